@@ -0,0 +1,123 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "fractal.h"
+#include "options.h"
+
+namespace {
+// Разбор списка значений через запятую
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+size_t getFileSize(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    return static_cast<size_t>(in.tellg());
+}
+
+double getSecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+}
+
+// Замер скорости и качества кодека: каждое изображение кодируется для всех сочетаний размера блока, режима поиска
+// и числа потоков, затем декодируется. Результат - одна CSV-таблица, строка на каждую итерацию декодирования
+int main(int argc, char* argv[]) {
+    const CCommandLineArguments args(argc, argv);
+    const auto& positional = args.Positional;
+    if (positional.empty() || positional.size() > 2) {
+        std::cerr << "Invalid number of arguments!" << std::endl;
+        return 1;
+    }
+    const std::string tablePath(positional[0]);
+    const std::string imagesFolder = positional.size() == 2 ? positional[1] : "./source_images";
+    const std::string encodedPath = tablePath + ".frac";
+
+    const std::vector<std::string> images = splitList(args.GetOption("images", "Lena,Boat,Goldhill"));
+    const std::vector<std::string> blockSizes = splitList(args.GetOption("block-sizes", "4,8,16"));
+    const std::vector<std::string> modes = splitList(args.GetOption("modes", "full,fast"));
+    const std::vector<std::string> threads = splitList(args.GetOption("threads", "1,0"));
+    CDecodeParameters decodeParameters;
+    // Детерминированная инициализация - метрики итераций воспроизводимы
+    decodeParameters.Initialization = DI_Bias;
+    try {
+        decodeParameters.MaxIterationsNumber = std::stoi(args.GetOption("iterations", "8"));
+    } catch(...) {
+        std::cerr << "Invalid --iterations option! Should define decode iterations number.";
+        return 1;
+    }
+
+    std::ofstream table;
+    table.open(tablePath);
+    table << "image,block_size,mode,threads,encode_s,candidates,candidates_per_s,bytes,mappings,bytes_per_mapping,"
+        "decode_s,iteration,psnr" << std::endl;
+    for (const std::string& imageName : images) {
+        const CGrayImage image(imagesFolder + "/" + imageName + ".bmp");
+        if (image.GetWidth() == 0 || image.GetHeight() == 0) {
+            std::cerr << "Can't read image " << imageName << std::endl;
+            continue;
+        }
+        for (const std::string& blockSizeOption : blockSizes) {
+            const int blockSize = std::stoi(blockSizeOption);
+            if (blockSize != 4 && blockSize != 8 && blockSize != 16) {
+                std::cerr << "Invalid block size " << blockSizeOption << " (4, 8 or 16 allowed)" << std::endl;
+                continue;
+            }
+            const size_t mappingsNumber = (GetPaddedSideSize(image.GetWidth(), blockSize) / blockSize) *
+                (GetPaddedSideSize(image.GetHeight(), blockSize) / blockSize);
+            for (const std::string& mode : modes) {
+                for (const std::string& threadsOption : threads) {
+                    const size_t threadsNumber = std::stoul(threadsOption);
+                    const auto encodeStart = std::chrono::steady_clock::now();
+                    CFractalImageCompressor encoder(image, blockSize, mode == "fast", threadsNumber);
+                    encoder.Compress(encodedPath);
+                    const double encodeTimeInSeconds = getSecondsSince(encodeStart);
+                    const uint64_t candidatesNumber = encoder.GetExaminedCandidatesNumber();
+                    const size_t bytesNumber = getFileSize(encodedPath);
+
+                    // Время декодирования меряется отдельно от подсчета метрик по итерациям
+                    CFractalImageDecompressor decoder(encodedPath, threadsNumber);
+                    const auto decodeStart = std::chrono::steady_clock::now();
+                    decoder.Decompress(decodeParameters);
+                    const double decodeTimeInSeconds = getSecondsSince(decodeStart);
+                    std::vector<double> iterationsPSNR;
+                    CDecodeParameters measuredParameters = decodeParameters;
+                    measuredParameters.IterationCallback = [&](size_t, const CGrayImage& retrieved) {
+                        iterationsPSNR.push_back(CalculateMetrics(retrieved, image).PSNR);
+                    };
+                    decoder.Decompress(measuredParameters);
+
+                    for (size_t iteration = 0; iteration < iterationsPSNR.size(); ++iteration) {
+                        table << imageName << ',' << blockSize << ',' << mode << ',' << threadsNumber << ','
+                            << encodeTimeInSeconds << ',' << candidatesNumber << ','
+                            << candidatesNumber / encodeTimeInSeconds << ',' << bytesNumber << ','
+                            << mappingsNumber << ',' << static_cast<double>(bytesNumber) / mappingsNumber << ','
+                            << decodeTimeInSeconds << ',' << iteration << ',' << iterationsPSNR[iteration] << '\n';
+                    }
+                    table.flush();
+                    std::cout << imageName << " R=" << blockSize << ' ' << mode << " threads=" << threadsNumber
+                        << ": encode " << encodeTimeInSeconds << " s, " << bytesNumber << " bytes, PSNR "
+                        << (iterationsPSNR.empty() ? 0.0 : iterationsPSNR.back()) << std::endl;
+                }
+            }
+        }
+    }
+    table.close();
+    std::remove(encodedPath.c_str());
+
+    return 0;
+}
@@ -1,64 +1,142 @@
+#include <algorithm>
 #include <iostream>
-#include <time.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
 
 #include "image.h"
 #include "fractal.h"
+#include "options.h"
 
 int main(int argc, char* argv[]) {
-    if (argc < 3 || argc > 6) {
+    const CCommandLineArguments args(argc, argv);
+    const auto& positional = args.Positional;
+    if (positional.size() < 2 || positional.size() > 5) {
         std::cerr << "Invalid number of arguments!" << std::endl;
+        return 1;
     }
-    const std::string encodedBinaryPath(argv[1]);
-    const std::string resultImagePath = std::string(argv[2]) + ".bmp";
-    const std::string resultMetricPath = std::string(argv[2]) + ".txt";
+    const std::string encodedBinaryPath(positional[0]);
+    const std::string resultImagePath = positional[1] + ".bmp";
+    const std::string resultMetricPath = positional[1] + ".txt";
 
     CGrayImage gray;
-    if (argc >= 4) {
-        gray.LoadFromFile(argv[3]);
+    if (positional.size() >= 3) {
+        gray.LoadFromFile(positional[2]);
     }
 
     std::string resultsFolder;
-    if (argc >= 5) {
-        resultsFolder = std::string(argv[4]);
+    if (positional.size() >= 4) {
+        resultsFolder = positional[3];
     }
 
-    size_t decodeIterationsNumber = 8;
-    if (argc == 6) {
+    CDecodeParameters decodeParameters;
+    if (positional.size() == 5) {
         try {
-            decodeIterationsNumber = std::stoi(argv[5]);
+            decodeParameters.MaxIterationsNumber = std::stoi(positional[4]);
         } catch(...) {
             std::cerr << "Invalid fourth argument! Should define iterations number (8 by default).";
         }
     }
+    if (args.HasOption("epsilon")) {
+        try {
+            decodeParameters.Epsilon = std::stod(args.GetOption("epsilon"));
+        } catch(...) {
+            std::cerr << "Invalid --epsilon option! Should define mean absolute pixel change to stop at.";
+        }
+    }
+    decodeParameters.IsInPlace = args.HasOption("in-place");
+    if (args.HasOption("scale")) {
+        // Масштаб задается степенью двойки: 0.25, 0.5, 1, 2, 4
+        double scaleLog2 = 0.0;
+        try {
+            scaleLog2 = std::log2(std::stod(args.GetOption("scale")));
+        } catch(...) {
+            scaleLog2 = 0.5;
+        }
+        // Уменьшение ограничено наибольшим блоком R (16), точнее его проверяет декодер по размеру блока файла
+        if (!std::isfinite(scaleLog2) || scaleLog2 != std::round(scaleLog2) ||
+            scaleLog2 > CDecodeParameters::MaxScaleLog2 || scaleLog2 < -4)
+        {
+            std::cerr << "Invalid --scale option! Should be a power of two (0.25, 0.5, 1, 2 or 4).";
+            return 1;
+        }
+        decodeParameters.ScaleLog2 = static_cast<int>(scaleLog2);
+    }
+    if (args.HasOption("roi")) {
+        // Область интереса задается как x,y,ширина,высота в пикселях исходного изображения
+        CImageTile& region = decodeParameters.RegionOfInterest;
+        if (std::sscanf(args.GetOption("roi").c_str(), "%zu,%zu,%zu,%zu",
+            &region.Left, &region.Top, &region.Width, &region.Height) != 4 || region.Width == 0 || region.Height == 0)
+        {
+            std::cerr << "Invalid --roi option! Should be x,y,width,height.";
+            return 1;
+        }
+    }
+    const std::string initialization = args.GetOption("init", "random");
+    if (initialization == "mean") {
+        decodeParameters.Initialization = DI_Mean;
+    } else if (initialization == "bias") {
+        decodeParameters.Initialization = DI_Bias;
+    } else if (initialization != "random") {
+        std::cerr << "Invalid --init option! Should be random, mean or bias.";
+    }
+    size_t threadsNumber = 0;
+    if (args.HasOption("threads")) {
+        try {
+            threadsNumber = std::stoi(args.GetOption("threads"));
+        } catch(...) {
+            std::cerr << "Invalid --threads option! Should define threads number (0 for all cores).";
+        }
+    }
 
-    const time_t decodeStart = clock();
-    CFractalImageDecompressor decoder(encodedBinaryPath);
-    std::shared_ptr<CGrayImage> retrieved = decoder.Decompress(decodeIterationsNumber, resultsFolder, gray);
-    const time_t decodeEnd = clock();
+    try {
+        // Декодирование многопоточное, поэтому меряем реальное время, а не процессорное
+        const auto decodeStart = std::chrono::steady_clock::now();
+        CFractalImageDecompressor decoder(encodedBinaryPath, threadsNumber);
+        std::shared_ptr<CGrayImage> retrieved = decoder.Decompress(decodeParameters, resultsFolder, gray);
+        // Для цветного изображения восстанавливаются и цветоразностные плоскости, метрики считаются по яркости
+        std::shared_ptr<CGrayImage> blueChroma;
+        std::shared_ptr<CGrayImage> redChroma;
+        if (decoder.IsColor()) {
+            blueChroma = decoder.DecompressChroma(decodeParameters, 0);
+            redChroma = decoder.DecompressChroma(decodeParameters, 1);
+        }
+        const auto decodeEnd = std::chrono::steady_clock::now();
 
-    const auto decodeTimeDiff = static_cast<double>(decodeEnd - decodeStart);
-    const auto decodeTimeInSeconds = decodeTimeDiff / CLOCKS_PER_SEC;
-    const auto decodeRelativeTime = decodeTimeInSeconds / (size * size) / 1000;
-    const auto decodeTimePerIteration = decodeTimeInSeconds / decodeIterationsNumber;
-    const auto decodeRelativeTimePerIteration = decodeRelativeTime / decodeIterationsNumber;
+        const auto decodeTimeInSeconds = std::chrono::duration<double>(decodeEnd - decodeStart).count();
+        const auto decodeRelativeTime = decodeTimeInSeconds / (decoder.GetWidth() * decoder.GetHeight()) / 1000;
+        const size_t decodeIterationsNumber = std::max<size_t>(decoder.GetIterationsNumber(), 1);
+        const auto decodeTimePerIteration = decodeTimeInSeconds / decodeIterationsNumber;
+        const auto decodeRelativeTimePerIteration = decodeRelativeTime / decodeIterationsNumber;
 
-    std::cout.precision(3);
-    std::cout << "Decode full time: " << decodeTimeInSeconds << " seconds" << std::endl;
-    std::cout << "Decode relative time: " << decodeRelativeTime << " msec/MP" << std::endl;
-    std::cout << "Decode one iteration time: " << decodeTimePerIteration << " seconds" << std::endl;
-    std::cout << "Decode one iteration relative time: " << decodeRelativeTimePerIteration << " msec/MP" << std::endl;
+        std::cout.precision(3);
+        std::cout << "Decode iterations: " << decoder.GetIterationsNumber() << std::endl;
+        std::cout << "Decode full time: " << decodeTimeInSeconds << " seconds" << std::endl;
+        std::cout << "Decode relative time: " << decodeRelativeTime << " msec/MP" << std::endl;
+        std::cout << "Decode one iteration time: " << decodeTimePerIteration << " seconds" << std::endl;
+        std::cout << "Decode one iteration relative time: " << decodeRelativeTimePerIteration << " msec/MP"
+            << std::endl;
 
-    if (!gray.IsEmpty()) {
-        const CMetrics& resultMetrics = CalculateMetrics(*retrieved, gray);
-        std::cout << "MSE: " << resultMetrics.MSE << std::endl;
-        std::cout << "PSNR: " << resultMetrics.PSNR << std::endl;
-        std::ofstream out;
-        out.open(resultMetricPath);
-        out << resultMetrics.PSNR << std::endl;
-        out.close();
+        // Метрики имеют смысл только для результата в исходном разрешении
+        if (!gray.IsEmpty() && gray.GetWidth() == retrieved->GetWidth() && gray.GetHeight() == retrieved->GetHeight()) {
+            const CMetrics& resultMetrics = CalculateMetrics(*retrieved, gray);
+            std::cout << "MSE: " << resultMetrics.MSE << std::endl;
+            std::cout << "PSNR: " << resultMetrics.PSNR << std::endl;
+            std::ofstream out;
+            out.open(resultMetricPath);
+            out << resultMetrics.PSNR << std::endl;
+            out.close();
+        }
+        if (decoder.IsColor()) {
+            SaveYCbCrToFile(resultImagePath, *retrieved, *blueChroma, *redChroma);
+        } else {
+            retrieved->SaveToFile(resultImagePath);
+        }
+    } catch(const std::exception& exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
     }
-    retrieved->SaveToFile(resultImagePath);
 
     return 0;
-}
+}
\ No newline at end of file
@@ -1,43 +1,140 @@
 #include <iostream>
-#include <time.h>
+#include <chrono>
 #include "image.h"
 #include "fractal.h"
+#include "options.h"
 
 int main(int argc, char* argv[]) {
-    if (argc < 3 || argc > 5) {
+    const CCommandLineArguments args(argc, argv);
+    const auto& positional = args.Positional;
+    if (positional.size() < 2 || positional.size() > 4) {
         std::cerr << "Invalid number of arguments!" << std::endl;
+        return 1;
     }
-    const std::string srcImagePath(argv[1]);
-    const std::string dstBinPath(argv[2]);
+    const std::string srcImagePath(positional[0]);
+    const std::string dstBinPath(positional[1]);
 
     size_t rBlockSize = 4;
-    if (argc >= 4) {
+    if (positional.size() >= 3) {
         try {
-            rBlockSize = std::stoi(argv[3]);
+            rBlockSize = std::stoi(positional[2]);
         } catch(...) {
-            std::cerr << "Invalid third argument! Should define R block size (4 or 8 allowed).";
+            std::cerr << "Invalid third argument! Should define R block size (4, 8 or 16 allowed).";
+        }
+        if (rBlockSize != 4 && rBlockSize != 8 && rBlockSize != 16) {
+            std::cerr << "Invalid third argument! Should define R block size (4, 8 or 16 allowed).";
+            return 1;
         }
     }
     bool isFastModeEnabled = false;
-    if (argc == 5) {
-        if (std::string(argv[4]) != "FastMode") {
+    if (positional.size() == 4) {
+        if (positional[3] != "FastMode") {
             std::cerr << "Invalid fourth argument! Should be \"FastMode\" for fast mode or not provided for default mode.";
         }
         isFastModeEnabled = true;
     }
+    size_t threadsNumber = 0;
+    if (args.HasOption("threads")) {
+        try {
+            threadsNumber = std::stoi(args.GetOption("threads"));
+        } catch(...) {
+            std::cerr << "Invalid --threads option! Should define threads number (0 for all cores).";
+        }
+    }
+
+    double timeBudgetInSeconds = 0.0;
+    if (args.HasOption("time-budget")) {
+        try {
+            timeBudgetInSeconds = std::stod(args.GetOption("time-budget"));
+        } catch(...) {
+            std::cerr << "Invalid --time-budget option! Should define encode time budget in seconds.";
+        }
+    }
+    // Пул блоков D: шаг решетки в пикселях и ограничение числа блоков на тайл
+    int domainStep = 1;
+    size_t maxDomainsNumber = 0;
+    try {
+        domainStep = std::stoi(args.GetOption("domain-step", "1"));
+        maxDomainsNumber = std::stoul(args.GetOption("domain-pool", "0"));
+    } catch(...) {
+        std::cerr << "Invalid --domain-step or --domain-pool option! Should define D blocks lattice step and pool size.";
+    }
+    // Шаг решетки - степень двойки не больше размера блока D
+    if (domainStep <= 0 || domainStep > 2 * static_cast<int>(rBlockSize) || (domainStep & (domainStep - 1)) != 0) {
+        std::cerr << "Invalid --domain-step option! Should be a power of two not greater than D block size.";
+        return 1;
+    }
+    // Статистика поиска сохраняется рядом с .frac, если не указан другой путь
+    std::string statsPath;
+    if (args.HasOption("stats")) {
+        statsPath = args.GetOption("stats");
+        if (statsPath.empty()) {
+            statsPath = dstBinPath + ".stats.csv";
+        }
+    }
 
-    CGrayImage gray(srcImagePath);
-    const time_t encodeStart = clock();
-    CFractalImageCompressor encoder(gray, rBlockSize, isFastModeEnabled);
-    encoder.Compress(dstBinPath);
-    const time_t encodeEnd = clock();
+    // Цветное изображение кодируется как яркость и две уменьшенные вдвое цветоразностные плоскости
+    const bool isColor = args.HasOption("color");
+    CGrayImage gray;
+    CGrayImage blueChroma;
+    CGrayImage redChroma;
+    if (isColor) {
+        LoadYCbCrFromFile(srcImagePath, gray, blueChroma, redChroma);
+    } else {
+        gray.LoadFromFile(srcImagePath);
+    }
+    // Нечитаемое изображение загружается как 0x0
+    if (gray.GetWidth() == 0 || gray.GetHeight() == 0) {
+        std::cerr << "Can't read " << srcImagePath << std::endl;
+        return 1;
+    }
+    // Инкрементальное кодирование относительно предыдущего кадра последовательности
+    const bool isIncremental = args.HasOption("prev-encoded") && args.HasOption("prev-image");
+    CGrayImage previousGray;
+    if (isIncremental && isColor) {
+        CGrayImage previousBlueChroma;
+        CGrayImage previousRedChroma;
+        LoadYCbCrFromFile(args.GetOption("prev-image"), previousGray, previousBlueChroma, previousRedChroma);
+    } else if (isIncremental) {
+        previousGray.LoadFromFile(args.GetOption("prev-image"));
+    }
+    double lossTolerance = 0.0;
+    if (args.HasOption("tolerance")) {
+        try {
+            lossTolerance = std::stod(args.GetOption("tolerance"));
+        } catch(...) {
+            std::cerr << "Invalid --tolerance option! Should define allowed per-pixel loss growth.";
+        }
+    }
+    // Кодирование многопоточное, поэтому меряем реальное время, а не процессорное
+    const auto encodeStart = std::chrono::steady_clock::now();
+    CFractalImageCompressor encoder(gray, rBlockSize, isFastModeEnabled, threadsNumber, timeBudgetInSeconds);
+    try {
+        if (isColor) {
+            encoder.SetChromaPlanes(blueChroma, redChroma);
+        }
+        if (domainStep != 1 || maxDomainsNumber != 0) {
+            encoder.SetDomainPool(domainStep, maxDomainsNumber);
+        }
+        // Предыдущий кадр может не подойти по размерам или параметрам кодирования
+        if (isIncremental) {
+            encoder.SetPreviousFrame(args.GetOption("prev-encoded"), previousGray, lossTolerance);
+        }
+        encoder.Compress(dstBinPath, statsPath);
+    } catch(const std::exception& exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+    const auto encodeEnd = std::chrono::steady_clock::now();
 
-    const auto encodeTimeDiff = static_cast<double>(encodeEnd - encodeStart);
-    const auto encodeTimeInSeconds = encodeTimeDiff / CLOCKS_PER_SEC;
-    const auto encodeRelativeTime = encodeTimeInSeconds / (size * size) / 1000;
+    const auto encodeTimeInSeconds = std::chrono::duration<double>(encodeEnd - encodeStart).count();
+    const auto encodeRelativeTime = encodeTimeInSeconds / (gray.GetWidth() * gray.GetHeight()) / 1000;
     std::cout.precision(3);
     std::cout << "Encode full time: " << encodeTimeInSeconds << " seconds" << std::endl;
     std::cout << "Encode relative time: " << encodeRelativeTime << " msec/MP" << std::endl;
+    if (isIncremental) {
+        std::cout << "Searched R blocks: " << encoder.GetSearchedRBlocksNumber() << std::endl;
+    }
 
     return 0;
-}
+}
\ No newline at end of file
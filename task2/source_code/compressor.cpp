@@ -1,6 +1,14 @@
 #include "fractal.h"
+#include "frac_format.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <fstream>
+#include <functional>
+#include <stdexcept>
 
 namespace {
 // Порядок укладки подблоков для правильной ориентации блока
@@ -38,263 +46,726 @@ inline uint8_t calculateHash(const int* avgIntensities, int fullIntensity,
     }
     return hash;
 }
+
+// Дополнение изображения до нужных размеров повторением крайних пикселей
+void padImage(const CGrayImage& srcImage, CGrayImage& paddedImage) {
+    const size_t srcWidth = srcImage.GetWidth();
+    const size_t srcHeight = srcImage.GetHeight();
+    const size_t paddedWidth = paddedImage.GetWidth();
+    const size_t paddedHeight = paddedImage.GetHeight();
+    auto paddedRowBuffer = paddedImage.GetBuffer();
+    for (size_t rowIndex = 0; rowIndex < paddedHeight; ++rowIndex, paddedRowBuffer += paddedWidth) {
+        const uint8_t* srcRowBuffer = srcImage.GetBuffer() + std::min(rowIndex, srcHeight - 1) * srcWidth;
+        for (size_t columnIndex = 0; columnIndex < paddedWidth; ++columnIndex) {
+            paddedRowBuffer[columnIndex] = srcRowBuffer[std::min(columnIndex, srcWidth - 1)];
+        }
+    }
 }
 
+// Уменьшение изображения вдвое по каждой стороне усреднением квадратов 2x2
+void downsampleImage(const CGrayImage& srcImage, CGrayImage& downsampledImage) {
+    const size_t srcWidth = srcImage.GetWidth();
+    const size_t width = downsampledImage.GetWidth();
+    const size_t height = downsampledImage.GetHeight();
+    assert(2 * width <= srcWidth && 2 * height <= srcImage.GetHeight());
+    for (size_t rowIndex = 0; rowIndex < height; ++rowIndex) {
+        const uint8_t* topRow = srcImage.GetBuffer() + 2 * rowIndex * srcWidth;
+        const uint8_t* botRow = topRow + srcWidth;
+        uint8_t* downsampledRow = downsampledImage.GetBuffer() + rowIndex * width;
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+            downsampledRow[columnIndex] = static_cast<uint8_t>((topRow[2 * columnIndex] + topRow[2 * columnIndex + 1] +
+                botRow[2 * columnIndex] + botRow[2 * columnIndex + 1] + 2) / 4);
+        }
+    }
+}
+
+// Разбиение стороны из blocksNumber блоков на partsNumber почти равных частей
+inline size_t getPartBlocksNumber(size_t blocksNumber, size_t partsNumber, size_t partIndex) {
+    return blocksNumber / partsNumber + (partIndex < blocksNumber % partsNumber ? 1 : 0);
+}
+}
+
+size_t GetPaddedSideSize(size_t sideSize, int rBlockSize) {
+    const size_t minSideSize = std::max<size_t>(sideSize, 2 * rBlockSize);
+    return (minSideSize + rBlockSize - 1) / rBlockSize * rBlockSize;
+}
+
+std::vector<CImageTile> SplitIntoTiles(size_t paddedWidth, size_t paddedHeight, int rBlockSize) {
+    assert(paddedWidth % rBlockSize == 0 && paddedHeight % rBlockSize == 0);
+    const size_t blocksPerRow = paddedWidth / rBlockSize;
+    const size_t blocksPerColumn = paddedHeight / rBlockSize;
+    const size_t tilesPerRow = (paddedWidth + MaxTileSize - 1) / MaxTileSize;
+    const size_t tilesPerColumn = (paddedHeight + MaxTileSize - 1) / MaxTileSize;
+
+    std::vector<CImageTile> tiles;
+    tiles.reserve(tilesPerRow * tilesPerColumn);
+    size_t top = 0;
+    for (size_t tileRow = 0; tileRow < tilesPerColumn; ++tileRow) {
+        const size_t tileHeight = getPartBlocksNumber(blocksPerColumn, tilesPerColumn, tileRow) * rBlockSize;
+        size_t left = 0;
+        for (size_t tileColumn = 0; tileColumn < tilesPerRow; ++tileColumn) {
+            const size_t tileWidth = getPartBlocksNumber(blocksPerRow, tilesPerRow, tileColumn) * rBlockSize;
+            tiles.push_back({left, top, tileWidth, tileHeight});
+            left += tileWidth;
+        }
+        top += tileHeight;
+    }
+    return tiles;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
 CFractalImageCompressor::CFractalImageCompressor(const CGrayImage& toCompress, int _rBlockSize,
-        bool _isFastModeEnabled) :
+        bool _isFastModeEnabled, size_t _threadsNumber, double _timeBudgetInSeconds) :
     isFastModeEnabled(_isFastModeEnabled),
-    srcBuffer(toCompress.GetBuffer()),
     rBlockSize(_rBlockSize),
-    dBlockSize(2 * rBlockSize),
-    rBlockArea(rBlockSize * rBlockSize),
-    rBlocksPerSide(size / rBlockSize),
-    rBlocksNumber(rBlocksPerSide * rBlocksPerSide),
-    dBlocksNumberRoot(size - dBlockSize + 1),
-    dBlocksNumber(dBlocksNumberRoot * dBlocksNumberRoot),
-    downDValues(new uint8_t[rBlockArea * dBlocksNumber]),
-    downDSumTable(new int32_t[dBlocksNumber]),
-    downDSqSumTable(new int32_t[dBlocksNumber]),
-    rBlockLines(new const uint8_t*[rBlockSize]),
-    dBlockLines(new const uint8_t*[rBlockSize]),
-    rBlockMappings(new RDBlockMapping[rBlocksNumber])
+    threadsNumber(_threadsNumber),
+    timeBudgetInSeconds(_timeBudgetInSeconds),
+    width(toCompress.GetWidth()),
+    height(toCompress.GetHeight()),
+    srcImage(&toCompress)
+{
+    if (rBlockSize != 4 && rBlockSize != 8 && rBlockSize != 16) {
+        throw std::invalid_argument("Unsupported R block size " + std::to_string(rBlockSize));
+    }
+    if (width == 0 || height == 0) {
+        throw std::invalid_argument("Image to compress is empty");
+    }
+    const size_t paddedWidth = GetPaddedSideSize(width, rBlockSize);
+    const size_t paddedHeight = GetPaddedSideSize(height, rBlockSize);
+    if (paddedWidth != width || paddedHeight != height) {
+        new(&paddedImage) CGrayImage(paddedHeight, paddedWidth);
+        padImage(toCompress, paddedImage);
+        srcImage = &paddedImage;
+    }
+    tiles = SplitIntoTiles(paddedWidth, paddedHeight, rBlockSize);
+    size_t mappingsNumber = 0;
+    for (const auto& tile : tiles) {
+        tileMappingsOffsets.push_back(mappingsNumber);
+        mappingsNumber += (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
+    }
+    rBlockMappings.resize(mappingsNumber);
+    tileStreams.resize(tiles.size());
+}
+
+void CFractalImageCompressor::Compress(const std::string& pathToSave, const std::string& pathToSaveStats) {
+    typedef std::chrono::steady_clock TClock;
+    if (!pathToSaveStats.empty()) {
+        searchStats.resize(rBlockMappings.size());
+    }
+    const bool hasTimeBudget = timeBudgetInSeconds > 0.0;
+    const auto deadline = TClock::now() +
+        std::chrono::duration_cast<TClock::duration>(std::chrono::duration<double>(timeBudgetInSeconds));
+    const size_t workersNumber = std::min(GetThreadsNumber(threadsNumber), tiles.size());
+    std::atomic<size_t> startedTilesNumber{0};
+    searchedRBlocksNumber = 0;
+    examinedCandidatesNumber = 0;
+
+    ParallelFor(tiles.size(), threadsNumber, [&](size_t tileIndex) {
+        RDBlockMapping* tileMappings = rBlockMappings.data() + tileMappingsOffsets[tileIndex];
+        CRBlockSearchStats* tileStats = searchStats.empty() ? nullptr : searchStats.data() + tileMappingsOffsets[tileIndex];
+        // Оставшийся бюджет делится поровну между "раундами" еще не начатых тайлов
+        TClock::time_point tileDeadline;
+        if (hasTimeBudget) {
+            const size_t remainingTilesNumber = tiles.size() - startedTilesNumber++;
+            const size_t remainingRoundsNumber = (remainingTilesNumber + workersNumber - 1) / workersNumber;
+            const auto now = TClock::now();
+            tileDeadline = (now < deadline) ? now + (deadline - now) / static_cast<long>(remainingRoundsNumber) : now;
+        }
+        const TClock::time_point* tileDeadlinePtr = hasTimeBudget ? &tileDeadline : nullptr;
+        // Выбор специализации под размер блока - единственное место диспетчеризации в рантайме
+        const bool isIncremental = !previousMappings.empty();
+        switch (rBlockSize) {
+            case 4:
+                isIncremental ? compressTileIncrementally<4>(tileIndex, tileMappings, tileStats) :
+                    compressTile<4>(tiles[tileIndex], tileMappings, tileStats, tileDeadlinePtr);
+                break;
+            case 8:
+                isIncremental ? compressTileIncrementally<8>(tileIndex, tileMappings, tileStats) :
+                    compressTile<8>(tiles[tileIndex], tileMappings, tileStats, tileDeadlinePtr);
+                break;
+            case 16:
+                isIncremental ? compressTileIncrementally<16>(tileIndex, tileMappings, tileStats) :
+                    compressTile<16>(tiles[tileIndex], tileMappings, tileStats, tileDeadlinePtr);
+                break;
+            default:
+                // Размер блока проверен в конструкторе, исключение из потока-обработчика здесь недопустимо
+                break;
+        }
+        const int planesNumber = getPlanesNumber();
+        EncodeTileMappings(tileMappings, tiles[tileIndex], rBlockSize, domainStep,
+            tileStreams[tileIndex * planesNumber]);
+        for (int chromaPlane = 0; chromaPlane + 1 < planesNumber; ++chromaPlane) {
+            fitTileChroma(tileIndex, chromaPlane);
+            EncodeTileChromaMappings(chromaMappings[chromaPlane].data() + tileMappingsOffsets[tileIndex],
+                tiles[tileIndex], rBlockSize, tileStreams[tileIndex * planesNumber + 1 + chromaPlane]);
+        }
+    });
+    saveToBinaryFile(pathToSave);
+    if (!pathToSaveStats.empty()) {
+        saveSearchStats(pathToSaveStats);
+    }
+}
+
+void CFractalImageCompressor::SetPreviousFrame(const std::string& pathToPreviousEncoded,
+    const CGrayImage& _previousImage, double _lossTolerance)
+{
+    std::ifstream in;
+    in.open(pathToPreviousEncoded, std::ios::binary);
+    const CFracHeader header = ReadFracHeader(in);
+    if (header.RBlockSize != rBlockSize || header.DomainStep != domainStep || header.Width != width ||
+        header.Height != height || _previousImage.GetWidth() != width || _previousImage.GetHeight() != height ||
+        header.Tiles.size() != tiles.size())
+    {
+        throw std::runtime_error("Previous frame is incompatible with the current one");
+    }
+    previousMappings.resize(rBlockMappings.size());
+    for (size_t tileIndex = 0; tileIndex < tiles.size(); ++tileIndex) {
+        in.seekg(header.Tiles[tileIndex].StreamOffsets[0]);
+        DecodeTileMappings(in, tiles[tileIndex], rBlockSize, header.DomainStep,
+            previousMappings.data() + tileMappingsOffsets[tileIndex]);
+    }
+    // Предыдущее изображение дополняется так же, как текущее
+    new(&previousImage) CGrayImage(srcImage->GetHeight(), srcImage->GetWidth());
+    padImage(_previousImage, previousImage);
+    lossTolerance = _lossTolerance;
+}
+
+void CFractalImageCompressor::SetChromaPlanes(const CGrayImage& blueChroma, const CGrayImage& redChroma) {
+    const CGrayImage* srcChromaPlanes[ChromaPlanesNumber] = {&blueChroma, &redChroma};
+    for (int chromaPlane = 0; chromaPlane < ChromaPlanesNumber; ++chromaPlane) {
+        const CGrayImage& srcPlane = *srcChromaPlanes[chromaPlane];
+        if (srcPlane.GetWidth() != width || srcPlane.GetHeight() != height) {
+            throw std::invalid_argument("Chroma planes should have the same size as the luma plane");
+        }
+        // Плоскость дополняется так же, как яркость, и уменьшается усреднением квадратов 2x2
+        CGrayImage paddedPlane(srcImage->GetHeight(), srcImage->GetWidth());
+        padImage(srcPlane, paddedPlane);
+        CGrayImage(paddedPlane.GetHeight() / 2, paddedPlane.GetWidth() / 2).SwapImage(chromaPlanes[chromaPlane]);
+        downsampleImage(paddedPlane, chromaPlanes[chromaPlane]);
+        chromaMappings[chromaPlane].resize(rBlockMappings.size());
+    }
+    tileStreams.resize(tiles.size() * getPlanesNumber());
+}
+
+void CFractalImageCompressor::SetDomainPool(int _domainStep, size_t _maxDomainsNumber) {
+    if (_domainStep <= 0 || _domainStep > 2 * rBlockSize || (_domainStep & (_domainStep - 1)) != 0) {
+        throw std::invalid_argument("Domain step should be a power of two not greater than the D block size");
+    }
+    domainStep = _domainStep;
+    maxDomainsNumber = _maxDomainsNumber;
+}
+
+// Кодирование одного тайла специализацией под размер блока
+template<int RBlockSize>
+void CFractalImageCompressor::compressTile(const CImageTile& tile, RDBlockMapping* tileMappings,
+    CRBlockSearchStats* tileStats, const std::chrono::steady_clock::time_point* deadline)
+{
+    CFractalTileCompressor<RBlockSize> tileCompressor(srcImage->GetBuffer(), srcImage->GetWidth(), tile,
+        isFastModeEnabled, domainStep, maxDomainsNumber);
+    if (deadline == nullptr) {
+        tileCompressor.Compress(tileMappings, tileStats);
+    } else {
+        tileCompressor.CompressUntil(*deadline, tileMappings, tileStats);
+    }
+    searchedRBlocksNumber += (tile.Width / RBlockSize) * (tile.Height / RBlockSize);
+    examinedCandidatesNumber += tileCompressor.GetExaminedCandidatesNumber();
+}
+
+// Инкрементальное кодирование тайла: старые отображения проверяются на новом изображении,
+// поиск (и предпосчеты по тайлу) выполняются только если нашлись блоки, для которых старое отображение не годится
+template<int RBlockSize>
+void CFractalImageCompressor::compressTileIncrementally(size_t tileIndex, RDBlockMapping* tileMappings,
+    CRBlockSearchStats* tileStats)
+{
+    typedef CFractalTileCompressor<RBlockSize> TTileCompressor;
+    const CImageTile& tile = tiles[tileIndex];
+    const size_t stride = srcImage->GetWidth();
+    const size_t tileOffset = tile.Top * stride + tile.Left;
+    const uint8_t* tileBuffer = srcImage->GetBuffer() + tileOffset;
+    const uint8_t* previousTileBuffer = previousImage.GetBuffer() + tileOffset;
+    const RDBlockMapping* tilePreviousMappings = previousMappings.data() + tileMappingsOffsets[tileIndex];
+    const size_t rBlocksPerRow = tile.Width / RBlockSize;
+    const size_t rBlocksNumber = rBlocksPerRow * (tile.Height / RBlockSize);
+    const int64_t allowedLossGrowth = static_cast<int64_t>(lossTolerance * RBlockSize * RBlockSize);
+
+    std::vector<size_t> changedRBlocks;
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        const size_t rBlockRow = rBlockIndex / rBlocksPerRow;
+        const size_t rBlockColumn = rBlockIndex % rBlocksPerRow;
+        const RDBlockMapping& mapping = tilePreviousMappings[rBlockIndex];
+        const int64_t loss = TTileCompressor::CalculateMappingLoss(tileBuffer, stride, rBlockRow, rBlockColumn, mapping);
+        const int64_t previousLoss = TTileCompressor::CalculateMappingLoss(previousTileBuffer, stride,
+            rBlockRow, rBlockColumn, mapping);
+        if (loss <= previousLoss + allowedLossGrowth) {
+            tileMappings[rBlockIndex] = mapping;
+            if (tileStats != nullptr) {
+                tileStats[rBlockIndex] = CRBlockSearchStats{};
+                tileStats[rBlockIndex].WinningLoss = loss;
+            }
+        } else {
+            changedRBlocks.push_back(rBlockIndex);
+        }
+    }
+    if (!changedRBlocks.empty()) {
+        TTileCompressor tileCompressor(srcImage->GetBuffer(), stride, tile, isFastModeEnabled, domainStep,
+            maxDomainsNumber);
+        tileCompressor.CompressBlocks(changedRBlocks, tileMappings, tileStats);
+        searchedRBlocksNumber += changedRBlocks.size();
+        examinedCandidatesNumber += tileCompressor.GetExaminedCandidatesNumber();
+    }
+}
+
+// Подбор масштабов и сдвигов блоков тайла цветоразностной плоскости при прообразах яркости (в том виде,
+// в каком их восстановит декодер). Плоскость, тайл и блоки вдвое меньше яркостных, позиция блока D округляется
+// так же, как при восстановлении в половинном масштабе. Масштаб и сдвиг - решение МНК для одного блока
+void CFractalImageCompressor::fitTileChroma(size_t tileIndex, int chromaPlane) {
+    const CGrayImage& plane = chromaPlanes[chromaPlane];
+    const CImageTile& tile = tiles[tileIndex];
+    const int blockSize = rBlockSize / 2;
+    const int blockArea = blockSize * blockSize;
+    const size_t stride = plane.GetWidth();
+    const uint8_t* tileBuffer = plane.GetBuffer() + tile.Top / 2 * stride + tile.Left / 2;
+    const size_t maxDBlockX = tile.Width / 2 - 2 * blockSize;
+    const size_t maxDBlockY = tile.Height / 2 - 2 * blockSize;
+    const size_t blocksPerRow = tile.Width / rBlockSize;
+    const size_t blocksNumber = blocksPerRow * (tile.Height / rBlockSize);
+    const RDBlockMapping* lumaMappings = rBlockMappings.data() + tileMappingsOffsets[tileIndex];
+    RDBlockMapping* tileChromaMappings = chromaMappings[chromaPlane].data() + tileMappingsOffsets[tileIndex];
+    std::vector<uint8_t> downDBlock(blockArea);
+
+    for (size_t blockIndex = 0; blockIndex < blocksNumber; ++blockIndex) {
+        // При нулевом масштабе позиция и ориентация яркости не сохраняются, декодер получает нулевые
+        RDBlockMapping mapping{};
+        if (lumaMappings[blockIndex].Scale != 0) {
+            mapping = lumaMappings[blockIndex];
+        }
+        const uint8_t* rBlockBuffer = tileBuffer +
+            blockSize * (blockIndex / blocksPerRow * stride + blockIndex % blocksPerRow);
+        const uint8_t* dBlockBuffer = tileBuffer + std::min<size_t>((mapping.TopLeftY + 1) / 2, maxDBlockY) * stride +
+            std::min<size_t>((mapping.TopLeftX + 1) / 2, maxDBlockX);
+        for (int rowIndex = 0; rowIndex < blockSize; ++rowIndex) {
+            const uint8_t* topRow = dBlockBuffer + 2 * rowIndex * stride;
+            const uint8_t* botRow = topRow + stride;
+            for (int columnIndex = 0; columnIndex < blockSize; ++columnIndex) {
+                downDBlock[rowIndex * blockSize + columnIndex] = (topRow[2 * columnIndex] +
+                    topRow[2 * columnIndex + 1] + botRow[2 * columnIndex] + botRow[2 * columnIndex + 1] + 2) / 4;
+            }
+        }
+        const auto orientation = static_cast<TBlockOrientation>(mapping.Orientation);
+        int64_t dSum = 0;
+        int64_t rSum = 0;
+        int64_t dSquaresSum = 0;
+        int64_t convolution = 0;
+        for (int rowIndex = 0; rowIndex < blockSize; ++rowIndex) {
+            for (int columnIndex = 0; columnIndex < blockSize; ++columnIndex) {
+                const int dValue = downDBlock[GetOrientedIndex(orientation, blockSize, rowIndex, columnIndex)];
+                const int rValue = rBlockBuffer[rowIndex * stride + columnIndex];
+                dSum += dValue;
+                rSum += rValue;
+                dSquaresSum += dValue * dValue;
+                convolution += dValue * rValue;
+            }
+        }
+        // Масштаб в [0, 1), отрицательная корреляция и постоянный блок D дают нулевой масштаб
+        const int64_t dVariance = blockArea * dSquaresSum - dSum * dSum;
+        const int64_t covariance = blockArea * convolution - dSum * rSum;
+        int scale = 0;
+        if (dVariance > 0 && covariance > 0) {
+            scale = std::min(static_cast<int>(static_cast<double>(covariance) / dVariance *
+                RDBlockMapping::ScaleBase + 0.5), RDBlockMapping::ScaleBase - 1);
+        }
+        // Сдвиг - среднее отклонение с уже дискретизованным масштабом, как его применит декодер
+        int64_t residualSum = 0;
+        for (int rowIndex = 0; rowIndex < blockSize; ++rowIndex) {
+            for (int columnIndex = 0; columnIndex < blockSize; ++columnIndex) {
+                const int dValue = downDBlock[GetOrientedIndex(orientation, blockSize, rowIndex, columnIndex)];
+                residualSum += rBlockBuffer[rowIndex * stride + columnIndex] -
+                    (dValue * scale + RDBlockMapping::ScaleBase / 2) / RDBlockMapping::ScaleBase;
+            }
+        }
+        const long bias = std::lround(static_cast<double>(residualSum) / blockArea) - GetChromaBiasOffset(scale);
+        mapping.Scale = scale;
+        mapping.Bias = color_cast<int8_t>(bias, INT8_MIN, INT8_MAX);
+        tileChromaMappings[blockIndex] = mapping;
+    }
+}
+
+// Сериализация сжатого представления
+void CFractalImageCompressor::saveToBinaryFile(const std::string& pathToSave) const {
+    CFracHeader header;
+    header.RBlockSize = rBlockSize;
+    header.PlanesNumber = getPlanesNumber();
+    header.DomainStep = domainStep;
+    header.Width = width;
+    header.Height = height;
+    for (const auto& tile : tiles) {
+        header.Tiles.push_back({tile, {}, {}});
+    }
+    WriteFracFile(pathToSave, header, tileStreams);
+}
+
+// Сохранение статистики поиска - одна строка CSV на блок R
+void CFractalImageCompressor::saveSearchStats(const std::string& pathToSave) const {
+    std::ofstream out;
+    out.open(pathToSave);
+    out << "tile,x,y,variance,small_variance,examined,hash_skipped,scale_rejected,zero_denominator,loss,time_us" << std::endl;
+    for (size_t tileIndex = 0; tileIndex < tiles.size(); ++tileIndex) {
+        const CImageTile& tile = tiles[tileIndex];
+        const CRBlockSearchStats* stats = searchStats.data() + tileMappingsOffsets[tileIndex];
+        for (size_t y = tile.Top; y < tile.Top + tile.Height; y += rBlockSize) {
+            for (size_t x = tile.Left; x < tile.Left + tile.Width; x += rBlockSize, ++stats) {
+                out << tileIndex << ',' << x << ',' << y << ',' << stats->Variance << ',' << stats->IsVarianceSmall << ','
+                    << stats->CandidatesExamined << ',' << stats->HashMismatchSkipped << ',' << stats->ScaleRejected << ','
+                    << stats->ZeroDenominator << ',' << stats->WinningLoss << ',' << stats->SearchTimeUs << '\n';
+            }
+        }
+    }
+    out.close();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<int RBlockSize>
+CFractalTileCompressor<RBlockSize>::CFractalTileCompressor(const uint8_t* imageBuffer, size_t imageStride,
+        const CImageTile& tile, bool _isFastModeEnabled, int _domainStep, size_t maxDomainsNumber) :
+    isFastModeEnabled(_isFastModeEnabled),
+    domainStep(_domainStep),
+    srcBuffer(imageBuffer + tile.Top * imageStride + tile.Left),
+    srcStride(imageStride),
+    rBlocksPerRow(tile.Width / rBlockSize),
+    rBlocksPerColumn(tile.Height / rBlockSize),
+    rBlocksNumber(rBlocksPerRow * rBlocksPerColumn),
+    dBlocksPerRow((tile.Width - dBlockSize) / _domainStep + 1),
+    dBlocksPerColumn((tile.Height - dBlockSize) / _domainStep + 1),
+    dBlocksNumber(dBlocksPerRow * dBlocksPerColumn),
+    dBlocksPoolSize(maxDomainsNumber == 0 ? dBlocksNumber : std::min<int>(maxDomainsNumber, dBlocksNumber)),
+    downDValues(new uint8_t[rBlockArea * dBlocksPoolSize]),
+    downDSumTable(new int32_t[dBlocksPoolSize]),
+    downDSqSumTable(new int32_t[dBlocksPoolSize])
 {
-    assert(toCompress.GetWidth() == size);
-    assert(toCompress.GetHeight() == size);
-    assert(rBlockSize == 4 || rBlockSize == 8);
+    assert(tile.Width <= MaxTileSize && tile.Height <= MaxTileSize);
+    assert(tile.Width >= dBlockSize && tile.Height >= dBlockSize);
+    assert(tile.Width % rBlockSize == 0 && tile.Height % rBlockSize == 0);
+    assert(domainStep > 0 && domainStep <= dBlockSize);
+    if (dBlocksPoolSize < dBlocksNumber) {
+        selectDBlocksPool();
+    }
     prepareDownDValues();
     if (isFastModeEnabled) {
         precalculateDHashes();
     }
 }
 
-CFractalImageCompressor::~CFractalImageCompressor() {
+template<int RBlockSize>
+CFractalTileCompressor<RBlockSize>::~CFractalTileCompressor() {
     delete [] downDValues;
     delete [] downDSumTable;
     delete [] downDSqSumTable;
-    delete [] rBlockLines;
-    delete [] dBlockLines;
-    delete [] rBlockMappings;
     if (isFastModeEnabled) {
         delete [] hashes;
     }
 }
 
-void CFractalImageCompressor::Compress(const std::string& pathToSave) {
-    size_t rBlockIndex = 0;
-    for (size_t rBlockRow = 0; rBlockRow < rBlocksPerSide; ++rBlockRow) {
-        for (size_t rBlockColumn = 0; rBlockColumn < rBlocksPerSide; ++rBlockColumn, ++rBlockIndex) {
-            int rBlockSum = 0, rBlockSquaresSum = 0;
-            uint8_t hash = 0;
-            prepareRBlockStructs(rBlockRow, rBlockColumn, rBlockSum, rBlockSquaresSum, hash);
-            const int rBlockSumSquare = rBlockSum * rBlockSum;
-            const bool isRBlockVarSmall = (rBlockSquaresSum - rBlockSumSquare / rBlockArea) / rBlockArea < 10;
-
-            auto hashPtr = hashes;
-            int minLossValue = std::numeric_limits<int>::max();
-            size_t dBlockIndex = 0;
-            for (size_t dBlockRow = 0; dBlockRow < dBlocksNumberRoot; ++dBlockRow) {
-                for (size_t dBlockColumn = 0; dBlockColumn < dBlocksNumberRoot; ++dBlockColumn, ++dBlockIndex, hashPtr += BO_Count) {
-                    dBlockLines[0] = downDValues + dBlockIndex * rBlockArea;
-                    for (size_t rowIndex = 1; rowIndex < rBlockSize; ++rowIndex) {
-                        dBlockLines[rowIndex] = dBlockLines[rowIndex - 1] + rBlockSize;
-                    }
-                    const auto dBlockSum = downDSumTable[dBlockIndex];
-                    const auto dBlockSquaresSum = downDSqSumTable[dBlockIndex];
-                    const int scaleDenominator = rBlockArea * dBlockSquaresSum - dBlockSum * dBlockSum;
-                    if (scaleDenominator == 0) {
-                        const int currLoss = rBlockSquaresSum - rBlockSumSquare / rBlockArea;
-                        if (currLoss < minLossValue) {
-                            rBlockMappings[rBlockIndex].Scale = 0;
-                            rBlockMappings[rBlockIndex].Bias = rBlockSum / rBlockArea;
-                            rBlockMappings[rBlockIndex].Orientation = BO_Rot0;
-                            rBlockMappings[rBlockIndex].TopLeftX = dBlockColumn;
-                            rBlockMappings[rBlockIndex].TopLeftY = dBlockRow;
-                            minLossValue = currLoss;
-                        }
-                        continue;
-                    }
-                    const int sumsMultiplied = dBlockSum * rBlockSum;
-                    for (size_t dBlockOrientation = 0; dBlockOrientation < BO_Count; ++dBlockOrientation) {
-                        if (isFastModeEnabled && hashPtr[dBlockOrientation] != hash && !isRBlockVarSmall) {
-                            continue;
-                        }
-                        const auto orientation = static_cast<TBlockOrientation>(dBlockOrientation);
-                        const int blocksConv = getBlocksConvolution(orientation);
-                        const int scaleNumerator = rBlockArea * blocksConv - sumsMultiplied;
-                        const double scale = static_cast<double>(scaleNumerator) / scaleDenominator;
-                        if (scale >= 1.0 || scale < 0.0) {
-                            continue;
-                        }
-                        const int discretizedScale = static_cast<int>(scale * RDBlockMapping::ScaleBase);
-                        const int scaledDBlockSum = (dBlockSum * discretizedScale) / RDBlockMapping::ScaleBase;
-                        const int biasDiscretized = color_cast<int>((rBlockSum - scaledDBlockSum) / rBlockArea,
-                            std::numeric_limits<int8_t>::min(), std::numeric_limits<int8_t>::max());
-                        const int loss = rBlockSquaresSum + (dBlockSquaresSum * discretizedScale / RDBlockMapping::ScaleBase -
-                            2 * blocksConv + 2 * biasDiscretized * dBlockSum) * discretizedScale / RDBlockMapping::ScaleBase +
-                            biasDiscretized * (biasDiscretized * rBlockArea - 2 * rBlockSum);
-                        if (loss < minLossValue) {
-                            rBlockMappings[rBlockIndex].Scale = discretizedScale;
-                            rBlockMappings[rBlockIndex].Bias = biasDiscretized;
-                            rBlockMappings[rBlockIndex].Orientation = orientation;
-                            rBlockMappings[rBlockIndex].TopLeftX = dBlockColumn;
-                            rBlockMappings[rBlockIndex].TopLeftY = dBlockRow;
-                            minLossValue = loss;
-                        }
-                    }
-                }
-            }
-        }
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::Compress(RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats) {
+    rBlockMappings = tileMappings;
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        searchRBlock(rBlockIndex, 1, tileStats == nullptr ? nullptr : tileStats + rBlockIndex);
     }
-    saveToBinaryFile(pathToSave);
 }
 
-// Подготовка необходимых структур по текущему блоку R
-inline void CFractalImageCompressor::prepareRBlockStructs(size_t rBlockRow, size_t rBlockColumn, int& rBlockSum,
-    int& rBlockSquaresSum, uint8_t& hash)
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::CompressBlocks(const std::vector<size_t>& rBlockIndices,
+    RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats)
 {
-    rBlockLines[0] = srcBuffer + rBlockSize * (rBlockRow * size + rBlockColumn);
-    for (size_t lineIndex = 1; lineIndex < rBlockSize; ++lineIndex) {
-        rBlockLines[lineIndex] = rBlockLines[lineIndex - 1] + size;
+    rBlockMappings = tileMappings;
+    for (const size_t rBlockIndex : rBlockIndices) {
+        searchRBlock(rBlockIndex, 1, tileStats == nullptr ? nullptr : tileStats + rBlockIndex);
     }
-    for (size_t lineIndex = 0; lineIndex < rBlockSize; ++lineIndex) {
-        for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-            const uint8_t value = rBlockLines[lineIndex][columnIndex];
-            rBlockSum += value;
-            rBlockSquaresSum += value * value;
+}
+
+template<int RBlockSize>
+int64_t CFractalTileCompressor<RBlockSize>::CalculateMappingLoss(const uint8_t* tileBuffer, size_t stride,
+    size_t rBlockRow, size_t rBlockColumn, const RDBlockMapping& mapping)
+{
+    const uint8_t* rBlockBuffer = tileBuffer + rBlockSize * (rBlockRow * stride + rBlockColumn);
+    const uint8_t* dBlockBuffer = tileBuffer + mapping.TopLeftY * stride + mapping.TopLeftX;
+    const auto orientation = static_cast<TBlockOrientation>(mapping.Orientation);
+    // Уменьшенный блок D в порядке, в котором его пиксели сопоставляются пикселям блока R
+    uint8_t downDBlock[rBlockArea];
+    for (int rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
+        const uint8_t* topRow = dBlockBuffer + 2 * rowIndex * stride;
+        const uint8_t* botRow = topRow + stride;
+        for (int columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
+            downDBlock[rowIndex * rBlockSize + columnIndex] = (topRow[2 * columnIndex] + topRow[2 * columnIndex + 1] +
+                botRow[2 * columnIndex] + botRow[2 * columnIndex + 1] + 2) / 4;
         }
     }
-    if (isFastModeEnabled) {
-        int avgIntensities[4] = { 0, 0, 0, 0 };
-        const int fullIntensity = calculateIntensities(avgIntensities, rBlockLines[0], rBlockSize);
-        hash = calculateHash(avgIntensities, fullIntensity);
+    int64_t loss = 0;
+    for (int rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
+        for (int columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
+            const int intensity = downDBlock[GetOrientedIndex(orientation, rBlockSize, rowIndex, columnIndex)];
+            const int mapped = color_cast((intensity * mapping.Scale + RDBlockMapping::ScaleBase / 2) /
+                RDBlockMapping::ScaleBase + mapping.Bias);
+            const int difference = mapped - rBlockBuffer[rowIndex * stride + columnIndex];
+            loss += difference * difference;
+        }
     }
+    return loss;
 }
 
-// Свертка блоков D и R
-int CFractalImageCompressor::getBlocksConvolution(TBlockOrientation orientation) const {
-    int acc = 0;
-    switch (orientation) {
-        case BO_Rot0:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rowIndex][columnIndex];
-                }
-            }
-            break;
-        case BO_Rot90:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[columnIndex][rBlockSize - 1 - rowIndex];
-                }
-            }
-            break;
-        case BO_Rot180:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rBlockSize - 1 - rowIndex][rBlockSize - 1 - columnIndex];
-                }
-            }
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::CompressUntil(std::chrono::steady_clock::time_point deadline,
+    RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats)
+{
+    rBlockMappings = tileMappings;
+    // 1. Дешевое отображение для каждого блока - поиск только по непересекающимся блокам D
+    // (шаг по решетке - в шагах решетки)
+    const size_t cheapSearchStep = std::max(1, dBlockSize / domainStep);
+    std::vector<std::pair<int64_t, size_t>> lossesWithIndices(rBlocksNumber);
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        CRBlockSearchStats* stats = tileStats == nullptr ? nullptr : tileStats + rBlockIndex;
+        lossesWithIndices[rBlockIndex] = {searchRBlock(rBlockIndex, cheapSearchStep, stats), rBlockIndex};
+    }
+    // 2. Полный поиск для блоков в порядке убывания ошибки, пока есть время.
+    // Грубая решетка - подмножество полного перебора, поэтому ошибка блока может только уменьшиться
+    std::sort(lossesWithIndices.begin(), lossesWithIndices.end(), std::greater<>());
+    for (const auto& lossWithIndex : lossesWithIndices) {
+        if (std::chrono::steady_clock::now() >= deadline) {
             break;
-        case BO_Rot270:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rBlockSize - 1 - columnIndex][rowIndex];
+        }
+        const size_t rBlockIndex = lossWithIndex.second;
+        CRBlockSearchStats* stats = tileStats == nullptr ? nullptr : tileStats + rBlockIndex;
+        const double cheapSearchTimeUs = stats == nullptr ? 0.0 : stats->SearchTimeUs;
+        searchRBlock(rBlockIndex, 1, stats);
+        if (stats != nullptr) {
+            stats->SearchTimeUs += cheapSearchTimeUs;
+        }
+    }
+}
+
+// Поиск прообраза для одного блока R среди блоков D пула с шагом dBlockStep по решетке по каждой оси.
+// Возвращает ошибку найденного отображения
+template<int RBlockSize>
+int64_t CFractalTileCompressor<RBlockSize>::searchRBlock(size_t rBlockIndex, size_t dBlockStep,
+    CRBlockSearchStats* stats)
+{
+    const auto searchStart = std::chrono::steady_clock::now();
+    // Счетчики статистики поиска - дешевые, поэтому считаются всегда
+    uint32_t examinedNumber = 0, hashSkippedNumber = 0, scaleRejectedNumber = 0, zeroDenominatorNumber = 0;
+    int rBlockSum = 0, rBlockSquaresSum = 0;
+    uint8_t hash = 0;
+    prepareRBlockStructs(rBlockIndex / rBlocksPerRow, rBlockIndex % rBlocksPerRow, rBlockSum, rBlockSquaresSum, hash);
+    // Для блоков 16x16 промежуточные величины не умещаются в int - считаем в int64_t
+    const int64_t rBlockSumSquare = static_cast<int64_t>(rBlockSum) * rBlockSum;
+    const int64_t rBlockVariance = (rBlockSquaresSum - rBlockSumSquare / rBlockArea) / rBlockArea;
+    const bool isRBlockVarSmall = rBlockVariance < SmallVarianceThreshold;
+
+    RDBlockMapping bestMapping{};
+    int64_t minLossValue = std::numeric_limits<int64_t>::max();
+    for (size_t dBlockRow = 0; dBlockRow < dBlocksPerColumn; dBlockRow += dBlockStep) {
+        for (size_t dBlockColumn = 0; dBlockColumn < dBlocksPerRow; dBlockColumn += dBlockStep) {
+            size_t dBlockIndex = dBlockRow * dBlocksPerRow + dBlockColumn;
+            if (!dBlockPoolIndices.empty()) {
+                if (dBlockPoolIndices[dBlockIndex] < 0) {
+                    continue;
                 }
+                dBlockIndex = dBlockPoolIndices[dBlockIndex];
             }
-            break;
-        case BO_MirroredRot0:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rowIndex][rBlockSize - 1 - columnIndex];
+            const uint8_t* downDBlock = downDValues + dBlockIndex * rBlockArea;
+            const uint8_t* hashPtr = isFastModeEnabled ? hashes + dBlockIndex * BO_Count : nullptr;
+            const int64_t dBlockSum = downDSumTable[dBlockIndex];
+            const int64_t dBlockSquaresSum = downDSqSumTable[dBlockIndex];
+            const int64_t scaleDenominator = rBlockArea * dBlockSquaresSum - dBlockSum * dBlockSum;
+            if (scaleDenominator == 0) {
+                ++zeroDenominatorNumber;
+                const int64_t currLoss = rBlockSquaresSum - rBlockSumSquare / rBlockArea;
+                if (currLoss < minLossValue) {
+                    bestMapping.Scale = 0;
+                    bestMapping.Bias = rBlockSum / rBlockArea;
+                    bestMapping.Orientation = BO_Rot0;
+                    bestMapping.TopLeftX = dBlockColumn * domainStep;
+                    bestMapping.TopLeftY = dBlockRow * domainStep;
+                    minLossValue = currLoss;
                 }
+                continue;
             }
-            break;
-        case BO_MirroredRot90:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rBlockSize - 1 - columnIndex][rBlockSize - 1 - rowIndex];
+            const int64_t sumsMultiplied = dBlockSum * rBlockSum;
+            for (size_t dBlockOrientation = 0; dBlockOrientation < BO_Count; ++dBlockOrientation) {
+                if (isFastModeEnabled && hashPtr[dBlockOrientation] != hash && !isRBlockVarSmall) {
+                    ++hashSkippedNumber;
+                    continue;
                 }
-            }
-            break;
-        case BO_MirroredRot180:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[rBlockSize - 1 - rowIndex][columnIndex];
+                ++examinedNumber;
+                const auto orientation = static_cast<TBlockOrientation>(dBlockOrientation);
+                const int64_t blocksConv = getBlocksConvolution(orientedRBlocks[orientation], downDBlock);
+                const int64_t scaleNumerator = rBlockArea * blocksConv - sumsMultiplied;
+                const double scale = static_cast<double>(scaleNumerator) / scaleDenominator;
+                if (scale >= 1.0 || scale < 0.0) {
+                    ++scaleRejectedNumber;
+                    continue;
                 }
-            }
-            break;
-        case BO_MirroredRot270:
-            for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-                for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-                    acc += rBlockLines[rowIndex][columnIndex] * dBlockLines[columnIndex][rowIndex];
+                const int discretizedScale = static_cast<int>(scale * RDBlockMapping::ScaleBase);
+                const int64_t scaledDBlockSum = (dBlockSum * discretizedScale) / RDBlockMapping::ScaleBase;
+                const int biasDiscretized = color_cast<int>((rBlockSum - scaledDBlockSum) / rBlockArea,
+                    std::numeric_limits<int8_t>::min(), std::numeric_limits<int8_t>::max());
+                const int64_t loss = rBlockSquaresSum + (dBlockSquaresSum * discretizedScale / RDBlockMapping::ScaleBase -
+                    2 * blocksConv + 2 * biasDiscretized * dBlockSum) * discretizedScale / RDBlockMapping::ScaleBase +
+                    biasDiscretized * (biasDiscretized * rBlockArea - 2 * rBlockSum);
+                if (loss < minLossValue) {
+                    bestMapping.Scale = discretizedScale;
+                    bestMapping.Bias = biasDiscretized;
+                    bestMapping.Orientation = orientation;
+                    bestMapping.TopLeftX = dBlockColumn * domainStep;
+                    bestMapping.TopLeftY = dBlockRow * domainStep;
+                    minLossValue = loss;
                 }
             }
-            break;
-        default:
-            assert(false);
+        }
     }
-    return acc;
+    rBlockMappings[rBlockIndex] = bestMapping;
+    examinedCandidatesNumber += examinedNumber;
+    if (stats != nullptr) {
+        const auto searchEnd = std::chrono::steady_clock::now();
+        stats->CandidatesExamined = examinedNumber;
+        stats->HashMismatchSkipped = hashSkippedNumber;
+        stats->ScaleRejected = scaleRejectedNumber;
+        stats->ZeroDenominator = zeroDenominatorNumber;
+        stats->Variance = static_cast<int32_t>(rBlockVariance);
+        stats->IsVarianceSmall = isRBlockVarSmall;
+        stats->WinningLoss = minLossValue;
+        stats->SearchTimeUs = std::chrono::duration<double, std::micro>(searchEnd - searchStart).count();
+    }
+    return minLossValue;
 }
 
-// Предпосчет сжатых блоков D
-void CFractalImageCompressor::prepareDownDValues() {
-    auto topLeftDBlockPtr = srcBuffer;
-    auto downDBuffer = downDValues;
-    size_t dBlockIndex = 0;
-    for (size_t rowIndex = 0; rowIndex < dBlocksNumberRoot; ++rowIndex) {
-        for (size_t columnIndex = 0; columnIndex < dBlocksNumberRoot; ++columnIndex, ++dBlockIndex) {
-            size_t index = 0;
-            downDSumTable[dBlockIndex] = 0;
-            downDSqSumTable[dBlockIndex] = 0;
-            for (size_t dBlockRow = 0; dBlockRow < rBlockSize; ++dBlockRow) {
-                for (size_t dBlockColumn = 0; dBlockColumn < rBlockSize; ++dBlockColumn, ++index) {
-                    auto topLeft = topLeftDBlockPtr + 2 * dBlockRow * size + 2 * dBlockColumn;
-                    auto topRight = topLeft + 1;
-                    auto botLeft = topLeft + size;
-                    auto botRight = botLeft + 1;
-                    downDBuffer[index] = (*topLeft + *topRight + *botLeft + *botRight + 2) / 4;
-                    downDSumTable[dBlockIndex] += downDBuffer[index];
-                    downDSqSumTable[dBlockIndex] += downDBuffer[index] * downDBuffer[index];
-                }
+// Подготовка необходимых структур по текущему блоку R
+// Блок раскладывается во всех ориентациях: свертка с повернутым блоком D
+// равна свертке блока D с обратно повернутым блоком R - непрерывным скалярным произведением
+template<int RBlockSize>
+inline void CFractalTileCompressor<RBlockSize>::prepareRBlockStructs(size_t rBlockRow, size_t rBlockColumn,
+    int& rBlockSum, int& rBlockSquaresSum, uint8_t& hash)
+{
+    const uint8_t* rBlockBuffer = srcBuffer + rBlockSize * (rBlockRow * srcStride + rBlockColumn);
+    for (int rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
+        for (int columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
+            const uint8_t value = rBlockBuffer[rowIndex * srcStride + columnIndex];
+            rBlockSum += value;
+            rBlockSquaresSum += value * value;
+            for (size_t orientation = 0; orientation < BO_Count; ++orientation) {
+                const int dIndex = GetOrientedIndex(static_cast<TBlockOrientation>(orientation), rBlockSize,
+                    rowIndex, columnIndex);
+                orientedRBlocks[orientation][dIndex] = value;
             }
-            downDBuffer += rBlockArea;
-            ++topLeftDBlockPtr;
         }
-        topLeftDBlockPtr += (dBlockSize - 1);
+    }
+    if (isFastModeEnabled) {
+        int avgIntensities[4] = { 0, 0, 0, 0 };
+        const int fullIntensity = calculateIntensities<rBlockSize>(avgIntensities, rBlockBuffer);
+        hash = calculateHash(avgIntensities, fullIntensity);
     }
 }
 
-// Вычисление интенсивностей подблоков и общей интенсивности
-int CFractalImageCompressor::calculateIntensities(int* subBlockIntensities, const uint8_t* buffer,
-    size_t fullBlockSize) const
+// Свертка блоков D и R - скалярное произведение фиксированной длины, хорошо векторизуется
+template<int RBlockSize>
+inline int CFractalTileCompressor<RBlockSize>::getBlocksConvolution(const uint8_t* orientedRBlock,
+    const uint8_t* downDBlock)
 {
-    const size_t subBlockSize = fullBlockSize / 2;
-    subBlockIntensities[SBO_TopLeft] = 0;
-    for (size_t dBlockRow = 0; dBlockRow < subBlockSize; ++dBlockRow) {
-        for (size_t dBlockColumn = 0; dBlockColumn < subBlockSize; ++dBlockColumn) {
-            subBlockIntensities[SBO_TopLeft] += *(buffer + dBlockRow * size + dBlockColumn);
-        }
+    int acc = 0;
+    for (int index = 0; index < rBlockArea; ++index) {
+        acc += orientedRBlock[index] * downDBlock[index];
     }
-    subBlockIntensities[SBO_TopRight] = 0;
-    for (size_t dBlockRow = 0; dBlockRow < subBlockSize; ++dBlockRow) {
-        for (size_t dBlockColumn = subBlockSize; dBlockColumn < fullBlockSize; ++dBlockColumn) {
-            subBlockIntensities[SBO_TopRight] += *(buffer + dBlockRow * size + dBlockColumn);
+    return acc;
+}
+
+// Сжатие блока D усреднением квадратов 2x2 с подсчетом суммы и суммы квадратов сжатого блока
+template<int RBlockSize>
+inline void CFractalTileCompressor<RBlockSize>::downsampleDBlock(const uint8_t* dBlockBuffer, uint8_t* downDBlock,
+    int& dBlockSum, int& dBlockSquaresSum) const
+{
+    dBlockSum = 0;
+    dBlockSquaresSum = 0;
+    for (int dBlockRow = 0; dBlockRow < rBlockSize; ++dBlockRow) {
+        const uint8_t* topRow = dBlockBuffer + 2 * dBlockRow * srcStride;
+        const uint8_t* botRow = topRow + srcStride;
+        uint8_t* downRow = downDBlock + dBlockRow * rBlockSize;
+        for (int dBlockColumn = 0; dBlockColumn < rBlockSize; ++dBlockColumn) {
+            downRow[dBlockColumn] = (topRow[2 * dBlockColumn] + topRow[2 * dBlockColumn + 1] +
+                botRow[2 * dBlockColumn] + botRow[2 * dBlockColumn + 1] + 2) / 4;
         }
+        for (int dBlockColumn = 0; dBlockColumn < rBlockSize; ++dBlockColumn) {
+            dBlockSum += downRow[dBlockColumn];
+            dBlockSquaresSum += downRow[dBlockColumn] * downRow[dBlockColumn];
+        }
+    }
+}
+
+// Выбор пула блоков D по дисперсии: блоки решетки упорядочиваются по дисперсии, и пул берется равномерно
+// по этому порядку (по квантилям). Пул только из блоков с наибольшей дисперсией на измерениях заметно хуже:
+// масштаб лежит в [0, 1), а сдвиг ограничен int8, поэтому яркие гладкие блоки R требуют гладких блоков D
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::selectDBlocksPool() {
+    std::vector<std::pair<int64_t, int>> variancesWithIndices(dBlocksNumber);
+    uint8_t downDBlock[rBlockArea];
+    for (int dBlockIndex = 0; dBlockIndex < dBlocksNumber; ++dBlockIndex) {
+        const size_t dBlockRow = dBlockIndex / dBlocksPerRow;
+        const size_t dBlockColumn = dBlockIndex % dBlocksPerRow;
+        int dBlockSum = 0;
+        int dBlockSquaresSum = 0;
+        downsampleDBlock(srcBuffer + domainStep * (dBlockRow * srcStride + dBlockColumn), downDBlock,
+            dBlockSum, dBlockSquaresSum);
+        const int64_t variance = static_cast<int64_t>(rBlockArea) * dBlockSquaresSum -
+            static_cast<int64_t>(dBlockSum) * dBlockSum;
+        variancesWithIndices[dBlockIndex] = {variance, dBlockIndex};
+    }
+    std::sort(variancesWithIndices.begin(), variancesWithIndices.end());
+    std::vector<int> poolLatticeIndices(dBlocksPoolSize);
+    for (int poolIndex = 0; poolIndex < dBlocksPoolSize; ++poolIndex) {
+        const size_t quantileIndex = (2 * static_cast<size_t>(poolIndex) + 1) * dBlocksNumber / (2 * dBlocksPoolSize);
+        poolLatticeIndices[poolIndex] = variancesWithIndices[quantileIndex].second;
     }
-    subBlockIntensities[SBO_BotLeft] = 0;
-    for (size_t dBlockRow = subBlockSize; dBlockRow < fullBlockSize; ++dBlockRow) {
-        for (size_t dBlockColumn = 0; dBlockColumn < subBlockSize; ++dBlockColumn) {
-            subBlockIntensities[SBO_BotLeft] += *(buffer + dBlockRow * size + dBlockColumn);
+    // Пул хранится в порядке решетки - так же, как без ограничения
+    std::sort(poolLatticeIndices.begin(), poolLatticeIndices.end());
+    dBlockPoolIndices.assign(dBlocksNumber, -1);
+    for (int poolIndex = 0; poolIndex < dBlocksPoolSize; ++poolIndex) {
+        dBlockPoolIndices[poolLatticeIndices[poolIndex]] = poolIndex;
+    }
+}
+
+// Предпосчет сжатых блоков D пула
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::prepareDownDValues() {
+    for (int dBlockIndex = 0; dBlockIndex < dBlocksNumber; ++dBlockIndex) {
+        const int poolIndex = dBlockPoolIndices.empty() ? dBlockIndex : dBlockPoolIndices[dBlockIndex];
+        if (poolIndex < 0) {
+            continue;
         }
+        const size_t dBlockRow = dBlockIndex / dBlocksPerRow;
+        const size_t dBlockColumn = dBlockIndex % dBlocksPerRow;
+        downsampleDBlock(srcBuffer + domainStep * (dBlockRow * srcStride + dBlockColumn),
+            downDValues + poolIndex * rBlockArea, downDSumTable[poolIndex], downDSqSumTable[poolIndex]);
+    }
+}
+
+// Вычисление интенсивностей подблоков и общей интенсивности
+template<int RBlockSize>
+template<int FullBlockSize>
+int CFractalTileCompressor<RBlockSize>::calculateIntensities(int* subBlockIntensities, const uint8_t* buffer) const {
+    constexpr int subBlockSize = FullBlockSize / 2;
+    for (size_t subBlockIndex = 0; subBlockIndex < SBO_Count; ++subBlockIndex) {
+        subBlockIntensities[subBlockIndex] = 0;
     }
-    subBlockIntensities[SBO_BotRight] = 0;
-    for (size_t dBlockRow = subBlockSize; dBlockRow < fullBlockSize; ++dBlockRow) {
-        for (size_t dBlockColumn = subBlockSize; dBlockColumn < fullBlockSize; ++dBlockColumn) {
-            subBlockIntensities[SBO_BotRight] += *(buffer + dBlockRow * size + dBlockColumn);
+    for (int rowIndex = 0; rowIndex < FullBlockSize; ++rowIndex) {
+        const uint8_t* row = buffer + rowIndex * srcStride;
+        const size_t subBlockRowOffset = (rowIndex < subBlockSize) ? SBO_TopLeft : SBO_BotLeft;
+        for (int columnIndex = 0; columnIndex < subBlockSize; ++columnIndex) {
+            subBlockIntensities[subBlockRowOffset] += row[columnIndex];
+            subBlockIntensities[subBlockRowOffset + 1] += row[subBlockSize + columnIndex];
         }
     }
-    const int blockArea = fullBlockSize * fullBlockSize;
-    const int subBlockArea = subBlockSize * subBlockSize;
+    constexpr int blockArea = FullBlockSize * FullBlockSize;
+    constexpr int subBlockArea = subBlockSize * subBlockSize;
     int fullIntensity = 0;
     for (size_t subBlockIndex = 0; subBlockIndex < SBO_Count; ++subBlockIndex) {
         fullIntensity += subBlockIntensities[subBlockIndex];
@@ -304,33 +775,29 @@ int CFractalImageCompressor::calculateIntensities(int* subBlockIntensities, cons
     return fullIntensity;
 }
 
-// Предпосчет хэшей
-void CFractalImageCompressor::precalculateDHashes() {
+// Предпосчет хэшей блоков D пула
+template<int RBlockSize>
+void CFractalTileCompressor<RBlockSize>::precalculateDHashes() {
     assert(isFastModeEnabled);
-    hashes = new uint8_t[BO_Count * dBlocksNumber];
-    auto blockHashesPtr = hashes;
-    auto topLeftDBlockPtr = srcBuffer;
-    size_t dBlockIndex = 0;
-    for (size_t rowIndex = 0; rowIndex < dBlocksNumberRoot; ++rowIndex) {
-        for (size_t columnIndex = 0; columnIndex < dBlocksNumberRoot; ++columnIndex, ++dBlockIndex) {
-            int avgIntensities[4] = { 0, 0, 0, 0 };
-            const int fullIntensity = calculateIntensities(avgIntensities, topLeftDBlockPtr, dBlockSize);
-            for (size_t orientationIndex = 0; orientationIndex < BO_Count; ++orientationIndex) {
-                blockHashesPtr[orientationIndex] = calculateHash(avgIntensities, fullIntensity,
-                    static_cast<TBlockOrientation>(orientationIndex));
-            }
-            blockHashesPtr += BO_Count;
-            ++topLeftDBlockPtr;
+    hashes = new uint8_t[BO_Count * dBlocksPoolSize];
+    for (int dBlockIndex = 0; dBlockIndex < dBlocksNumber; ++dBlockIndex) {
+        const int poolIndex = dBlockPoolIndices.empty() ? dBlockIndex : dBlockPoolIndices[dBlockIndex];
+        if (poolIndex < 0) {
+            continue;
+        }
+        const size_t dBlockRow = dBlockIndex / dBlocksPerRow;
+        const size_t dBlockColumn = dBlockIndex % dBlocksPerRow;
+        int avgIntensities[4] = { 0, 0, 0, 0 };
+        const int fullIntensity = calculateIntensities<dBlockSize>(avgIntensities,
+            srcBuffer + domainStep * (dBlockRow * srcStride + dBlockColumn));
+        uint8_t* blockHashesPtr = hashes + poolIndex * BO_Count;
+        for (size_t orientationIndex = 0; orientationIndex < BO_Count; ++orientationIndex) {
+            blockHashesPtr[orientationIndex] = calculateHash(avgIntensities, fullIntensity,
+                static_cast<TBlockOrientation>(orientationIndex));
         }
-        topLeftDBlockPtr += (dBlockSize - 1);
     }
 }
 
-// Сериализация сжатого представления
-void CFractalImageCompressor::saveToBinaryFile(const std::string& pathToSave) const {
-    std::ofstream out;
-    out.open(pathToSave, std::ios::binary);
-    out.write(reinterpret_cast<const char*>(&rBlockSize), sizeof(rBlockSize));
-    out.write(reinterpret_cast<const char*>(rBlockMappings), sizeof(RDBlockMapping) * rBlocksNumber);
-    out.close();
-}
\ No newline at end of file
+template class CFractalTileCompressor<4>;
+template class CFractalTileCompressor<8>;
+template class CFractalTileCompressor<16>;
\ No newline at end of file
@@ -1,66 +1,422 @@
 #include "fractal.h"
+#include "frac_format.h"
+#include "parallel.h"
+#include "results_writer.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <fstream>
 #include <random>
+#include <stdexcept>
 #include <iostream>
 
-CFractalImageDecompressor::CFractalImageDecompressor(const std::string& pathToCompressed) {
+CFractalImageDecompressor::CFractalImageDecompressor(const std::string& pathToCompressed, size_t _threadsNumber) :
+    threadsNumber(_threadsNumber)
+{
     loadFromBinaryFile(pathToCompressed);
-    rBlockLines = new uint8_t*[rBlockSize];
 }
 
-CFractalImageDecompressor::~CFractalImageDecompressor() {
-    delete [] rBlockMappings;
-    delete [] rBlockLines;
+std::shared_ptr<CGrayImage> CFractalImageDecompressor::Decompress(size_t iterationsNumber,
+    const std::string& folderPathToSaveIntermediate, const CGrayImage& reference)
+{
+    CDecodeParameters parameters;
+    parameters.MaxIterationsNumber = iterationsNumber;
+    return Decompress(parameters, folderPathToSaveIntermediate, reference);
 }
 
-std::shared_ptr<CGrayImage> CFractalImageDecompressor::Decompress(size_t iterationsNumber,
+std::shared_ptr<CGrayImage> CFractalImageDecompressor::Decompress(const CDecodeParameters& parameters,
+    const std::string& folderPathToSaveIntermediate, const CGrayImage& reference)
+{
+    selectPlane(0);
+    return decompressPlane(parameters, folderPathToSaveIntermediate, reference);
+}
+
+std::shared_ptr<CGrayImage> CFractalImageDecompressor::DecompressChroma(const CDecodeParameters& parameters,
+    int chromaPlane)
+{
+    assert(IsColor() && chromaPlane >= 0 && chromaPlane < ChromaPlanesNumber);
+    const CImageTile region = validateParameters(parameters);
+    // Плоскость уменьшена вдвое при кодировании - восстанавливается на вдвое меньшей сетке,
+    // если блок R на ней остается не меньше пикселя
+    CDecodeParameters chromaParameters = parameters;
+    chromaParameters.IterationCallback = nullptr;
+    chromaParameters.ScaleLog2 = parameters.ScaleLog2 - 1;
+    if (chromaParameters.ScaleLog2 < 0 && (rBlockSize >> -chromaParameters.ScaleLog2) == 0) {
+        ++chromaParameters.ScaleLog2;
+    }
+    const int upscaleShift = parameters.ScaleLog2 - chromaParameters.ScaleLog2;
+    // Положение результата яркости на ее сетке - результат плоскости должен с ним совпадать
+    prepareGrid(parameters.ScaleLog2, region);
+    const size_t lumaLeft = grid.Left;
+    const size_t lumaTop = grid.Top;
+    const size_t lumaWidth = grid.Width;
+    const size_t lumaHeight = grid.Height;
+    const size_t lumaIterationsNumber = lastIterationsNumber;
+    selectPlane(1 + chromaPlane);
+    const std::shared_ptr<CGrayImage> chroma = decompressPlane(chromaParameters, "", CGrayImage());
+    lastIterationsNumber = lumaIterationsNumber;
+
+    std::shared_ptr<CGrayImage> result(new CGrayImage(lumaHeight, lumaWidth));
+    uint8_t* resultRowBuffer = result->GetBuffer();
+    for (size_t rowIndex = 0; rowIndex < lumaHeight; ++rowIndex, resultRowBuffer += lumaWidth) {
+        const uint8_t* chromaRowBuffer = chroma->GetBuffer() +
+            (((lumaTop + rowIndex) >> upscaleShift) - grid.Top) * grid.Width;
+        for (size_t columnIndex = 0; columnIndex < lumaWidth; ++columnIndex) {
+            resultRowBuffer[columnIndex] = chromaRowBuffer[((lumaLeft + columnIndex) >> upscaleShift) - grid.Left];
+        }
+    }
+    return result;
+}
+
+// Проверка масштаба и области интереса (бросает std::invalid_argument). Возвращает восстанавливаемую область
+CImageTile CFractalImageDecompressor::validateParameters(const CDecodeParameters& parameters) const {
+    // Блок R на сетке результата должен остаться не меньше пикселя
+    const int downscaleShift = std::min(std::max(-parameters.ScaleLog2, 0), 30);
+    if (parameters.ScaleLog2 > CDecodeParameters::MaxScaleLog2 || (rBlockSize >> downscaleShift) == 0) {
+        throw std::invalid_argument("Unsupported decode scale 2^" + std::to_string(parameters.ScaleLog2) +
+            " for R block size " + std::to_string(rBlockSize));
+    }
+    const CImageTile& region = parameters.RegionOfInterest;
+    if (region.Width == 0 || region.Height == 0) {
+        return CImageTile{0, 0, width, height};
+    }
+    // Сравнение без сложения: сумма огромных значений из командной строки может переполниться
+    if (region.Left > width || region.Width > width - region.Left ||
+        region.Top > height || region.Height > height - region.Top)
+    {
+        throw std::invalid_argument("Region of interest is out of image bounds");
+    }
+    return region;
+}
+
+// Выбор восстанавливаемой плоскости: 0 - яркость, 1 и 2 - цветоразностные
+void CFractalImageDecompressor::selectPlane(int plane) {
+    planeMappings = plane == 0 ? rBlockMappings.data() : chromaMappings[plane - 1].data();
+    for (int scale = 0; scale < RDBlockMapping::ScaleBase; ++scale) {
+        planeBiasOffsets[scale] = static_cast<int16_t>(plane == 0 ? 0 : GetChromaBiasOffset(scale));
+    }
+}
+
+// Восстановление выбранной плоскости
+std::shared_ptr<CGrayImage> CFractalImageDecompressor::decompressPlane(const CDecodeParameters& parameters,
     const std::string& folderPathToSaveIntermediate, const CGrayImage& reference)
 {
-    std::shared_ptr<CGrayImage> prevImage(new CGrayImage(size, size));
-    std::shared_ptr<CGrayImage> currImage(new CGrayImage(size, size));
-    randomInitialize(*currImage);
-
-    for (size_t iteration = 0; iteration < iterationsNumber; ++iteration) {
-        prevImage->SwapImage(*currImage);
-        size_t rBlockIndex = 0;
-        for (size_t rBlockRow = 0; rBlockRow < rBlocksPerSide; ++rBlockRow) {
-            for (size_t rBlockColumn = 0; rBlockColumn < rBlocksPerSide; ++rBlockColumn, ++rBlockIndex) {
-                prepareRBlockLines(*currImage, rBlockRow, rBlockColumn);
-                applyMapping(*prevImage, rBlockIndex);
+    const CImageTile region = validateParameters(parameters);
+    prepareGrid(parameters.ScaleLog2, region);
+    prepareActiveRBlocks(region);
+    prepareLookupTables();
+    std::shared_ptr<CGrayImage> currImage(new CGrayImage(grid.PaddedHeight, grid.PaddedWidth));
+    switch (parameters.Initialization) {
+        case DI_Random:
+            randomInitialize(*currImage);
+            break;
+        case DI_Mean:
+            std::fill_n(currImage->GetBuffer(), grid.PaddedWidth * grid.PaddedHeight,
+                static_cast<uint8_t>(estimateMeanIntensity()));
+            break;
+        case DI_Bias:
+            biasInitialize(*currImage, estimateMeanIntensity());
+            break;
+        default:
+            assert(false);
+    }
+    // Усредненное 2x2 изображение: значение в (x, y) - среднее квадрата 2x2 с левым верхним углом в (x, y).
+    // Блоки D перекрываются, поэтому усреднение делается один раз за итерацию, а не для каждого отображения.
+    // При обновлении "на месте" средние считаются по текущему изображению, и копия не нужна
+    std::vector<uint8_t> downsampled(parameters.IsInPlace ? 0 : grid.PaddedWidth * grid.PaddedHeight);
+    const double pixelsNumber = static_cast<double>(activeRBlocksNumber * grid.BlockSize * grid.BlockSize);
+    // Промежуточные результаты пишутся на диск в фоновом потоке, чтобы не останавливать итерации
+    std::unique_ptr<CIntermediateResultsWriter> resultsWriter;
+    if (!folderPathToSaveIntermediate.empty()) {
+        resultsWriter.reset(new CIntermediateResultsWriter(folderPathToSaveIntermediate, reference,
+            grid.Height, grid.Width));
+    }
+
+    lastIterationsNumber = 0;
+    while (lastIterationsNumber < parameters.MaxIterationsNumber) {
+        // Выбор специализации под размер блока на сетке - единственное место диспетчеризации в рантайме
+        uint64_t changeSum = 0;
+        switch (grid.BlockSize) {
+            case 1:
+                changeSum = runIteration<1>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 2:
+                changeSum = runIteration<2>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 4:
+                changeSum = runIteration<4>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 8:
+                changeSum = runIteration<8>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 16:
+                changeSum = runIteration<16>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 32:
+                changeSum = runIteration<32>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            case 64:
+                changeSum = runIteration<64>(*currImage, downsampled.data(), parameters.IsInPlace);
+                break;
+            default:
+                throw std::invalid_argument("Unsupported decode grid block size " +
+                    std::to_string(grid.BlockSize));
+        }
+        onIterationEnd(lastIterationsNumber++, parameters, resultsWriter.get(), *currImage);
+        if (changeSum / pixelsNumber < parameters.Epsilon) {
+            break;
+        }
+    }
+    if (!isCropNeeded()) {
+        return currImage;
+    }
+    std::shared_ptr<CGrayImage> result(new CGrayImage(grid.Height, grid.Width));
+    cropResult(*currImage, *result);
+    return result;
+}
+
+// Одна итерация восстановления всего изображения. Возвращает сумму абсолютных изменений пикселей
+template<int RBlockSize>
+uint64_t CFractalImageDecompressor::runIteration(CGrayImage& image, uint8_t* downsampled, bool isInPlace) const {
+    std::vector<uint64_t> changeSums;
+    if (isInPlace) {
+        // Блоки D не выходят за свой тайл, поэтому тайлы обновляются параллельно, а блоки внутри тайла - по порядку.
+        // Строки задач одного тайла идут подряд, начиная с tileRowsOffsets
+        changeSums.resize(activeTiles.size());
+        ParallelFor(activeTiles.size(), threadsNumber, [&](size_t activeTileIndex) {
+            const size_t tileRowsEnd = activeTileIndex + 1 < activeTiles.size() ?
+                activeTiles[activeTileIndex + 1].RowTasksOffset : rBlockRows.size();
+            for (size_t rowTaskIndex = activeTiles[activeTileIndex].RowTasksOffset; rowTaskIndex < tileRowsEnd;
+                ++rowTaskIndex)
+            {
+                changeSums[activeTileIndex] += decompressRBlockRow<RBlockSize, true>(rBlockRows[rowTaskIndex],
+                    image.GetBuffer(), image);
+            }
+        });
+    } else {
+        ParallelFor(rBlockRows.size(), threadsNumber, [&](size_t rowTaskIndex) {
+            downsampleRBlockRow(rBlockRows[rowTaskIndex], image, downsampled);
+        });
+        // Все блоки R независимы друг от друга - обрабатываем параллельно строки блоков R всех тайлов
+        changeSums.resize(rBlockRows.size());
+        ParallelFor(rBlockRows.size(), threadsNumber, [&](size_t rowTaskIndex) {
+            changeSums[rowTaskIndex] = decompressRBlockRow<RBlockSize, false>(rBlockRows[rowTaskIndex],
+                downsampled, image);
+        });
+    }
+    uint64_t changeSum = 0;
+    for (const uint64_t tasksChangeSum : changeSums) {
+        changeSum += tasksChangeSum;
+    }
+    return changeSum;
+}
+
+// Сетка восстановления: все размеры исходного изображения, умноженные на 2^scaleLog2.
+// Тайлы и блоки R кратны размеру блока, поэтому масштабируются точно
+void CFractalImageDecompressor::prepareGrid(int scaleLog2, const CImageTile& region) {
+    const auto scaleSide = [scaleLog2](size_t side) {
+        return scaleLog2 >= 0 ? side << scaleLog2 : side >> -scaleLog2;
+    };
+    // При уменьшении неполные пиксели на краю области сохраняются
+    const auto scaleSideUp = [scaleLog2, &scaleSide](size_t side) {
+        return scaleLog2 >= 0 ? scaleSide(side) : scaleSide(side + (size_t(1) << -scaleLog2) - 1);
+    };
+    grid.ScaleLog2 = scaleLog2;
+    grid.BlockSize = static_cast<int>(scaleSide(rBlockSize));
+    grid.Left = scaleSide(region.Left);
+    grid.Top = scaleSide(region.Top);
+    grid.Width = scaleSideUp(region.Left + region.Width) - grid.Left;
+    grid.Height = scaleSideUp(region.Top + region.Height) - grid.Top;
+    grid.PaddedWidth = scaleSide(paddedWidth);
+    grid.PaddedHeight = scaleSide(paddedHeight);
+    grid.Tiles.clear();
+    for (const CImageTile& tile : tiles) {
+        grid.Tiles.push_back({scaleSide(tile.Left), scaleSide(tile.Top),
+            scaleSide(tile.Width), scaleSide(tile.Height)});
+    }
+}
+
+// Замыкание зависимостей области интереса: нужны блоки R, пересекающие область, и (транзитивно) блоки R,
+// покрывающие блоки D уже нужных блоков. Остальные блоки на итерациях не обрабатываются и не меняются
+void CFractalImageDecompressor::prepareActiveRBlocks(const CImageTile& region) {
+    activeRBlocks.assign(rBlockMappings.size(), false);
+    activeRBlocksNumber = 0;
+    std::vector<size_t> rBlocksToVisit;
+    for (size_t tileIndex = 0; tileIndex < tiles.size(); ++tileIndex) {
+        const CImageTile& tile = tiles[tileIndex];
+        if (region.Left >= tile.Left + tile.Width || tile.Left >= region.Left + region.Width ||
+            region.Top >= tile.Top + tile.Height || tile.Top >= region.Top + region.Height)
+        {
+            continue;
+        }
+        const size_t rBlocksPerRow = tile.Width / rBlockSize;
+        const size_t tileMappingsOffset = tileMappingsOffsets[tileIndex];
+        const auto visit = [&](size_t rBlockRow, size_t rBlockColumn) {
+            const size_t rBlockIndex = rBlockRow * rBlocksPerRow + rBlockColumn;
+            if (!activeRBlocks[tileMappingsOffset + rBlockIndex]) {
+                activeRBlocks[tileMappingsOffset + rBlockIndex] = true;
+                rBlocksToVisit.push_back(rBlockIndex);
+            }
+        };
+        // Блоки, пересекающие область
+        const size_t firstColumn = (std::max(region.Left, tile.Left) - tile.Left) / rBlockSize;
+        const size_t lastColumn =
+            (std::min(region.Left + region.Width, tile.Left + tile.Width) - 1 - tile.Left) / rBlockSize;
+        const size_t firstRow = (std::max(region.Top, tile.Top) - tile.Top) / rBlockSize;
+        const size_t lastRow =
+            (std::min(region.Top + region.Height, tile.Top + tile.Height) - 1 - tile.Top) / rBlockSize;
+        for (size_t rBlockRow = firstRow; rBlockRow <= lastRow; ++rBlockRow) {
+            for (size_t rBlockColumn = firstColumn; rBlockColumn <= lastColumn; ++rBlockColumn) {
+                visit(rBlockRow, rBlockColumn);
+            }
+        }
+        // Блоки D не выходят за тайл, поэтому замыкание строится внутри тайла
+        while (!rBlocksToVisit.empty()) {
+            const RDBlockMapping& mapping = rBlockMappings[tileMappingsOffset + rBlocksToVisit.back()];
+            rBlocksToVisit.pop_back();
+            const size_t dBlockLastColumn = (mapping.TopLeftX + 2 * rBlockSize - 1) / rBlockSize;
+            const size_t dBlockLastRow = (mapping.TopLeftY + 2 * rBlockSize - 1) / rBlockSize;
+            const size_t dBlockFirstColumn = mapping.TopLeftX / rBlockSize;
+            for (size_t rBlockRow = mapping.TopLeftY / rBlockSize; rBlockRow <= dBlockLastRow; ++rBlockRow) {
+                for (size_t rBlockColumn = dBlockFirstColumn; rBlockColumn <= dBlockLastColumn; ++rBlockColumn) {
+                    visit(rBlockRow, rBlockColumn);
+                }
+            }
+        }
+    }
+    // Задачи для параллельной обработки - строки тайлов, содержащие нужные блоки R
+    rBlockRows.clear();
+    activeTiles.clear();
+    for (size_t tileIndex = 0; tileIndex < tiles.size(); ++tileIndex) {
+        const size_t rBlocksPerRow = tiles[tileIndex].Width / rBlockSize;
+        const size_t rBlocksPerColumn = tiles[tileIndex].Height / rBlockSize;
+        const size_t tileRowTasksOffset = rBlockRows.size();
+        for (size_t rBlockRow = 0; rBlockRow < rBlocksPerColumn; ++rBlockRow) {
+            const auto rowBegin = activeRBlocks.begin() + tileMappingsOffsets[tileIndex] + rBlockRow * rBlocksPerRow;
+            const size_t rowActiveNumber = std::count(rowBegin, rowBegin + rBlocksPerRow, true);
+            if (rowActiveNumber > 0) {
+                rBlockRows.push_back({tileIndex, rBlockRow});
+                activeRBlocksNumber += rowActiveNumber;
             }
         }
-        onIterationEnd(iteration, folderPathToSaveIntermediate, reference, *currImage);
+        if (rBlockRows.size() > tileRowTasksOffset) {
+            activeTiles.push_back({tileIndex, tileRowTasksOffset});
+        }
+    }
+}
+
+// Координата блока D на сетке результата. При уменьшении округляется к ближайшей,
+// но так, чтобы блок D не выходил за тайл
+size_t CFractalImageDecompressor::scaleDBlockPosition(size_t position, size_t maxPosition) const {
+    if (grid.ScaleLog2 >= 0) {
+        return position << grid.ScaleLog2;
     }
-    return currImage;
+    const int shift = -grid.ScaleLog2;
+    return std::min((position + (size_t(1) << (shift - 1))) >> shift, maxPosition);
 }
 
-// Подготовка строк текущего R блока
-void CFractalImageDecompressor::prepareRBlockLines(CGrayImage& dstImage, size_t rBlockRow, size_t rBlockColumn) {
-    rBlockLines[0] = dstImage.GetBuffer() + rBlockSize * (rBlockRow * size + rBlockColumn);
-    for (size_t lineIndex = 1; lineIndex < rBlockSize; ++lineIndex) {
-        rBlockLines[lineIndex] = rBlockLines[lineIndex - 1] + size;
+// Подготовка таблиц: смещений пикселей блока D для каждой ориентации и яркостного преобразования
+void CFractalImageDecompressor::prepareLookupTables() {
+    const int rBlockArea = grid.BlockSize * grid.BlockSize;
+    const ptrdiff_t stride = grid.PaddedWidth;
+    orientedOffsets.resize(BO_Count * rBlockArea);
+    for (int orientation = 0; orientation < BO_Count; ++orientation) {
+        for (int rowIndex = 0; rowIndex < grid.BlockSize; ++rowIndex) {
+            for (int columnIndex = 0; columnIndex < grid.BlockSize; ++columnIndex) {
+                // Пиксель (rowIndex, columnIndex) блока R берется из пикселя (dRow, dColumn) уменьшенного блока D
+                const int dIndex = GetOrientedIndex(static_cast<TBlockOrientation>(orientation), grid.BlockSize,
+                    rowIndex, columnIndex);
+                const int dRow = dIndex / grid.BlockSize;
+                const int dColumn = dIndex % grid.BlockSize;
+                orientedOffsets[orientation * rBlockArea + rowIndex * grid.BlockSize + columnIndex] =
+                    2 * (dRow * stride + dColumn);
+            }
+        }
+    }
+    // Для каждого масштаба - готовая строка значений intensity * scale с округлением,
+    // отображение выбирает свою строку, и преобразование пикселя сводится к двум обращениям к таблицам
+    for (int scale = 0; scale < RDBlockMapping::ScaleBase; ++scale) {
+        for (int intensity = 0; intensity <= UINT8_MAX; ++intensity) {
+            scaledIntensities[scale][intensity] = static_cast<int16_t>(
+                (intensity * scale + RDBlockMapping::ScaleBase / 2) / RDBlockMapping::ScaleBase);
+        }
+    }
+    for (int value = 0; value < ClampTableSize; ++value) {
+        clampTable[value] = color_cast(value + INT8_MIN);
+    }
+}
+
+// Усреднение квадратов 2x2 для пикселей строки блоков R тайла. Правый столбец тайла в блоки D не попадает
+void CFractalImageDecompressor::downsampleRBlockRow(const CRBlockRowTask& rowTask, const CGrayImage& sourceImage,
+    uint8_t* downsampled) const
+{
+    const CImageTile& tile = grid.Tiles[rowTask.TileIndex];
+    const size_t stride = grid.PaddedWidth;
+    const size_t firstRow = tile.Top + rowTask.RBlockRow * grid.BlockSize;
+    const size_t lastColumn = tile.Left + tile.Width - 1;
+    for (size_t rowIndex = firstRow; rowIndex < firstRow + grid.BlockSize; ++rowIndex) {
+        const uint8_t* topRow = sourceImage.GetBuffer() + rowIndex * stride;
+        const uint8_t* bottomRow = (rowIndex + 1 < grid.PaddedHeight) ? topRow + stride : topRow;
+        uint8_t* downsampledRow = downsampled + rowIndex * stride;
+        for (size_t columnIndex = tile.Left; columnIndex < lastColumn; ++columnIndex) {
+            downsampledRow[columnIndex] = static_cast<uint8_t>((topRow[columnIndex] + topRow[columnIndex + 1] +
+                bottomRow[columnIndex] + bottomRow[columnIndex + 1] + 2) / 4);
+        }
+    }
+}
+
+// Одна итерация восстановления строки блоков R тайла
+template<int RBlockSize, bool IsInPlace>
+uint64_t CFractalImageDecompressor::decompressRBlockRow(const CRBlockRowTask& rowTask, const uint8_t* sourceImage,
+    CGrayImage& dstImage) const
+{
+    const CImageTile& tile = grid.Tiles[rowTask.TileIndex];
+    const size_t tileOffset = tile.Top * grid.PaddedWidth + tile.Left;
+    const uint8_t* sourceTileBuffer = sourceImage + tileOffset;
+    uint8_t* dstRowBuffer = dstImage.GetBuffer() + tileOffset + RBlockSize * rowTask.RBlockRow * grid.PaddedWidth;
+    const size_t rBlocksPerRow = tile.Width / RBlockSize;
+    // Тайл не меньше блока D (проверяется при чтении заголовка)
+    assert(tile.Width >= 2 * RBlockSize && tile.Height >= 2 * RBlockSize);
+    const size_t maxDBlockX = tile.Width >= 2 * RBlockSize ? tile.Width - 2 * RBlockSize : 0;
+    const size_t maxDBlockY = tile.Height >= 2 * RBlockSize ? tile.Height - 2 * RBlockSize : 0;
+    size_t rBlockIndex = tileMappingsOffsets[rowTask.TileIndex] + rowTask.RBlockRow * rBlocksPerRow;
+    uint64_t changeSum = 0;
+    for (size_t rBlockColumn = 0; rBlockColumn < rBlocksPerRow; ++rBlockColumn, ++rBlockIndex) {
+        if (!activeRBlocks[rBlockIndex]) {
+            continue;
+        }
+        const RDBlockMapping& mapping = planeMappings[rBlockIndex];
+        const uint8_t* dBlockBuffer = sourceTileBuffer +
+            scaleDBlockPosition(mapping.TopLeftY, maxDBlockY) * grid.PaddedWidth +
+            scaleDBlockPosition(mapping.TopLeftX, maxDBlockX);
+        changeSum += applyMapping<RBlockSize, IsInPlace>(dBlockBuffer, dstRowBuffer + RBlockSize * rBlockColumn,
+            mapping);
     }
+    return changeSum;
 }
 
-// Применение отображения к одному блоку
-void CFractalImageDecompressor::applyMapping(const CGrayImage& sourceImage, size_t rBlockIndex) {
-    const RDBlockMapping& mapping = rBlockMappings[rBlockIndex];
-    const auto scale = mapping.Scale;
-    const auto bias = mapping.Bias;
-    const auto orientation = static_cast<TBlockOrientation>(mapping.Orientation);
-    const auto buffer = sourceImage.GetBuffer() + rBlockMappings[rBlockIndex].TopLeftY * size +
-        rBlockMappings[rBlockIndex].TopLeftX;;
-    for (size_t rowIndex = 0; rowIndex < rBlockSize; ++rowIndex) {
-        for (size_t columnIndex = 0; columnIndex < rBlockSize; ++columnIndex) {
-            auto topLeft = getTopLeftBlockPtr(buffer, rowIndex, columnIndex, orientation);
-            auto topRight = topLeft + 1;
-            auto botLeft = topLeft + size;
-            auto botRight = botLeft + 1;
-            rBlockLines[rowIndex][columnIndex] = color_cast((((*topLeft + *topRight + *botLeft + *botRight + 2) / 4) *
-                scale + RDBlockMapping::ScaleBase / 2) / RDBlockMapping::ScaleBase + bias);
+// Применение отображения к одному блоку. Источник - усредненное изображение,
+// либо (при обновлении "на месте") само текущее изображение, усредняемое на лету
+template<int RBlockSize, bool IsInPlace>
+uint64_t CFractalImageDecompressor::applyMapping(const uint8_t* dBlockBuffer, uint8_t* rBlockBuffer,
+    const RDBlockMapping& mapping) const
+{
+    const int16_t* scaled = scaledIntensities[mapping.Scale];
+    const uint8_t* clamp = clampTable - INT8_MIN + mapping.Bias + planeBiasOffsets[mapping.Scale];
+    const ptrdiff_t* offsets = orientedOffsets.data() + mapping.Orientation * RBlockSize * RBlockSize;
+    const size_t stride = grid.PaddedWidth;
+    uint64_t changeSum = 0;
+    for (int rowIndex = 0; rowIndex < RBlockSize; ++rowIndex, rBlockBuffer += stride, offsets += RBlockSize) {
+        for (int columnIndex = 0; columnIndex < RBlockSize; ++columnIndex) {
+            const uint8_t* dPixel = dBlockBuffer + offsets[columnIndex];
+            const int intensity = IsInPlace ?
+                (dPixel[0] + dPixel[1] + dPixel[stride] + dPixel[stride + 1] + 2) / 4 : dPixel[0];
+            const uint8_t value = clamp[scaled[intensity]];
+            changeSum += std::abs(value - rBlockBuffer[columnIndex]);
+            rBlockBuffer[columnIndex] = value;
         }
     }
+    return changeSum;
 }
 
 // Случайная инициализация начального изображения
@@ -69,23 +425,88 @@ void CFractalImageDecompressor::randomInitialize(CGrayImage& toInitialize) {
     std::mt19937 random(device());
     std::uniform_int_distribution<int> generator(std::numeric_limits<uint8_t>::min(), std::numeric_limits<uint8_t>::max());
     auto currImageBuffer = toInitialize.GetBuffer();
-    for (size_t pixelIndex = 0; pixelIndex < size * size; ++pixelIndex) {
+    const size_t imageSize = toInitialize.GetWidth() * toInitialize.GetHeight();
+    for (size_t pixelIndex = 0; pixelIndex < imageSize; ++pixelIndex) {
         currImageBuffer[pixelIndex] = generator(random);
     }
 }
 
-// Коллбэк на конец итерации - логирует результаты
-void CFractalImageDecompressor::onIterationEnd(size_t iteration, const std::string& pathToResultsFolder,
-    const CGrayImage& reference, const CGrayImage& currentRetrieved)
+// Оценка средней яркости изображения как неподвижной точки отображения средних:
+// среднее блока R равно scale * (среднее блока D) + bias, откуда mean = avg(bias) / (1 - avg(scale))
+int CFractalImageDecompressor::estimateMeanIntensity() const {
+    if (rBlockMappings.empty()) {
+        return 0;
+    }
+    int64_t scalesSum = 0;
+    int64_t biasesSum = 0;
+    for (size_t mappingIndex = 0; mappingIndex < rBlockMappings.size(); ++mappingIndex) {
+        const RDBlockMapping& mapping = planeMappings[mappingIndex];
+        scalesSum += mapping.Scale;
+        biasesSum += mapping.Bias + planeBiasOffsets[mapping.Scale];
+    }
+    const double mappingsNumber = static_cast<double>(rBlockMappings.size());
+    const double averageScale = scalesSum / mappingsNumber / RDBlockMapping::ScaleBase;
+    const double averageBias = biasesSum / mappingsNumber;
+    return color_cast(static_cast<int>(averageBias / (1.0 - averageScale) + 0.5));
+}
+
+// Инициализация блоков R их отображениями, примененными к изображению средней яркости
+void CFractalImageDecompressor::biasInitialize(CGrayImage& toInitialize, int meanIntensity) const {
+    uint8_t* imageBuffer = toInitialize.GetBuffer();
+    for (size_t tileIndex = 0; tileIndex < grid.Tiles.size(); ++tileIndex) {
+        const CImageTile& tile = grid.Tiles[tileIndex];
+        const size_t rBlocksPerRow = tile.Width / grid.BlockSize;
+        const size_t rBlocksPerColumn = tile.Height / grid.BlockSize;
+        size_t rBlockIndex = tileMappingsOffsets[tileIndex];
+        for (size_t rBlockRow = 0; rBlockRow < rBlocksPerColumn; ++rBlockRow) {
+            for (size_t rBlockColumn = 0; rBlockColumn < rBlocksPerRow; ++rBlockColumn, ++rBlockIndex) {
+                const RDBlockMapping& mapping = planeMappings[rBlockIndex];
+                const uint8_t value = clampTable[scaledIntensities[mapping.Scale][meanIntensity] + mapping.Bias +
+                    planeBiasOffsets[mapping.Scale] - INT8_MIN];
+                uint8_t* rBlockBuffer = imageBuffer + (tile.Top + rBlockRow * grid.BlockSize) * grid.PaddedWidth +
+                    tile.Left + rBlockColumn * grid.BlockSize;
+                for (int rowIndex = 0; rowIndex < grid.BlockSize; ++rowIndex, rBlockBuffer += grid.PaddedWidth) {
+                    std::fill_n(rBlockBuffer, grid.BlockSize, value);
+                }
+            }
+        }
+    }
+}
+
+// Коллбэк на конец итерации - отдает снимок результата на фоновую запись и пользовательскому коллбэку, если они есть
+void CFractalImageDecompressor::onIterationEnd(size_t iteration, const CDecodeParameters& parameters,
+    CIntermediateResultsWriter* resultsWriter, const CGrayImage& currentRetrieved) const
 {
-    if (!pathToResultsFolder.empty()) {
-        const std::string& pathToSaveImage = pathToResultsFolder + "/result_" + std::to_string(iteration) + ".bmp";
-        currentRetrieved.SaveToFile(pathToSaveImage);
-        if (!reference.IsEmpty()) {
-            const std::string& pathToSaveMetrics = pathToResultsFolder + "/metrics_" + std::to_string(iteration) + ".txt";
-            const CMetrics& metrics = CalculateMetrics(currentRetrieved, reference);
-            metrics.SaveToFile(pathToSaveMetrics);
+    if (resultsWriter != nullptr) {
+        CGrayImage& snapshot = resultsWriter->AcquireBuffer();
+        cropResult(currentRetrieved, snapshot);
+        resultsWriter->Submit(iteration, snapshot);
+    }
+    if (parameters.IterationCallback) {
+        if (!isCropNeeded()) {
+            parameters.IterationCallback(iteration, currentRetrieved);
+            return;
         }
+        CGrayImage snapshot(grid.Height, grid.Width);
+        cropResult(currentRetrieved, snapshot);
+        parameters.IterationCallback(iteration, snapshot);
+    }
+}
+
+// Нужно ли вырезать результат из изображения на сетке (дополнение при кодировании или область интереса)
+bool CFractalImageDecompressor::isCropNeeded() const {
+    return grid.Left != 0 || grid.Top != 0 || grid.PaddedWidth != grid.Width || grid.PaddedHeight != grid.Height;
+}
+
+// Вырезание результата: отрезание дополнения, добавленного при кодировании, и всего вне области интереса
+void CFractalImageDecompressor::cropResult(const CGrayImage& paddedRetrieved, CGrayImage& result) const {
+    assert(result.GetWidth() == grid.Width && result.GetHeight() == grid.Height);
+    auto paddedRowBuffer = paddedRetrieved.GetBuffer() + grid.Top * grid.PaddedWidth + grid.Left;
+    auto resultRowBuffer = result.GetBuffer();
+    for (size_t rowIndex = 0; rowIndex < grid.Height; ++rowIndex) {
+        std::copy_n(paddedRowBuffer, grid.Width, resultRowBuffer);
+        paddedRowBuffer += grid.PaddedWidth;
+        resultRowBuffer += grid.Width;
     }
 }
 
@@ -93,37 +514,40 @@ void CFractalImageDecompressor::onIterationEnd(size_t iteration, const std::stri
 void CFractalImageDecompressor::loadFromBinaryFile(const std::string& pathToBinary) {
     std::ifstream in;
     in.open(pathToBinary, std::ios::binary);
-    in.read(reinterpret_cast<char*>(&rBlockSize), sizeof(rBlockSize));
-    rBlocksPerSide = size / rBlockSize;
-    rBlocksNumber = rBlocksPerSide * rBlocksPerSide;
-    rBlockMappings = new RDBlockMapping[rBlocksNumber];
-    in.read(reinterpret_cast<char*>(rBlockMappings), rBlocksNumber * sizeof(RDBlockMapping));
+    const CFracHeader header = ReadFracHeader(in);
     in.close();
-}
-
-// Получить указатель на верхний левый угол подблока 2x2 блока D
-inline const uint8_t* CFractalImageDecompressor::getTopLeftBlockPtr(const uint8_t* buffer,
-    size_t rowIndex, size_t columnIndex, TBlockOrientation orientation) const
-{
-    switch(orientation) {
-        case BO_Rot0:
-            return buffer + 2 * size * rowIndex + 2 * columnIndex;
-        case BO_Rot90:
-            return buffer + 2 * size * columnIndex + 2 * (rBlockSize - 1 - rowIndex);
-        case BO_Rot180:
-            return buffer + 2 * size * (rBlockSize - 1 - rowIndex) + 2 * (rBlockSize - 1 - columnIndex);
-        case BO_Rot270:
-            return buffer + 2 * size * (rBlockSize - 1 - columnIndex) + 2 * rowIndex;
-        case BO_MirroredRot0:
-            return buffer + 2 * size * rowIndex + 2 * (rBlockSize - 1 - columnIndex);
-        case BO_MirroredRot90:
-            return buffer + 2 * size * (rBlockSize - 1 - columnIndex) + 2 * (rBlockSize - 1 - rowIndex);;
-        case BO_MirroredRot180:
-            return buffer + 2 * size * (rBlockSize - 1 - rowIndex) + 2 * columnIndex;
-        case BO_MirroredRot270:
-            return buffer + 2 * size * columnIndex + 2 * rowIndex;
-        default:
-            assert(false);
-            return nullptr;
+    rBlockSize = header.RBlockSize;
+    planesNumber = header.PlanesNumber;
+    width = header.Width;
+    height = header.Height;
+    // Тайлы заголовка проверены: они разбивают ровно дополненное изображение
+    paddedWidth = GetPaddedSideSize(width, rBlockSize);
+    paddedHeight = GetPaddedSideSize(height, rBlockSize);
+    size_t mappingsNumber = 0;
+    for (const auto& entry : header.Tiles) {
+        const CImageTile& tile = entry.Tile;
+        tiles.push_back(tile);
+        tileMappingsOffsets.push_back(mappingsNumber);
+        mappingsNumber += (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
     }
+    rBlockMappings.resize(mappingsNumber);
+    for (int chromaPlane = 0; chromaPlane + 1 < planesNumber; ++chromaPlane) {
+        chromaMappings[chromaPlane].resize(mappingsNumber);
+    }
+    // Потоки тайлов независимы - каждый читается и декодируется отдельно прямо из файла
+    ParallelFor(tiles.size(), threadsNumber, [&](size_t tileIndex) {
+        std::ifstream tileIn;
+        tileIn.open(pathToBinary, std::ios::binary);
+        tileIn.seekg(header.Tiles[tileIndex].StreamOffsets[0]);
+        RDBlockMapping* tileMappings = rBlockMappings.data() + tileMappingsOffsets[tileIndex];
+        DecodeTileMappings(tileIn, tiles[tileIndex], rBlockSize, header.DomainStep, tileMappings);
+        // Цветоразностные плоскости берут позиции и ориентации прообразов яркости
+        const size_t tileMappingsNumber = (tiles[tileIndex].Width / rBlockSize) * (tiles[tileIndex].Height / rBlockSize);
+        for (int chromaPlane = 0; chromaPlane + 1 < planesNumber; ++chromaPlane) {
+            RDBlockMapping* tileChromaMappings = chromaMappings[chromaPlane].data() + tileMappingsOffsets[tileIndex];
+            std::copy_n(tileMappings, tileMappingsNumber, tileChromaMappings);
+            tileIn.seekg(header.Tiles[tileIndex].StreamOffsets[1 + chromaPlane]);
+            DecodeTileChromaMappings(tileIn, tiles[tileIndex], rBlockSize, tileChromaMappings);
+        }
+    });
 }
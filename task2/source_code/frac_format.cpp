@@ -0,0 +1,317 @@
+#include "frac_format.h"
+#include "range_coder.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+void writeUInt(std::ostream& out, uint32_t value, size_t bytesNumber = sizeof(uint32_t)) {
+    for (size_t byteIndex = 0; byteIndex < bytesNumber; ++byteIndex) {
+        out.put(static_cast<char>((value >> (8 * byteIndex)) & 0xFFu));
+    }
+}
+
+uint32_t readUInt(std::istream& in, size_t bytesNumber = sizeof(uint32_t)) {
+    uint32_t value = 0;
+    for (size_t byteIndex = 0; byteIndex < bytesNumber; ++byteIndex) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(in.get())) << (8 * byteIndex);
+    }
+    return value;
+}
+
+// Размер заголовка до директории тайлов и размер одной записи директории
+constexpr size_t getHeaderSize(uint16_t version) {
+    return sizeof(FracMagic) + 2 + 2 + (version >= FracColorVersion ? 2 : 0) +
+        (version >= FracDomainStepVersion ? 2 : 0) + 4 + 4 + 4;
+}
+constexpr size_t getTileEntrySize(int planesNumber) {
+    return (4 + planesNumber) * 4;
+}
+
+// Контекстная модель отображений одного тайла.
+// 1. Масштаб кодируется в контексте масштаба предыдущего блока.
+// 2. При нулевом масштабе блок заполняется сдвигом (средним) - позиция и ориентация не нужны,
+//    а сам сдвиг кодируется разностью со сдвигом предыдущего такого блока.
+// 3. Сдвиг сильно зависит от масштаба (чем больше масштаб, тем меньше сдвиг) - кодируется в контексте масштаба.
+// 4. Позиция прообраза кодируется абсолютной: лучший блок D находится где угодно в тайле,
+//    и кодирование смещения относительно блока R на практике дает поток длиннее.
+//    Позиция записывается в шагах решетки блоков D.
+class CMappingsModel {
+public:
+    explicit CMappingsModel(int _domainStep) : domainStep(_domainStep) {}
+
+    void Encode(CRangeEncoder& encoder, const RDBlockMapping& mapping) {
+        scaleModels[scaleContext()].Encode(encoder, mapping.Scale);
+        prevScale = mapping.Scale;
+        if (mapping.Scale == 0) {
+            meanBiasModel.Encode(encoder, static_cast<uint8_t>(mapping.Bias - prevMeanBias));
+            prevMeanBias = mapping.Bias;
+            return;
+        }
+        orientationModel.Encode(encoder, mapping.Orientation);
+        assert(mapping.TopLeftX % domainStep == 0 && mapping.TopLeftY % domainStep == 0);
+        positionXModel.Encode(encoder, mapping.TopLeftX / domainStep);
+        positionYModel.Encode(encoder, mapping.TopLeftY / domainStep);
+        biasModels[biasContext(mapping.Scale)].Encode(encoder, static_cast<uint8_t>(mapping.Bias));
+    }
+
+    RDBlockMapping Decode(CRangeDecoder& decoder) {
+        RDBlockMapping mapping{};
+        mapping.Scale = scaleModels[scaleContext()].Decode(decoder);
+        prevScale = mapping.Scale;
+        if (mapping.Scale == 0) {
+            mapping.Orientation = BO_Rot0;
+            mapping.Bias = static_cast<int8_t>(prevMeanBias + meanBiasModel.Decode(decoder));
+            prevMeanBias = mapping.Bias;
+            return mapping;
+        }
+        mapping.Orientation = orientationModel.Decode(decoder);
+        mapping.TopLeftX = positionXModel.Decode(decoder) * domainStep;
+        mapping.TopLeftY = positionYModel.Decode(decoder) * domainStep;
+        mapping.Bias = static_cast<int8_t>(biasModels[biasContext(mapping.Scale)].Decode(decoder));
+        return mapping;
+    }
+
+private:
+    static constexpr int scaleContextsNumber = 4;
+    static constexpr int biasContextsNumber = 4;
+
+    const int domainStep;
+    int prevScale{0};
+    int8_t prevMeanBias{0};
+
+    CBitTreeModel<5> scaleModels[scaleContextsNumber];
+    CBitTreeModel<3> orientationModel;
+    CBitTreeModel<8> positionXModel;
+    CBitTreeModel<8> positionYModel;
+    CBitTreeModel<8> meanBiasModel;
+    CBitTreeModel<8> biasModels[biasContextsNumber];
+
+    int scaleContext() const {
+        return prevScale == 0 ? 0 : 1 + (prevScale - 1) * (scaleContextsNumber - 1) / (RDBlockMapping::ScaleBase - 1);
+    }
+    static int biasContext(int scale) {
+        return (scale - 1) * biasContextsNumber / (RDBlockMapping::ScaleBase - 1);
+    }
+};
+
+// Модель параметров цветоразностной плоскости тайла. Масштаб кодируется в контексте масштаба предыдущего блока,
+// сдвиг - в контексте масштаба, а при нулевом масштабе (блок заполняется сдвигом) - разностью с предыдущим таким
+class CChromaMappingsModel {
+public:
+    void Encode(CRangeEncoder& encoder, const RDBlockMapping& mapping) {
+        scaleModels[scaleContext()].Encode(encoder, mapping.Scale);
+        prevScale = mapping.Scale;
+        if (mapping.Scale == 0) {
+            meanBiasModel.Encode(encoder, static_cast<uint8_t>(mapping.Bias - prevMeanBias));
+            prevMeanBias = mapping.Bias;
+            return;
+        }
+        biasModels[biasContext(mapping.Scale)].Encode(encoder, static_cast<uint8_t>(mapping.Bias));
+    }
+
+    void Decode(CRangeDecoder& decoder, RDBlockMapping& mapping) {
+        mapping.Scale = scaleModels[scaleContext()].Decode(decoder);
+        prevScale = mapping.Scale;
+        if (mapping.Scale == 0) {
+            mapping.Bias = static_cast<int8_t>(prevMeanBias + meanBiasModel.Decode(decoder));
+            prevMeanBias = mapping.Bias;
+            return;
+        }
+        mapping.Bias = static_cast<int8_t>(biasModels[biasContext(mapping.Scale)].Decode(decoder));
+    }
+
+private:
+    static constexpr int scaleContextsNumber = 4;
+    static constexpr int biasContextsNumber = 4;
+
+    int prevScale{0};
+    int8_t prevMeanBias{0};
+
+    CBitTreeModel<5> scaleModels[scaleContextsNumber];
+    CBitTreeModel<8> meanBiasModel;
+    CBitTreeModel<8> biasModels[biasContextsNumber];
+
+    int scaleContext() const {
+        return prevScale == 0 ? 0 : 1 + (prevScale - 1) * (scaleContextsNumber - 1) / (RDBlockMapping::ScaleBase - 1);
+    }
+    static int biasContext(int scale) {
+        return (scale - 1) * biasContextsNumber / (RDBlockMapping::ScaleBase - 1);
+    }
+};
+}
+
+void WriteFracFile(const std::string& pathToSave, const CFracHeader& header,
+    const std::vector<std::vector<uint8_t>>& tileStreams)
+{
+    assert(header.PlanesNumber == 1 || header.PlanesNumber == MaxPlanesNumber);
+    assert(header.Tiles.size() * header.PlanesNumber == tileStreams.size());
+    // Записывается наименьшая достаточная версия - файлы полутоновых изображений с полной решеткой не меняются
+    const uint16_t version = header.DomainStep != 1 ? FracDomainStepVersion :
+        (header.PlanesNumber > 1 ? FracColorVersion : FracVersion);
+    std::ofstream out;
+    out.open(pathToSave, std::ios::binary);
+    out.write(FracMagic, sizeof(FracMagic));
+    writeUInt(out, version, 2);
+    writeUInt(out, header.RBlockSize, 2);
+    if (version >= FracColorVersion) {
+        writeUInt(out, header.PlanesNumber, 2);
+    }
+    if (version >= FracDomainStepVersion) {
+        writeUInt(out, header.DomainStep, 2);
+    }
+    writeUInt(out, header.Width);
+    writeUInt(out, header.Height);
+    writeUInt(out, header.Tiles.size());
+    for (size_t tileIndex = 0; tileIndex < header.Tiles.size(); ++tileIndex) {
+        const CImageTile& tile = header.Tiles[tileIndex].Tile;
+        writeUInt(out, tile.Left);
+        writeUInt(out, tile.Top);
+        writeUInt(out, tile.Width);
+        writeUInt(out, tile.Height);
+        for (int plane = 0; plane < header.PlanesNumber; ++plane) {
+            writeUInt(out, tileStreams[tileIndex * header.PlanesNumber + plane].size());
+        }
+    }
+    for (const auto& stream : tileStreams) {
+        out.write(reinterpret_cast<const char*>(stream.data()), stream.size());
+    }
+    out.close();
+}
+
+CFracHeader ReadFracHeader(std::istream& in) {
+    // Размер файла нужен, чтобы проверить директорию тайлов до выделения памяти под нее
+    const std::istream::pos_type headerStart = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::istream::pos_type fileEnd = in.tellg();
+    in.seekg(headerStart);
+    if (!in || fileEnd < headerStart) {
+        throw std::runtime_error("Can't read .frac file");
+    }
+    const size_t fileSize = static_cast<size_t>(fileEnd - headerStart);
+    char magic[sizeof(FracMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, FracMagic, sizeof(FracMagic)) != 0) {
+        throw std::runtime_error("Not a .frac file");
+    }
+    const uint16_t version = readUInt(in, 2);
+    if (version != FracVersion && version != FracColorVersion && version != FracDomainStepVersion) {
+        throw std::runtime_error("Unsupported .frac version " + std::to_string(version));
+    }
+    CFracHeader header;
+    header.RBlockSize = readUInt(in, 2);
+    if (header.RBlockSize != 4 && header.RBlockSize != 8 && header.RBlockSize != 16) {
+        throw std::runtime_error("Unsupported .frac R block size " + std::to_string(header.RBlockSize));
+    }
+    header.PlanesNumber = version >= FracColorVersion ? readUInt(in, 2) : 1;
+    if (header.PlanesNumber != 1 && header.PlanesNumber != MaxPlanesNumber) {
+        throw std::runtime_error("Unsupported .frac planes number " + std::to_string(header.PlanesNumber));
+    }
+    header.DomainStep = version >= FracDomainStepVersion ? readUInt(in, 2) : 1;
+    if (header.DomainStep == 0) {
+        throw std::runtime_error("Invalid .frac domain step");
+    }
+    header.Width = readUInt(in);
+    header.Height = readUInt(in);
+    const size_t tilesNumber = readUInt(in);
+    if (!in || header.Width == 0 || header.Height == 0) {
+        throw std::runtime_error("Invalid .frac image size");
+    }
+    const size_t headerSize = getHeaderSize(version);
+    const size_t entrySize = getTileEntrySize(header.PlanesNumber);
+    if (tilesNumber == 0 || tilesNumber > (fileSize - headerSize) / entrySize) {
+        throw std::runtime_error("Invalid .frac tiles number " + std::to_string(tilesNumber));
+    }
+    // Декодер восстанавливает изображение на сетке дополненного изображения, поэтому тайлы должны быть ровно теми,
+    // на которые ее разбивает кодер (в частности, со сторонами не меньше блока D)
+    const size_t paddedWidth = GetPaddedSideSize(header.Width, header.RBlockSize);
+    const size_t paddedHeight = GetPaddedSideSize(header.Height, header.RBlockSize);
+    const size_t tilesPerRow = (paddedWidth + MaxTileSize - 1) / MaxTileSize;
+    const size_t tilesPerColumn = (paddedHeight + MaxTileSize - 1) / MaxTileSize;
+    if (tilesNumber != tilesPerRow * tilesPerColumn) {
+        throw std::runtime_error("Invalid .frac tiles number " + std::to_string(tilesNumber));
+    }
+    const std::vector<CImageTile> expectedTiles = SplitIntoTiles(paddedWidth, paddedHeight, header.RBlockSize);
+    const size_t dBlockSize = 2 * header.RBlockSize;
+    header.Tiles.resize(tilesNumber);
+    size_t streamOffset = headerSize + entrySize * tilesNumber;
+    for (size_t tileIndex = 0; tileIndex < tilesNumber; ++tileIndex) {
+        CFracTileEntry& entry = header.Tiles[tileIndex];
+        entry.Tile.Left = readUInt(in);
+        entry.Tile.Top = readUInt(in);
+        entry.Tile.Width = readUInt(in);
+        entry.Tile.Height = readUInt(in);
+        const CImageTile& expectedTile = expectedTiles[tileIndex];
+        if (entry.Tile.Left != expectedTile.Left || entry.Tile.Top != expectedTile.Top ||
+            entry.Tile.Width != expectedTile.Width || entry.Tile.Height != expectedTile.Height ||
+            entry.Tile.Width < dBlockSize || entry.Tile.Height < dBlockSize)
+        {
+            throw std::runtime_error("Invalid .frac tile rectangle");
+        }
+        for (int plane = 0; plane < header.PlanesNumber; ++plane) {
+            entry.StreamSizes[plane] = readUInt(in);
+            entry.StreamOffsets[plane] = streamOffset;
+            if (entry.StreamSizes[plane] > fileSize - streamOffset) {
+                throw std::runtime_error("Truncated .frac tile streams");
+            }
+            streamOffset += entry.StreamSizes[plane];
+        }
+    }
+    if (!in) {
+        throw std::runtime_error("Truncated .frac header");
+    }
+    return header;
+}
+
+void EncodeTileMappings(const RDBlockMapping* tileMappings, const CImageTile& tile, int rBlockSize, int domainStep,
+    std::vector<uint8_t>& stream)
+{
+    CRangeEncoder encoder(stream);
+    CMappingsModel model(domainStep);
+    const size_t rBlocksNumber = (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        model.Encode(encoder, tileMappings[rBlockIndex]);
+    }
+    encoder.Finish();
+}
+
+void DecodeTileMappings(std::istream& in, const CImageTile& tile, int rBlockSize, int domainStep,
+    RDBlockMapping* tileMappings)
+{
+    CRangeDecoder decoder(in);
+    CMappingsModel model(domainStep);
+    // Поврежденный поток не должен выводить блоки D за пределы тайла
+    const size_t dBlockSize = 2 * rBlockSize;
+    const size_t maxLeft = tile.Width >= dBlockSize ? tile.Width - dBlockSize : 0;
+    const size_t maxTop = tile.Height >= dBlockSize ? tile.Height - dBlockSize : 0;
+    const size_t rBlocksNumber = (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        RDBlockMapping& mapping = tileMappings[rBlockIndex];
+        mapping = model.Decode(decoder);
+        mapping.TopLeftX = std::min<size_t>(mapping.TopLeftX, maxLeft);
+        mapping.TopLeftY = std::min<size_t>(mapping.TopLeftY, maxTop);
+    }
+}
+
+void EncodeTileChromaMappings(const RDBlockMapping* tileMappings, const CImageTile& tile, int rBlockSize,
+    std::vector<uint8_t>& stream)
+{
+    CRangeEncoder encoder(stream);
+    CChromaMappingsModel model;
+    const size_t rBlocksNumber = (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        model.Encode(encoder, tileMappings[rBlockIndex]);
+    }
+    encoder.Finish();
+}
+
+void DecodeTileChromaMappings(std::istream& in, const CImageTile& tile, int rBlockSize, RDBlockMapping* tileMappings) {
+    CRangeDecoder decoder(in);
+    CChromaMappingsModel model;
+    const size_t rBlocksNumber = (tile.Width / rBlockSize) * (tile.Height / rBlockSize);
+    for (size_t rBlockIndex = 0; rBlockIndex < rBlocksNumber; ++rBlockIndex) {
+        model.Decode(decoder, tileMappings[rBlockIndex]);
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "fractal.h"
+#include <istream>
+#include <string>
+#include <vector>
+
+// Версионируемый контейнер фрактального представления (.frac). Все числа записываются в little-endian.
+//   "FRAC" | версия (uint16) | размер блока R (uint16) | [v2: число плоскостей (uint16)]
+//   [v3: шаг решетки блоков D в пикселях (uint16)]
+//   ширина, высота исходного изображения (uint32) | число тайлов (uint32)
+//   директория тайлов: Left, Top, Width, Height, размеры потоков тайла по плоскостям в байтах (uint32)
+//   потоки тайлов по порядку тайлов, внутри тайла - по плоскостям (Y, затем Cb и Cr):
+//   отображения блоков R тайла (построчно), сжатые адаптивным арифметическим кодером.
+// Версия 1 - только полутоновые изображения (одна плоскость), версия 2 - цветные (Y, Cb, Cr),
+// версия 3 - произвольный шаг решетки блоков D, позиции прообразов записываются в шагах решетки.
+// Записывается наименьшая версия, достаточная для изображения.
+// Потоки тайлов независимы, поэтому тайлы можно декодировать параллельно.
+static constexpr char FracMagic[4] = {'F', 'R', 'A', 'C'};
+static constexpr uint16_t FracVersion = 1;
+static constexpr uint16_t FracColorVersion = 2;
+static constexpr uint16_t FracDomainStepVersion = 3;
+// Наибольшее число плоскостей изображения
+static constexpr int MaxPlanesNumber = 1 + ChromaPlanesNumber;
+
+// Запись директории тайлов
+struct CFracTileEntry {
+    CImageTile Tile;
+    // Положение и размер сжатых потоков тайла в файле по плоскостям
+    size_t StreamOffsets[MaxPlanesNumber];
+    size_t StreamSizes[MaxPlanesNumber];
+};
+
+// Заголовок контейнера вместе с директорией тайлов
+struct CFracHeader {
+    int RBlockSize{0};
+    // 1 - полутоновое изображение, 3 - цветное
+    int PlanesNumber{1};
+    // Шаг решетки блоков D в пикселях
+    int DomainStep{1};
+    size_t Width{0};
+    size_t Height{0};
+    std::vector<CFracTileEntry> Tiles;
+};
+
+// Запись контейнера целиком. Потоки - по тайлам, внутри тайла по плоскостям (tileIndex * PlanesNumber + plane).
+// Смещения потоков в header вычисляются при записи
+void WriteFracFile(const std::string& pathToSave, const CFracHeader& header,
+    const std::vector<std::vector<uint8_t>>& tileStreams);
+// Чтение заголовка и директории тайлов (бросает std::runtime_error на неверном формате)
+CFracHeader ReadFracHeader(std::istream& in);
+
+// Сжатие отображений блоков тайла в поток. Позиции прообразов должны быть кратны шагу решетки domainStep
+void EncodeTileMappings(const RDBlockMapping* tileMappings, const CImageTile& tile, int rBlockSize, int domainStep,
+    std::vector<uint8_t>& stream);
+// Потоковое восстановление отображений тайла - поток должен стоять на начале данных тайла
+void DecodeTileMappings(std::istream& in, const CImageTile& tile, int rBlockSize, int domainStep,
+    RDBlockMapping* tileMappings);
+
+// Сжатие параметров яркостного преобразования блоков тайла цветоразностной плоскости.
+// Позиция и ориентация прообраза общие с яркостью и не записываются
+void EncodeTileChromaMappings(const RDBlockMapping* tileMappings, const CImageTile& tile, int rBlockSize,
+    std::vector<uint8_t>& stream);
+// Восстановление масштабов и сдвигов цветоразностной плоскости тайла, позиции и ориентации не меняются
+void DecodeTileChromaMappings(std::istream& in, const CImageTile& tile, int rBlockSize, RDBlockMapping* tileMappings);
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "image.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
 #include <limits>
+#include <vector>
 
 // Возможные ориентации блока
 // 1. Поворот задается по часовой стрелке
@@ -26,7 +30,7 @@ enum TBlockOrientation : unsigned char {
 struct RDBlockMapping {
     typedef uint8_t pos_type;
 
-    // Координаты найденного прообраза - блока D
+    // Координаты найденного прообраза - блока D (относительно левого верхнего угла тайла)
     pos_type TopLeftX;
     pos_type TopLeftY;
     // Ориентация блока
@@ -42,45 +46,147 @@ struct RDBlockMapping {
 };
 static_assert(sizeof(RDBlockMapping) == 4);
 
-// Механизмы работают на фиксированном размере
-// Код легко обобщить, но в рамках данной реализации мы этого делать не будем
-static constexpr int size = 256;
-static_assert(std::numeric_limits<RDBlockMapping::pos_type>::max() + 1 >= size);
+// Индекс пикселя сжатого блока D, сопоставляемого пикселю (rowIndex, columnIndex) блока R при ориентации D
+// (блоки по blockSize пикселей на сторону хранятся построчно)
+constexpr int GetOrientedIndex(TBlockOrientation orientation, int blockSize, int rowIndex, int columnIndex) {
+    const int last = blockSize - 1;
+    switch (orientation) {
+        case BO_Rot0:
+            return rowIndex * blockSize + columnIndex;
+        case BO_Rot90:
+            return columnIndex * blockSize + (last - rowIndex);
+        case BO_Rot180:
+            return (last - rowIndex) * blockSize + (last - columnIndex);
+        case BO_Rot270:
+            return (last - columnIndex) * blockSize + rowIndex;
+        case BO_MirroredRot0:
+            return rowIndex * blockSize + (last - columnIndex);
+        case BO_MirroredRot90:
+            return (last - columnIndex) * blockSize + (last - rowIndex);
+        case BO_MirroredRot180:
+            return (last - rowIndex) * blockSize + columnIndex;
+        case BO_MirroredRot270:
+            return columnIndex * blockSize + rowIndex;
+        default:
+            return 0;
+    }
+}
+
+// Цветное изображение кодируется в YCbCr: полный поиск прообразов выполняется только для яркости Y,
+// цветоразностные плоскости Cb и Cr уменьшены вдвое по каждой стороне и используют позиции и ориентации
+// прообразов яркости, подбирая только свои масштаб и сдвиг
+static constexpr int ChromaPlanesNumber = 2;
+// Нейтральное (серое) значение цветоразностной плоскости
+static constexpr int ChromaNeutral = 128;
+// Сдвиг отображения цветоразностной плоскости хранится относительно нейтрального значения: к нему добавляется
+// ChromaNeutral - scale * ChromaNeutral, чтобы типичные сдвиги были около нуля и умещались в int8
+constexpr int GetChromaBiasOffset(int scale) {
+    return ChromaNeutral - (ChromaNeutral * scale + RDBlockMapping::ScaleBase / 2) / RDBlockMapping::ScaleBase;
+}
+
+// Изображение произвольного размера разбивается на независимо кодируемые тайлы.
+// Блоки-прообразы D ищутся только внутри своего тайла, поэтому координаты хранятся относительно тайла,
+// а время кодирования растет линейно по площади изображения
+static constexpr int MaxTileSize = 256;
+static_assert(std::numeric_limits<RDBlockMapping::pos_type>::max() + 1 >= MaxTileSize);
+
+// Прямоугольный тайл изображения
+struct CImageTile {
+    size_t Left;
+    size_t Top;
+    size_t Width;
+    size_t Height;
+};
+
+// Размер стороны изображения после дополнения до кратного размеру блока R (и не меньше блока D)
+size_t GetPaddedSideSize(size_t sideSize, int rBlockSize);
+// Разбиение (дополненного) изображения на тайлы со сторонами не больше MaxTileSize, кратными размеру блока R
+std::vector<CImageTile> SplitIntoTiles(size_t paddedWidth, size_t paddedHeight, int rBlockSize);
+
+// Статистика поиска прообраза для одного блока R (для подбора порогов по измерениям)
+struct CRBlockSearchStats {
+    // Число пар (блок D, ориентация), для которых считалась свертка
+    uint32_t CandidatesExamined;
+    // Число пар, пропущенных в быстром режиме из-за несовпадения хэшей
+    uint32_t HashMismatchSkipped;
+    // Число пар, отброшенных из-за масштаба вне [0, 1)
+    uint32_t ScaleRejected;
+    // Число блоков D с нулевой дисперсией (масштаб не определен, используется только среднее)
+    uint32_t ZeroDenominator;
+    // Дисперсия блока R и признак "маленькой" дисперсии (для такого блока хэши не используются)
+    int32_t Variance;
+    bool IsVarianceSmall;
+    // Ошибка выбранного отображения (сумма квадратов отклонений)
+    int64_t WinningLoss;
+    // Время поиска в микросекундах
+    double SearchTimeUs;
+};
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Энкодер полутонового изображения во фрактальное представление
-class CFractalImageCompressor {
+// Энкодер одного тайла - поиск прообразов для всех блоков R тайла.
+// Специализируется размером блока R (4, 8 или 16): все внутренние циклы имеют фиксированную длину
+template<int RBlockSize>
+class CFractalTileCompressor {
 public:
-    // Размер блока = 4 или 8 (assert).
-    // Быстрый режим - ускоренный поиск блока-прообраза D только по блокам с таким же хэшом.
-    explicit CFractalImageCompressor(const CGrayImage& toCompress, int rBlockSize = 4, bool isFastModeEnabled = false);
-    ~CFractalImageCompressor();
+    // imageBuffer/imageStride - буфер всего изображения и длина его строки.
+    // Блоки D берутся на решетке с шагом domainStep пикселей; maxDomainsNumber (0 - без ограничения) оставляет
+    // в пуле только столько блоков D решетки, выбранных равномерно по квантилям дисперсии
+    CFractalTileCompressor(const uint8_t* imageBuffer, size_t imageStride, const CImageTile& tile,
+        bool isFastModeEnabled, int domainStep = 1, size_t maxDomainsNumber = 0);
+    ~CFractalTileCompressor();
 
-    // Основной метод фрактального сжатия - сохраняет бинарный файл на диск по переданному пути
-    void Compress(const std::string& pathToSave);
+    // Дисперсия блока R, ниже которой в быстром режиме перебираются все блоки D
+    static constexpr int SmallVarianceThreshold = 10;
+
+    // Заполняет отображения блоков R тайла (построчно) и, если передан буфер, статистику поиска по каждому блоку
+    void Compress(RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats = nullptr);
+    // Кодирование с ограничением по времени: сначала дешевое отображение для каждого блока
+    // (поиск по непересекающимся блокам D), затем полный поиск для блоков с наибольшей ошибкой до deadline
+    void CompressUntil(std::chrono::steady_clock::time_point deadline, RDBlockMapping* tileMappings,
+        CRBlockSearchStats* tileStats = nullptr);
+    // Поиск прообразов только для перечисленных блоков R тайла, остальные отображения не меняются
+    void CompressBlocks(const std::vector<size_t>& rBlockIndices, RDBlockMapping* tileMappings,
+        CRBlockSearchStats* tileStats = nullptr);
+    // Ошибка (сумма квадратов) отображения блока R, примененного к самому изображению так же, как его применяет декодер.
+    // Не требует предпосчетов по тайлу, поэтому годится для быстрой проверки старых отображений
+    static int64_t CalculateMappingLoss(const uint8_t* tileBuffer, size_t stride, size_t rBlockRow, size_t rBlockColumn,
+        const RDBlockMapping& mapping);
+    // Число пар (блок D, ориентация), для которых считалась свертка, по всем поискам этого энкодера
+    uint64_t GetExaminedCandidatesNumber() const { return examinedCandidatesNumber; }
 
 private:
-    // Включен ли "быстрый" режим
-    bool isFastModeEnabled;
-    // Буфер обрабатываемого изображения
-    const uint8_t* srcBuffer;
     // Размер блока R (по одной стороне)
-    const int rBlockSize;
+    static constexpr int rBlockSize = RBlockSize;
     // Размер блока D (не сжатого)
-    const int dBlockSize;
+    static constexpr int dBlockSize = 2 * RBlockSize;
     // Площадь блока R
-    const int rBlockArea;
-    // Количество столбцов(строк) блоков R вдоль одной из сторон изображения
-    const int rBlocksPerSide;
+    static constexpr int rBlockArea = RBlockSize * RBlockSize;
+
+    // Включен ли "быстрый" режим
+    bool isFastModeEnabled;
+    // Шаг решетки блоков D в пикселях
+    const int domainStep;
+    // Буфер обрабатываемого изображения (начиная с левого верхнего угла тайла)
+    const uint8_t* srcBuffer;
+    // Длина строки буфера изображения
+    const size_t srcStride;
+    // Количество столбцов и строк блоков R в тайле
+    const size_t rBlocksPerRow;
+    const size_t rBlocksPerColumn;
     // Общее число блоков R
-    const int rBlocksNumber;
-    // Количество блоков D, приходящееся на одну сторону изображения
-    const int dBlocksNumberRoot;
-    // Общее количество блоков D
+    const size_t rBlocksNumber;
+    // Количество позиций блоков D на решетке по горизонтали и вертикали
+    const size_t dBlocksPerRow;
+    const size_t dBlocksPerColumn;
+    // Общее количество блоков D на решетке
     const int dBlocksNumber;
+    // Количество блоков D в пуле (не больше числа блоков на решетке)
+    const int dBlocksPoolSize;
+    // Номер блока D решетки в пуле (-1 - не попал в пул); пустой, если в пуле все блоки решетки
+    std::vector<int> dBlockPoolIndices;
 
-    // Предпосчитанные сжатые блоки D
+    // Предпосчитанные сжатые блоки D (для блоков пула)
     uint8_t* downDValues;
     // Предпосчитанные суммы по сжатым блокам D
     int* downDSumTable;
@@ -89,51 +195,257 @@ private:
     // Хэши блоков D, для всех ориентаций
     uint8_t* hashes{nullptr};
 
-    // Указатели на строки текущих рассматриваемых блоков R и D (сжатого)
-    const uint8_t** rBlockLines;
-    const uint8_t** dBlockLines;
+    // Текущий блок R, разложенный под каждую ориентацию блока D
+    uint8_t orientedRBlocks[BO_Count][rBlockArea];
     // Выстраеваемые для блоков R прообразы
-    RDBlockMapping* rBlockMappings;
+    RDBlockMapping* rBlockMappings{nullptr};
+    // Число рассмотренных кандидатов по всем поискам
+    uint64_t examinedCandidatesNumber{0};
 
+    int64_t searchRBlock(size_t rBlockIndex, size_t dBlockStep, CRBlockSearchStats* stats);
     void prepareRBlockStructs(size_t rBlockRow, size_t rBlockColumn, int& rBlockSum, int& rBlockSquaresSum, uint8_t& hash);
+    void selectDBlocksPool();
     void prepareDownDValues();
-    int calculateIntensities(int* subBlockIntensities, const uint8_t* buffer, size_t fullBlockSize) const;
+    void downsampleDBlock(const uint8_t* dBlockBuffer, uint8_t* downDBlock, int& dBlockSum, int& dBlockSquaresSum) const;
+    template<int FullBlockSize>
+    int calculateIntensities(int* subBlockIntensities, const uint8_t* buffer) const;
     void precalculateDHashes();
-    int getBlocksConvolution(TBlockOrientation orientation) const;
+    static int getBlocksConvolution(const uint8_t* orientedRBlock, const uint8_t* downDBlock);
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Энкодер полутонового изображения во фрактальное представление
+class CFractalImageCompressor {
+public:
+    // Изображение непустое, размер блока = 4, 8 или 16 (иначе std::invalid_argument).
+    // Быстрый режим - ускоренный поиск блока-прообраза D только по блокам с таким же хэшом.
+    // Тайлы кодируются параллельно в threadsNumber потоков (0 - по числу ядер).
+    // Бюджет времени (0 - без ограничения) включает режим "anytime": каждый блок сначала получает дешевое отображение,
+    // затем оставшееся время тратится на полный поиск для блоков с наибольшей ошибкой.
+    explicit CFractalImageCompressor(const CGrayImage& toCompress, int rBlockSize = 4, bool isFastModeEnabled = false,
+        size_t threadsNumber = 0, double timeBudgetInSeconds = 0.0);
+
+    // Инкрементальное кодирование очередного кадра последовательности: отображение блока R из предыдущего кадра
+    // сохраняется, если его ошибка на новом изображении выросла не больше чем на lossTolerance на пиксель
+    // (относительно ошибки на предыдущем изображении). Полный поиск выполняется только для остальных блоков.
+    // Кадры должны совпадать по размерам, размеру блока и шагу решетки блоков D (иначе std::runtime_error)
+    void SetPreviousFrame(const std::string& pathToPreviousEncoded, const CGrayImage& previousImage,
+        double lossTolerance = 0.0);
+
+    // Цветное кодирование: переданное в конструктор изображение - яркость Y, здесь задаются плоскости Cb и Cr
+    // того же размера (иначе std::invalid_argument). Плоскости уменьшаются вдвое и кодируются с позициями
+    // и ориентациями прообразов яркости - поиск по ним не выполняется
+    void SetChromaPlanes(const CGrayImage& blueChroma, const CGrayImage& redChroma);
+
+    // Пул блоков D: решетка с шагом domainStep пикселей (степень двойки не больше размера блока D, иначе
+    // std::invalid_argument) и не больше maxDomainsNumber блоков на тайл, выбранных по квантилям дисперсии
+    // (0 - все блоки решетки). Уменьшает время поиска и память предпосчетов ценой качества; позиции в файле хранятся в шагах решетки
+    void SetDomainPool(int domainStep, size_t maxDomainsNumber = 0);
+
+    // Основной метод фрактального сжатия - сохраняет бинарный файл на диск по переданному пути
+    // Дополнительно сохраняет статистику поиска по каждому блоку R в CSV (опционально)
+    void Compress(const std::string& pathToSave, const std::string& pathToSaveStats = "");
+    // Число блоков R, для которых при последнем сжатии выполнялся поиск прообраза
+    size_t GetSearchedRBlocksNumber() const { return searchedRBlocksNumber; }
+    // Число пар (блок D, ориентация), рассмотренных при последнем сжатии
+    uint64_t GetExaminedCandidatesNumber() const { return examinedCandidatesNumber; }
+
+private:
+    // Включен ли "быстрый" режим
+    const bool isFastModeEnabled;
+    // Размер блока R (по одной стороне)
+    const int rBlockSize;
+    // Число потоков кодирования
+    const size_t threadsNumber;
+    // Бюджет времени на кодирование (0 - без ограничения)
+    const double timeBudgetInSeconds;
+    // Размеры исходного изображения
+    const size_t width;
+    const size_t height;
+    // Изображение, дополненное до размеров, кратных блоку R (пустое, если дополнение не требуется)
+    CGrayImage paddedImage;
+    // Кодируемое изображение (исходное или дополненное)
+    const CGrayImage* srcImage;
+    // Тайлы и смещения их отображений в общем массиве
+    std::vector<CImageTile> tiles;
+    std::vector<size_t> tileMappingsOffsets;
+    // Выстраеваемые для блоков R прообразы (по всем тайлам)
+    std::vector<RDBlockMapping> rBlockMappings;
+    // Сжатые потоки отображений тайлов
+    std::vector<std::vector<uint8_t>> tileStreams;
+    // Статистика поиска по блокам R (заполняется, только если запрошена)
+    std::vector<CRBlockSearchStats> searchStats;
+    // Предыдущий кадр для инкрементального кодирования (пустые, если не задан): дополненное изображение
+    // и его отображения, допустимый рост ошибки на пиксель
+    CGrayImage previousImage;
+    std::vector<RDBlockMapping> previousMappings;
+    double lossTolerance{0.0};
+    // Шаг решетки блоков D и ограничение пула на тайл (0 - без ограничения)
+    int domainStep{1};
+    size_t maxDomainsNumber{0};
+    // Число блоков R, для которых выполнялся поиск, и число рассмотренных кандидатов
+    std::atomic<size_t> searchedRBlocksNumber{0};
+    std::atomic<uint64_t> examinedCandidatesNumber{0};
+    // Цветоразностные плоскости, дополненные и уменьшенные вдвое (пустые для полутонового изображения),
+    // и отображения их блоков R (блоки тоже вдвое меньше, по одному на блок R яркости)
+    CGrayImage chromaPlanes[ChromaPlanesNumber];
+    std::vector<RDBlockMapping> chromaMappings[ChromaPlanesNumber];
+
+    template<int RBlockSize>
+    void compressTile(const CImageTile& tile, RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats,
+        const std::chrono::steady_clock::time_point* deadline);
+    template<int RBlockSize>
+    void compressTileIncrementally(size_t tileIndex, RDBlockMapping* tileMappings, CRBlockSearchStats* tileStats);
+    void fitTileChroma(size_t tileIndex, int chromaPlane);
+    int getPlanesNumber() const { return chromaMappings[0].empty() ? 1 : 1 + ChromaPlanesNumber; }
     void saveToBinaryFile(const std::string& pathToSave) const;
+    void saveSearchStats(const std::string& pathToSave) const;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Декодер полутонового изображения из фрактального представления
+// Начальное изображение итеративного восстановления
+enum TDecodeInitialization : unsigned char {
+    // Случайный шум (недетерминированно)
+    DI_Random,
+    // Постоянное изображение со средней яркостью - неподвижной точкой отображения средних
+    DI_Mean,
+    // Каждый блок R заполняется своим отображением, примененным к изображению средней яркости
+    DI_Bias
+};
+
+// Параметры итеративного восстановления
+struct CDecodeParameters {
+    // Максимальное число итераций
+    size_t MaxIterationsNumber{8};
+    // Остановка, когда среднее по пикселям абсолютное изменение за итерацию меньше Epsilon (0 - не останавливаться)
+    double Epsilon{0.0};
+    // Обновление одного изображения "на месте" (Гаусс-Зейдель): блоки тайла обрабатываются последовательно
+    // и сразу используют уже обновленные значения. Иначе - итерация Якоби по копии предыдущего изображения
+    bool IsInPlace{false};
+    TDecodeInitialization Initialization{DI_Random};
+    // Масштаб результата - степень двойки: -2 - 1/4, -1 - 1/2, 1 - 2x. Отображения не зависят от разрешения
+    // и применяются на масштабированной сетке. Допустимо от -log2(размер блока R) до MaxScaleLog2
+    int ScaleLog2{0};
+    static constexpr int MaxScaleLog2 = 2;
+    // Область интереса в пикселях исходного изображения (пустая - все изображение). Восстанавливаются только
+    // блоки R, от которых область зависит через отображения, результат - вырезанная область
+    CImageTile RegionOfInterest{0, 0, 0, 0};
+    // Вызывается после каждой итерации с текущим результатом в том же виде, что итоговый (опционально, для измерений)
+    std::function<void(size_t iteration, const CGrayImage& currentRetrieved)> IterationCallback;
+};
+
+class CIntermediateResultsWriter;
+
+// Декодер изображения из фрактального представления
 class CFractalImageDecompressor {
 public:
-    explicit CFractalImageDecompressor(const std::string& pathToCompressed);
-    ~CFractalImageDecompressor();
+    // Тайлы декодируются параллельно в threadsNumber потоков (0 - по числу ядер)
+    explicit CFractalImageDecompressor(const std::string& pathToCompressed, size_t threadsNumber = 0);
+
+    // Размеры восстанавливаемого изображения
+    size_t GetWidth() const { return width; }
+    size_t GetHeight() const { return height; }
+    // Есть ли в файле цветоразностные плоскости
+    bool IsColor() const { return planesNumber > 1; }
 
     // Восстановление изображения заданным количеством итераций
     // Осуществляет дополнительный дамп промежуточных изображений и метрик на диск (опционально)
     std::shared_ptr<CGrayImage> Decompress(size_t iterationsNumber, const std::string& folderPathToSaveResults = "",
         const CGrayImage& reference = CGrayImage());
+    // Восстановление с заданными начальным изображением, схемой итераций и критерием остановки
+    std::shared_ptr<CGrayImage> Decompress(const CDecodeParameters& parameters,
+        const std::string& folderPathToSaveResults = "", const CGrayImage& reference = CGrayImage());
+    // Восстановление цветоразностной плоскости (0 - Cb, 1 - Cr) с теми же параметрами. Плоскость восстанавливается
+    // на вдвое меньшей сетке и увеличивается повторением пикселей до размеров результата яркости
+    std::shared_ptr<CGrayImage> DecompressChroma(const CDecodeParameters& parameters, int chromaPlane);
+    // Число итераций, выполненных последним восстановлением яркости
+    size_t GetIterationsNumber() const { return lastIterationsNumber; }
 
 private:
+    // Число потоков декодирования
+    const size_t threadsNumber;
     // Размер блока R (считывается первым из файла)
-    int rBlockSize;
-    // Число блоков на одну сторону изображения
-    int rBlocksPerSide;
-    // Общее число блоков
-    int rBlocksNumber;
-    // Отображения блоков, считанные из файла
-    RDBlockMapping* rBlockMappings;
-    // Строки заполняемого блока R
-    uint8_t** rBlockLines;
+    int rBlockSize{0};
+    // Число плоскостей изображения: 1 - полутоновое, 3 - YCbCr
+    int planesNumber{1};
+    // Размеры исходного изображения
+    size_t width{0};
+    size_t height{0};
+    // Размеры дополненного изображения (покрытого тайлами)
+    size_t paddedWidth{0};
+    size_t paddedHeight{0};
+    // Тайлы и смещения их отображений в общем массиве
+    std::vector<CImageTile> tiles;
+    std::vector<size_t> tileMappingsOffsets;
+    // Отображения блоков, считанные из файла: яркость и цветоразностные плоскости (для цветного изображения)
+    std::vector<RDBlockMapping> rBlockMappings;
+    std::vector<RDBlockMapping> chromaMappings[ChromaPlanesNumber];
+    // Отображения восстанавливаемой плоскости и добавка к сдвигу для каждого масштаба (ненулевая у Cb и Cr)
+    const RDBlockMapping* planeMappings{nullptr};
+    int16_t planeBiasOffsets[RDBlockMapping::ScaleBase];
+    // Число итераций последнего восстановления
+    size_t lastIterationsNumber{0};
+    // Сетка восстановления - размеры блока, тайлов и изображения с учетом масштаба результата
+    struct CDecodeGrid {
+        int ScaleLog2{0};
+        int BlockSize{0};
+        // Положение и размеры результата (области интереса) на сетке
+        size_t Left{0};
+        size_t Top{0};
+        size_t Width{0};
+        size_t Height{0};
+        size_t PaddedWidth{0};
+        size_t PaddedHeight{0};
+        std::vector<CImageTile> Tiles;
+    };
+    CDecodeGrid grid;
+    // Строка блоков R тайла - единица параллельной работы декодера
+    struct CRBlockRowTask {
+        size_t TileIndex;
+        size_t RBlockRow;
+    };
+    std::vector<CRBlockRowTask> rBlockRows;
+    // Тайлы с нужными блоками R и начало их строк в rBlockRows
+    struct CActiveTile {
+        size_t TileIndex;
+        size_t RowTasksOffset;
+    };
+    std::vector<CActiveTile> activeTiles;
+    // Признаки блоков R, нужных для восстановления области интереса, и их число
+    std::vector<bool> activeRBlocks;
+    size_t activeRBlocksNumber{0};
+    // Смещения пикселей блока D в уменьшенном изображении для каждой ориентации (BO_Count x размер блока^2)
+    std::vector<ptrdiff_t> orientedOffsets;
+    // Значения intensity * scale / ScaleBase для всех масштабов
+    int16_t scaledIntensities[RDBlockMapping::ScaleBase][UINT8_MAX + 1];
+    // Ограничение результата сдвига диапазоном [0, 255], индекс смещен на -INT8_MIN
+    // (сдвиг с добавкой цветоразностной плоскости доходит до 255)
+    static constexpr int ClampTableSize = 3 * (UINT8_MAX + 1);
+    uint8_t clampTable[ClampTableSize];
 
+    CImageTile validateParameters(const CDecodeParameters& parameters) const;
+    void selectPlane(int plane);
+    std::shared_ptr<CGrayImage> decompressPlane(const CDecodeParameters& parameters,
+        const std::string& folderPathToSaveResults, const CGrayImage& reference);
     static void randomInitialize(CGrayImage& toInitialize);
-    void prepareRBlockLines(CGrayImage& dstImage, size_t rBlockRow, size_t rBlockColumn);
-    void applyMapping(const CGrayImage& sourceImage, size_t rBlockIndex);
-    static void onIterationEnd(size_t iteration, const std::string& pathToResultsFolder,
-        const CGrayImage& reference, const CGrayImage& currentRetrieved);
+    int estimateMeanIntensity() const;
+    void biasInitialize(CGrayImage& toInitialize, int meanIntensity) const;
+    void prepareGrid(int scaleLog2, const CImageTile& region);
+    void prepareActiveRBlocks(const CImageTile& region);
+    size_t scaleDBlockPosition(size_t position, size_t maxPosition) const;
+    void prepareLookupTables();
+    void downsampleRBlockRow(const CRBlockRowTask& rowTask, const CGrayImage& sourceImage, uint8_t* downsampled) const;
+    template<int RBlockSize>
+    uint64_t runIteration(CGrayImage& image, uint8_t* downsampled, bool isInPlace) const;
+    template<int RBlockSize, bool IsInPlace>
+    uint64_t decompressRBlockRow(const CRBlockRowTask& rowTask, const uint8_t* sourceImage, CGrayImage& dstImage) const;
+    template<int RBlockSize, bool IsInPlace>
+    uint64_t applyMapping(const uint8_t* dBlockBuffer, uint8_t* rBlockBuffer, const RDBlockMapping& mapping) const;
+    void onIterationEnd(size_t iteration, const CDecodeParameters& parameters,
+        CIntermediateResultsWriter* resultsWriter, const CGrayImage& currentRetrieved) const;
+    bool isCropNeeded() const;
+    void cropResult(const CGrayImage& paddedRetrieved, CGrayImage& result) const;
     void loadFromBinaryFile(const std::string& pathToBinary);
-    const uint8_t* getTopLeftBlockPtr(const uint8_t* buffer, size_t rowIndex, size_t columnIndex,
-        TBlockOrientation orientation) const;
-};
\ No newline at end of file
+};
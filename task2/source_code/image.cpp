@@ -4,7 +4,9 @@
 #include <opencv2/imgcodecs.hpp>
 #include <cassert>
 #include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <stdexcept>
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 // Реализация - запись(чтение) изображений в(из) файл(а) осуществляется с помощью OpenCV
@@ -49,11 +51,61 @@ void CGrayImage::SwapImage(CGrayImage& other) {
     std::swap(dataBuffer, other.dataBuffer);
 }
 
+void LoadYCbCrFromFile(const std::string& sourceFilePath, CGrayImage& luma, CGrayImage& blueChroma,
+    CGrayImage& redChroma)
+{
+    const cv::Mat cvImage = imread(sourceFilePath, cv::IMREAD_COLOR);
+    const size_t width = cvImage.cols;
+    const size_t height = cvImage.rows;
+    CGrayImage(height, width).SwapImage(luma);
+    CGrayImage(height, width).SwapImage(blueChroma);
+    CGrayImage(height, width).SwapImage(redChroma);
+    for (size_t rowIndex = 0; rowIndex < height; ++rowIndex) {
+        // OpenCV хранит пиксели в порядке BGR
+        const uint8_t* bgrRow = cvImage.ptr(rowIndex);
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex, bgrRow += 3) {
+            const double blue = bgrRow[0];
+            const double green = bgrRow[1];
+            const double red = bgrRow[2];
+            const size_t pixelIndex = rowIndex * width + columnIndex;
+            luma.GetBuffer()[pixelIndex] = color_cast(std::lround(0.299 * red + 0.587 * green + 0.114 * blue));
+            blueChroma.GetBuffer()[pixelIndex] =
+                color_cast(std::lround(128.0 - 0.168736 * red - 0.331264 * green + 0.5 * blue));
+            redChroma.GetBuffer()[pixelIndex] =
+                color_cast(std::lround(128.0 + 0.5 * red - 0.418688 * green - 0.081312 * blue));
+        }
+    }
+}
+
+void SaveYCbCrToFile(const std::string& targetFilePath, const CGrayImage& luma, const CGrayImage& blueChroma,
+    const CGrayImage& redChroma)
+{
+    const size_t width = luma.GetWidth();
+    const size_t height = luma.GetHeight();
+    assert(blueChroma.GetWidth() == width && blueChroma.GetHeight() == height);
+    assert(redChroma.GetWidth() == width && redChroma.GetHeight() == height);
+    cv::Mat cvImage(height, width, CV_8UC3);
+    for (size_t rowIndex = 0; rowIndex < height; ++rowIndex) {
+        uint8_t* bgrRow = cvImage.ptr(rowIndex);
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex, bgrRow += 3) {
+            const size_t pixelIndex = rowIndex * width + columnIndex;
+            const double y = luma.GetBuffer()[pixelIndex];
+            const double cb = blueChroma.GetBuffer()[pixelIndex] - 128.0;
+            const double cr = redChroma.GetBuffer()[pixelIndex] - 128.0;
+            bgrRow[0] = color_cast(std::lround(y + 1.772 * cb));
+            bgrRow[1] = color_cast(std::lround(y - 0.344136 * cb - 0.714136 * cr));
+            bgrRow[2] = color_cast(std::lround(y + 1.402 * cr));
+        }
+    }
+    imwrite(targetFilePath, cvImage);
+}
+
 CMetrics CalculateMetrics(const CGrayImage& recoveredImage, const CGrayImage& referenceImage) {
     const size_t width = recoveredImage.GetWidth();
     const size_t height = recoveredImage.GetHeight();
-    assert(width == referenceImage.GetWidth());
-    assert(height == referenceImage.GetHeight());
+    if (width != referenceImage.GetWidth() || height != referenceImage.GetHeight()) {
+        throw std::invalid_argument("Metrics need images of the same size");
+    }
     const size_t imageSize = width * height;
     double mse = 0.0;
     const auto recoveredBuffer = recoveredImage.GetBuffer();
@@ -35,6 +35,15 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Цветное изображение в виде трех плоскостей YCbCr (BT.601 в полном диапазоне [0, 255], как в JPEG).
+// Плоскости одного размера с исходным изображением
+void LoadYCbCrFromFile(const std::string& sourceFilePath, CGrayImage& luma, CGrayImage& blueChroma,
+    CGrayImage& redChroma);
+void SaveYCbCrToFile(const std::string& targetFilePath, const CGrayImage& luma, const CGrayImage& blueChroma,
+    const CGrayImage& redChroma);
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
 // Метрики качества восстановленного изображения
 struct CMetrics {
     // Среднеквадратичная ошибка
@@ -46,7 +55,7 @@ struct CMetrics {
     void SaveToFile(const std::string& pathToSave) const;
 };
 
-// Подсчет метрик
+// Подсчет метрик (изображения разного размера - std::invalid_argument)
 CMetrics CalculateMetrics(const CGrayImage& recoveredImage, const CGrayImage& referenceImage);
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Число потоков по умолчанию (0 в параметрах означает "по числу ядер")
+inline size_t GetThreadsNumber(size_t requestedThreadsNumber = 0) {
+    if (requestedThreadsNumber != 0) {
+        return requestedThreadsNumber;
+    }
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Параллельное выполнение независимых задач с индексами [0, tasksNumber)
+// Задачи раздаются потокам динамически, поэтому неравномерные по времени задачи (тайлы) балансируются сами
+template<typename TTaskFunction>
+void ParallelFor(size_t tasksNumber, size_t threadsNumber, const TTaskFunction& task) {
+    threadsNumber = std::min(GetThreadsNumber(threadsNumber), tasksNumber);
+    if (threadsNumber <= 1) {
+        for (size_t taskIndex = 0; taskIndex < tasksNumber; ++taskIndex) {
+            task(taskIndex);
+        }
+        return;
+    }
+    std::atomic<size_t> nextTaskIndex{0};
+    auto worker = [&]() {
+        for (size_t taskIndex = nextTaskIndex++; taskIndex < tasksNumber; taskIndex = nextTaskIndex++) {
+            task(taskIndex);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(threadsNumber - 1);
+    for (size_t threadIndex = 1; threadIndex < threadsNumber; ++threadIndex) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
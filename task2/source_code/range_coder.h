@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+// Адаптивный двоичный арифметический (интервальный) кодер в духе LZMA.
+// Вероятность нуля хранится 11-битным числом и после каждого бита сдвигается к наблюдаемой статистике.
+
+// Адаптивная модель одного бита
+struct CBitModel {
+    static constexpr int ProbBits = 11;
+    static constexpr uint32_t ProbMax = 1u << ProbBits;
+    static constexpr int AdaptationShift = 5;
+
+    uint16_t ZeroProb = ProbMax / 2;
+
+    void Update(unsigned bit) {
+        if (bit == 0) {
+            ZeroProb += (ProbMax - ZeroProb) >> AdaptationShift;
+        } else {
+            ZeroProb -= ZeroProb >> AdaptationShift;
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Кодер - дописывает сжатые байты в выходной буфер
+class CRangeEncoder {
+public:
+    explicit CRangeEncoder(std::vector<uint8_t>& _output) : output(_output) {}
+
+    void EncodeBit(CBitModel& model, unsigned bit) {
+        const uint32_t bound = (range >> CBitModel::ProbBits) * model.ZeroProb;
+        if (bit == 0) {
+            range = bound;
+        } else {
+            low += bound;
+            range -= bound;
+        }
+        model.Update(bit);
+        normalize();
+    }
+
+    // Сброс оставшегося состояния в буфер - вызывается один раз в конце потока
+    void Finish() {
+        for (int byteIndex = 0; byteIndex < 5; ++byteIndex) {
+            shiftLow();
+        }
+    }
+
+private:
+    static constexpr uint32_t topValue = 1u << 24;
+
+    std::vector<uint8_t>& output;
+    uint64_t low{0};
+    uint32_t range{0xFFFFFFFFu};
+    uint8_t cache{0};
+    uint64_t cacheSize{1};
+
+    void normalize() {
+        while (range < topValue) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    // Выталкивание старшего байта с учетом возможного переноса
+    void shiftLow() {
+        if (static_cast<uint32_t>(low) < 0xFF000000u || (low >> 32) != 0) {
+            const uint8_t carry = static_cast<uint8_t>(low >> 32);
+            uint8_t temp = cache;
+            do {
+                output.push_back(static_cast<uint8_t>(temp + carry));
+                temp = 0xFF;
+            } while (--cacheSize != 0);
+            cache = static_cast<uint8_t>(static_cast<uint32_t>(low) >> 24);
+        }
+        ++cacheSize;
+        low = (low & 0x00FFFFFFu) << 8;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Декодер - читает сжатые байты из потока по мере необходимости
+class CRangeDecoder {
+public:
+    explicit CRangeDecoder(std::istream& _input) : input(_input) {
+        for (int byteIndex = 0; byteIndex < 5; ++byteIndex) {
+            code = (code << 8) | readByte();
+        }
+    }
+
+    unsigned DecodeBit(CBitModel& model) {
+        const uint32_t bound = (range >> CBitModel::ProbBits) * model.ZeroProb;
+        unsigned bit = 0;
+        if (code < bound) {
+            range = bound;
+        } else {
+            code -= bound;
+            range -= bound;
+            bit = 1;
+        }
+        model.Update(bit);
+        normalize();
+        return bit;
+    }
+
+private:
+    static constexpr uint32_t topValue = 1u << 24;
+
+    std::istream& input;
+    uint32_t code{0};
+    uint32_t range{0xFFFFFFFFu};
+
+    uint32_t readByte() {
+        const auto value = input.get();
+        return value == std::istream::traits_type::eof() ? 0 : static_cast<uint32_t>(value);
+    }
+
+    void normalize() {
+        while (range < topValue) {
+            range <<= 8;
+            code = (code << 8) | readByte();
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Адаптивная модель символа из BitsNumber бит - двоичное дерево моделей бит
+template<int BitsNumber>
+struct CBitTreeModel {
+    CBitModel Models[1u << BitsNumber];
+
+    void Encode(CRangeEncoder& encoder, uint32_t symbol) {
+        uint32_t modelIndex = 1;
+        for (int bitIndex = BitsNumber - 1; bitIndex >= 0; --bitIndex) {
+            const unsigned bit = (symbol >> bitIndex) & 1u;
+            encoder.EncodeBit(Models[modelIndex], bit);
+            modelIndex = (modelIndex << 1) | bit;
+        }
+    }
+
+    uint32_t Decode(CRangeDecoder& decoder) {
+        uint32_t modelIndex = 1;
+        for (int bitIndex = 0; bitIndex < BitsNumber; ++bitIndex) {
+            modelIndex = (modelIndex << 1) | decoder.DecodeBit(Models[modelIndex]);
+        }
+        return modelIndex - (1u << BitsNumber);
+    }
+};
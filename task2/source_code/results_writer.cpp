@@ -0,0 +1,67 @@
+#include "results_writer.h"
+
+CIntermediateResultsWriter::CIntermediateResultsWriter(const std::string& _pathToResultsFolder,
+        const CGrayImage& _reference, size_t height, size_t width, size_t buffersNumber) :
+    pathToResultsFolder(_pathToResultsFolder),
+    reference(_reference),
+    isMetricsEnabled(!_reference.IsEmpty() && _reference.GetWidth() == width && _reference.GetHeight() == height)
+{
+    for (size_t bufferIndex = 0; bufferIndex < buffersNumber; ++bufferIndex) {
+        buffers.emplace_back(new CGrayImage(height, width));
+        freeBuffers.push_back(buffers.back().get());
+    }
+    writerThread = std::thread(&CIntermediateResultsWriter::writeSnapshots, this);
+}
+
+CIntermediateResultsWriter::~CIntermediateResultsWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isFinishing = true;
+    }
+    hasQueuedSnapshot.notify_one();
+    writerThread.join();
+}
+
+CGrayImage& CIntermediateResultsWriter::AcquireBuffer() {
+    std::unique_lock<std::mutex> lock(mutex);
+    hasFreeBuffer.wait(lock, [this] { return !freeBuffers.empty(); });
+    CGrayImage* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return *buffer;
+}
+
+void CIntermediateResultsWriter::Submit(size_t iteration, CGrayImage& snapshot) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queuedSnapshots.emplace_back(iteration, &snapshot);
+    }
+    hasQueuedSnapshot.notify_one();
+}
+
+// Цикл фонового потока: запись снимков в порядке поступления и возврат буферов в пул
+void CIntermediateResultsWriter::writeSnapshots() {
+    while (true) {
+        std::pair<size_t, CGrayImage*> queued;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            hasQueuedSnapshot.wait(lock, [this] { return isFinishing || !queuedSnapshots.empty(); });
+            if (queuedSnapshots.empty()) {
+                return;
+            }
+            queued = queuedSnapshots.front();
+            queuedSnapshots.pop_front();
+        }
+        const size_t iteration = queued.first;
+        const CGrayImage& snapshot = *queued.second;
+        snapshot.SaveToFile(pathToResultsFolder + "/result_" + std::to_string(iteration) + ".bmp");
+        if (isMetricsEnabled) {
+            const CMetrics& metrics = CalculateMetrics(snapshot, reference);
+            metrics.SaveToFile(pathToResultsFolder + "/metrics_" + std::to_string(iteration) + ".txt");
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBuffers.push_back(queued.second);
+        }
+        hasFreeBuffer.notify_one();
+    }
+}
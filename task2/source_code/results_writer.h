@@ -0,0 +1,42 @@
+#pragma once
+
+#include "image.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Фоновая запись промежуточных результатов декодирования (изображение и метрики итерации) на диск.
+// Снимки итераций кладутся в буферы из небольшого пула: пока все буферы ждут записи, AcquireBuffer блокируется,
+// поэтому очередь ограничена размером пула, а память не растет при медленном диске
+class CIntermediateResultsWriter {
+public:
+    // Метрики считаются, если эталон не пуст и совпадает по размеру со снимками
+    CIntermediateResultsWriter(const std::string& pathToResultsFolder, const CGrayImage& reference,
+        size_t height, size_t width, size_t buffersNumber = 3);
+    // Дописывает все поставленные в очередь снимки
+    ~CIntermediateResultsWriter();
+
+    // Свободный буфер под снимок итерации
+    CGrayImage& AcquireBuffer();
+    // Постановка заполненного буфера в очередь на запись
+    void Submit(size_t iteration, CGrayImage& snapshot);
+
+private:
+    const std::string pathToResultsFolder;
+    const CGrayImage& reference;
+    const bool isMetricsEnabled;
+    std::vector<std::unique_ptr<CGrayImage>> buffers;
+
+    std::mutex mutex;
+    std::condition_variable hasFreeBuffer;
+    std::condition_variable hasQueuedSnapshot;
+    std::vector<CGrayImage*> freeBuffers;
+    std::deque<std::pair<size_t, CGrayImage*>> queuedSnapshots;
+    bool isFinishing{false};
+    std::thread writerThread;
+
+    void writeSnapshots();
+};
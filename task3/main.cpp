@@ -1,58 +1,208 @@
 #include "image.h"
+#include "batch.h"
 #include "binarizer.h"
+#include "options.h"
+#include "strip_binarizer.h"
+#include "tiff_io.h"
+#include <chrono>
 #include <iostream>
-#include <time.h>
+
+namespace {
+// Неотрицательная целочисленная опция --name=N
+size_t getSizeOption(const CCommandLineArguments& args, const std::string& name, size_t defaultValue) {
+    if (!args.HasOption(name)) {
+        return defaultValue;
+    }
+    try {
+        return std::stoul(args.GetOption(name));
+    } catch(...) {
+        std::cerr << "Invalid --" << name << " option! Should be non-negative int." << std::endl;
+        return defaultValue;
+    }
+}
+}
 
 int main(int argc, char* argv[]) {
     uint8_t noiseLevel = CPyramidBinarizer::NoiseLevel;
     float sigmaMultiplier = CPyramidBinarizer::SigmaMultiplier;
     TBinarizationMode mode = CPyramidBinarizer::DefaultMode;
 
-    if (argc < 3 || argc > 5) {
+    const CCommandLineArguments args(argc, argv);
+    const auto& positional = args.Positional;
+    if (positional.size() < 2 || positional.size() > 4) {
         std::cerr << "Invalid number of arguments!" << std::endl;
+        return 1;
     }
-    std::string srcPath = argv[1];
-    std::string resPath = argv[2];
-    if (argc >= 4) {
-        mode = ChooseMode(argv[3]);
+    std::string srcPath = positional[0];
+    std::string resPath = positional[1];
+    if (positional.size() >= 3) {
+        try {
+            mode = ChooseMode(positional[2]);
+        } catch(const std::exception& exception) {
+            std::cerr << exception.what() << std::endl;
+            return 1;
+        }
     }
-    if (argc == 5) {
+    if (positional.size() == 4) {
         if (mode != BM_BySeparatedNoiseLevels) {
             try {
-                noiseLevel = std::stoi(argv[4]);
+                noiseLevel = std::stoi(positional[3]);
             } catch(...) {
                 std::cerr << "Invalid noiseLevel argument! Should be int." << std::endl;
             }
         } else {
             try {
-                sigmaMultiplier = std::stof(argv[4]);
+                sigmaMultiplier = std::stof(positional[3]);
             } catch(...) {
                 std::cerr << "Invalid sigma multiplier argument! Should be float." << std::endl;
             }
         }
     }
+    const size_t threadsNumber = getSizeOption(args, "threads", 0);
 
-    const CRGBImage srcColorImage(srcPath);
-    const size_t srcHeight = srcColorImage.GetHeight();
-    const size_t srcWidth = srcColorImage.GetWidth();
-    const size_t srcImageSize = srcWidth * srcHeight;
+    CBWTiffOptions tiffOptions;
+    tiffOptions.ThreadsNumber = threadsNumber;
+    try {
+        tiffOptions.Compression = ChooseTiffCompression(args.GetOption("compression", "g4"));
+    } catch(const std::exception& exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+    if (args.HasOption("rows-per-strip")) {
+        try {
+            tiffOptions.RowsPerStrip = std::max<size_t>(1, std::stoul(args.GetOption("rows-per-strip")));
+        } catch(...) {
+            std::cerr << "Invalid --rows-per-strip option! Should be positive int." << std::endl;
+        }
+    }
 
-    CGrayImage srcGrayImage(srcHeight, srcWidth);
-    ConvertRGBImageToGray(srcColorImage, srcGrayImage);
+    // Уменьшение при чтении и чтение сразу в серый (без цветного буфера)
+    const size_t reductionFactor = getSizeOption(args, "reduce", 1);
+    const bool grayDecode = args.HasOption("gray-decode");
 
-    const time_t binarizeTimeStart = clock();
-    CPyramidBinarizer binarizer(srcGrayImage, mode, noiseLevel, sigmaMultiplier);
-    std::shared_ptr<CBWImage> binarized = binarizer.Binarize();
-    const time_t binarizeTimeEnd = clock();
+    if (args.HasOption("batch")) {
+        CBatchOptions batchOptions;
+        batchOptions.Mode = mode;
+        batchOptions.NoiseLevel = noiseLevel;
+        batchOptions.NoiseSigmaMultiplier = sigmaMultiplier;
+        batchOptions.DecodeWorkersNumber = getSizeOption(args, "decode-workers", batchOptions.DecodeWorkersNumber);
+        batchOptions.BinarizeWorkersNumber = getSizeOption(args, "binarize-workers", threadsNumber);
+        batchOptions.EncodeWorkersNumber = getSizeOption(args, "encode-workers", batchOptions.EncodeWorkersNumber);
+        batchOptions.QueueSize = getSizeOption(args, "queue-size", batchOptions.QueueSize);
+        batchOptions.GrayDecode = grayDecode;
+        batchOptions.ReductionFactor = reductionFactor;
+        batchOptions.MaxPageHeight = getSizeOption(args, "max-page-height", 0);
+        batchOptions.MaxPageWidth = getSizeOption(args, "max-page-width", 0);
+        // Страницы сжимаются параллельно друг другу, поэтому каждая - в один поток
+        batchOptions.TiffOptions = tiffOptions;
+        batchOptions.TiffOptions.ThreadsNumber = 1;
+        std::vector<std::string> sourcePaths;
+        try {
+            sourcePaths = ListBatchSources(srcPath);
+        } catch(const std::exception& exception) {
+            std::cerr << exception.what() << std::endl;
+            return 1;
+        }
 
-    const auto binarizeTimeDiff = static_cast<double>(binarizeTimeEnd - binarizeTimeStart);
-    const auto binarizeTimeInSeconds = binarizeTimeDiff / CLOCKS_PER_SEC;
-    const auto binarizeRelativeTime = binarizeTimeInSeconds / srcImageSize / 1000;
+        CBatchBinarizer batchBinarizer(batchOptions);
+        const CBatchStats stats = batchBinarizer.Run(sourcePaths, resPath);
+        std::cout.precision(3);
+        std::cout << "Pages: " << stats.PagesNumber << " (failed " << stats.FailedPagesNumber << ")" << std::endl;
+        std::cout << "Batch full time: " << stats.TimeInSeconds << " seconds" << std::endl;
+        std::cout << "Throughput: " << stats.PagesNumber / stats.TimeInSeconds << " pages/sec" << std::endl;
+        return stats.FailedPagesNumber == 0 ? 0 : 1;
+    }
+
+    if (args.HasOption("stream")) {
+        const size_t storedLevel = getSizeOption(args, "stored-level", CStripBinarizer::AutoStoredLevel);
+        // TIFF читается построчно, остальные форматы (и уменьшаемый TIFF) OpenCV умеет читать только целиком
+        std::unique_ptr<CGrayRowSource> source;
+        std::unique_ptr<CGrayImage> srcGrayImage;
+        try {
+            if (IsTiffPath(srcPath) && reductionFactor == 1) {
+                source.reset(new CTiffGrayRowSource(srcPath));
+            } else {
+                srcGrayImage.reset(new CGrayImage());
+                if (grayDecode) {
+                    LoadReducedImage(srcPath, reductionFactor, *srcGrayImage);
+                } else {
+                    CRGBImage srcColorImage;
+                    LoadReducedImage(srcPath, reductionFactor, srcColorImage);
+                    srcGrayImage->Reset(srcColorImage.GetHeight(), srcColorImage.GetWidth());
+                    ConvertRGBImageToGray(srcColorImage, *srcGrayImage);
+                }
+                source.reset(new CGrayImageRowSource(*srcGrayImage));
+            }
+        } catch(const std::exception& exception) {
+            std::cerr << exception.what() << std::endl;
+            return 1;
+        }
+        const size_t srcImageSize = source->GetWidth() * source->GetHeight();
+
+        const auto binarizeTimeStart = std::chrono::steady_clock::now();
+        CStripBinarizer binarizer(*source, mode, noiseLevel, sigmaMultiplier, storedLevel);
+        try {
+            CBWTiffWriter writer(resPath, source->GetWidth(), source->GetHeight(), tiffOptions);
+            binarizer.Binarize([&writer](const CBWValue* row) { writer.WriteRow(row); });
+        } catch(const std::exception& exception) {
+            std::cerr << exception.what() << std::endl;
+            return 1;
+        }
+        const auto binarizeTimeEnd = std::chrono::steady_clock::now();
+
+        const auto binarizeTimeInSeconds = std::chrono::duration<double>(binarizeTimeEnd - binarizeTimeStart).count();
+        const auto binarizeRelativeTime = binarizeTimeInSeconds * 1000 / (srcImageSize / 1e6);
+
+        std::cout.precision(3);
+        std::cout << "Binarize full time (with reading and writing): " << binarizeTimeInSeconds << " seconds"
+            << std::endl;
+        std::cout << "Binarize relative time: " << binarizeRelativeTime << " msec/MP" << std::endl;
+        std::cout << "Buffers size: " << binarizer.GetBuffersSize() / 1024 << " KiB (stored level "
+            << binarizer.GetStoredLevel() << ")" << std::endl;
+        return 0;
+    }
+
+    // Цветное изображение переводится в серое внутри бинаризатора - вместе с построением нулевого уровня пирамид
+    CRGBImage srcColorImage;
+    CGrayImage srcGrayImage;
+    try {
+        if (grayDecode) {
+            LoadReducedImage(srcPath, reductionFactor, srcGrayImage);
+        } else {
+            LoadReducedImage(srcPath, reductionFactor, srcColorImage);
+        }
+    } catch(const std::exception& exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+    const size_t srcHeight = grayDecode ? srcGrayImage.GetHeight() : srcColorImage.GetHeight();
+    const size_t srcWidth = grayDecode ? srcGrayImage.GetWidth() : srcColorImage.GetWidth();
+    const size_t srcImageSize = srcWidth * srcHeight;
+
+    // Время меряется по настенным часам: clock() суммировал бы процессорное время всех потоков
+    const auto binarizeTimeStart = std::chrono::steady_clock::now();
+    std::unique_ptr<CPyramidBinarizer> binarizer(grayDecode ?
+        new CPyramidBinarizer(srcGrayImage, mode, noiseLevel, sigmaMultiplier, threadsNumber) :
+        new CPyramidBinarizer(srcColorImage, mode, noiseLevel, sigmaMultiplier, threadsNumber));
+    std::shared_ptr<CBWImage> binarized = binarizer->Binarize();
+    const auto binarizeTimeEnd = std::chrono::steady_clock::now();
+
+    const auto binarizeTimeInSeconds = std::chrono::duration<double>(binarizeTimeEnd - binarizeTimeStart).count();
+    const auto binarizeRelativeTime = binarizeTimeInSeconds * 1000 / (srcImageSize / 1e6);
 
     std::cout.precision(3);
     std::cout << "Binarize full time: " << binarizeTimeInSeconds << " seconds" << std::endl;
     std::cout << "Binarize relative time: " << binarizeRelativeTime << " msec/MP" << std::endl;
-    binarized->SaveToFile(resPath);
+
+    const auto saveTimeStart = std::chrono::steady_clock::now();
+    try {
+        SaveBWImageToTiff(*binarized, resPath, tiffOptions);
+    } catch(const std::exception& exception) {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+    const auto saveTimeInSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - saveTimeStart).count();
+    std::cout << "Save time: " << saveTimeInSeconds << " seconds" << std::endl;
 
     return 0;
 }
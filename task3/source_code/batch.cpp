@@ -0,0 +1,194 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+bool hasImageExtension(const std::filesystem::path& path) {
+    static const char* const imageExtensions[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".ppm", ".pgm"};
+    std::string extension = path.extension().string();
+    for (auto& symbol : extension) {
+        symbol = static_cast<char>(std::tolower(static_cast<unsigned char>(symbol)));
+    }
+    return std::find(std::begin(imageExtensions), std::end(imageExtensions), extension) != std::end(imageExtensions);
+}
+
+// Пути результатов: targetFolder/<имя без расширения>.tiff. Если имя без расширения встречается у нескольких
+// источников (a.jpg и a.png), расширение источника сохраняется (a.jpg.tiff); совпадающие и после этого имена
+// (одноименные файлы из разных папок списка) различаются номером источника
+std::vector<std::string> makeTargetPaths(const std::vector<std::string>& sourcePaths, const std::string& targetFolder) {
+    std::map<std::string, size_t> stemsNumbers;
+    for (const auto& sourcePath : sourcePaths) {
+        ++stemsNumbers[std::filesystem::path(sourcePath).stem().string()];
+    }
+    std::vector<std::string> names;
+    std::map<std::string, size_t> namesNumbers;
+    for (const auto& sourcePath : sourcePaths) {
+        const std::filesystem::path path(sourcePath);
+        names.push_back(stemsNumbers[path.stem().string()] > 1 ? path.filename().string() : path.stem().string());
+        ++namesNumbers[names.back()];
+    }
+    std::vector<std::string> targetPaths;
+    for (size_t sourceIndex = 0; sourceIndex < sourcePaths.size(); ++sourceIndex) {
+        std::string name = names[sourceIndex];
+        if (namesNumbers[name] > 1) {
+            name += "_" + std::to_string(sourceIndex);
+        }
+        targetPaths.push_back((std::filesystem::path(targetFolder) / name).string() + ".tiff");
+    }
+    return targetPaths;
+}
+
+// Потоки стадии конвейера: последний завершившийся поток закрывает выходную очередь стадии
+template<typename TWorkerFunction>
+void startStage(std::vector<std::thread>& threads, size_t workersNumber, const TWorkerFunction& workerFunction,
+                const std::function<void()>& onStageFinished) {
+    auto activeWorkersNumber = std::make_shared<std::atomic<size_t>>(workersNumber);
+    for (size_t workerIndex = 0; workerIndex < workersNumber; ++workerIndex) {
+        threads.emplace_back([=] {
+            workerFunction();
+            if (--*activeWorkersNumber == 0) {
+                onStageFinished();
+            }
+        });
+    }
+}
+}
+
+std::vector<std::string> ListBatchSources(const std::string& sourcePath) {
+    std::vector<std::string> sourcePaths;
+    if (std::filesystem::is_directory(sourcePath)) {
+        for (const auto& entry : std::filesystem::directory_iterator(sourcePath)) {
+            if (entry.is_regular_file() && hasImageExtension(entry.path())) {
+                sourcePaths.push_back(entry.path().string());
+            }
+        }
+        std::sort(sourcePaths.begin(), sourcePaths.end());
+        return sourcePaths;
+    }
+    std::ifstream listFile(sourcePath);
+    if (!listFile) {
+        throw std::runtime_error("Can't open " + sourcePath);
+    }
+    std::string line;
+    while (std::getline(listFile, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            sourcePaths.push_back(line);
+        }
+    }
+    return sourcePaths;
+}
+
+CBatchBinarizer::CBatchBinarizer(const CBatchOptions& _options) :
+    options(_options)
+{
+}
+
+CBatchStats CBatchBinarizer::Run(const std::vector<std::string>& sourcePaths, const std::string& targetFolder) {
+    const auto timeStart = std::chrono::steady_clock::now();
+    std::filesystem::create_directories(targetFolder);
+    const std::vector<std::string> targetPaths = makeTargetPaths(sourcePaths, targetFolder);
+
+    const size_t decodeWorkersNumber = std::max<size_t>(1, options.DecodeWorkersNumber);
+    const size_t binarizeWorkersNumber = GetThreadsNumber(options.BinarizeWorkersNumber);
+    const size_t encodeWorkersNumber = std::max<size_t>(1, options.EncodeWorkersNumber);
+    const size_t queueSize = std::max<size_t>(1, options.QueueSize);
+    // Страниц достаточно, чтобы заполнить обе очереди и занять все потоки; больше в памяти не бывает
+    const size_t pagesNumber = decodeWorkersNumber + binarizeWorkersNumber + encodeWorkersNumber + 2 * queueSize;
+    std::vector<std::unique_ptr<CPage>> pages;
+    CBoundedQueue<CPage*> freePages(pagesNumber);
+    for (size_t pageIndex = 0; pageIndex < pagesNumber; ++pageIndex) {
+        pages.emplace_back(new CPage());
+        freePages.Push(pages.back().get());
+    }
+    CBoundedQueue<CPage*> decodedPages(queueSize);
+    CBoundedQueue<CPage*> binarizedPages(queueSize);
+
+    std::atomic<size_t> nextSourceIndex{0};
+    std::atomic<size_t> failedPagesNumber{0};
+    std::mutex logMutex;
+    std::vector<std::thread> threads;
+
+    startStage(threads, decodeWorkersNumber, [&] {
+        // Цветной буфер у каждого потока свой и переиспользуется между страницами
+        CRGBImage colorImage;
+        for (size_t sourceIndex = nextSourceIndex++; sourceIndex < sourcePaths.size(); sourceIndex = nextSourceIndex++) {
+            CPage* page = nullptr;
+            freePages.Pop(page);
+            page->SourcePath = sourcePaths[sourceIndex];
+            page->TargetPath = targetPaths[sourceIndex];
+            page->Error.clear();
+            try {
+                if (options.GrayDecode) {
+                    LoadReducedImage(page->SourcePath, options.ReductionFactor, page->GrayImage);
+                } else {
+                    LoadReducedImage(page->SourcePath, options.ReductionFactor, colorImage);
+                    page->GrayImage.Reset(colorImage.GetHeight(), colorImage.GetWidth());
+                    ConvertRGBImageToGray(colorImage, page->GrayImage);
+                }
+            } catch(const std::exception& exception) {
+                page->Error = exception.what();
+            }
+            decodedPages.Push(page);
+        }
+    }, [&] { decodedPages.Close(); });
+
+    startStage(threads, binarizeWorkersNumber, [&] {
+        // Бинаризатор у каждого потока свой: арена пирамид и карт порогов переиспользуется между страницами.
+        // Страницы бинаризуются параллельно друг другу, поэтому внутри страницы - в один поток
+        CPyramidBinarizer binarizer(options.Mode, options.NoiseLevel, options.NoiseSigmaMultiplier, 1,
+                                    options.MaxPageHeight, options.MaxPageWidth);
+        CPage* page = nullptr;
+        while (decodedPages.Pop(page)) {
+            if (page->Error.empty()) {
+                try {
+                    binarizer.Binarize(page->GrayImage, page->BWImage);
+                } catch(const std::exception& exception) {
+                    page->Error = exception.what();
+                }
+            }
+            binarizedPages.Push(page);
+        }
+    }, [&] { binarizedPages.Close(); });
+
+    startStage(threads, encodeWorkersNumber, [&] {
+        CPage* page = nullptr;
+        while (binarizedPages.Pop(page)) {
+            if (page->Error.empty()) {
+                try {
+                    SaveBWImageToTiff(page->BWImage, page->TargetPath, options.TiffOptions);
+                } catch(const std::exception& exception) {
+                    page->Error = exception.what();
+                }
+            }
+            if (!page->Error.empty()) {
+                ++failedPagesNumber;
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cerr << page->SourcePath << ": " << page->Error << std::endl;
+            }
+            freePages.Push(page);
+        }
+    }, [] {});
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CBatchStats stats;
+    stats.PagesNumber = sourcePaths.size();
+    stats.FailedPagesNumber = failedPagesNumber;
+    stats.TimeInSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+    return stats;
+}
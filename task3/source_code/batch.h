@@ -0,0 +1,118 @@
+#pragma once
+
+#include "binarizer.h"
+#include "tiff_io.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Ограниченная очередь между стадиями конвейера: Push ждет, пока в очереди есть место, Pop - пока есть элемент
+template<typename TValue>
+class CBoundedQueue {
+public:
+    explicit CBoundedQueue(size_t _capacity) : capacity(_capacity) {}
+
+    void Push(TValue value);
+    // false - очередь закрыта и опустела
+    bool Pop(TValue& value);
+    // Элементов больше не будет: ждущие Pop просыпаются
+    void Close();
+
+private:
+    const size_t capacity;
+    std::deque<TValue> values;
+    bool isClosed{false};
+    std::mutex mutex;
+    std::condition_variable hasValue;
+    std::condition_variable hasSpace;
+};
+
+// Параметры пакетной бинаризации
+struct CBatchOptions {
+    TBinarizationMode Mode{CPyramidBinarizer::DefaultMode};
+    uint8_t NoiseLevel{CPyramidBinarizer::NoiseLevel};
+    float NoiseSigmaMultiplier{CPyramidBinarizer::SigmaMultiplier};
+    // Число потоков каждой стадии (0 для бинаризации - по числу ядер)
+    size_t DecodeWorkersNumber{1};
+    size_t BinarizeWorkersNumber{0};
+    size_t EncodeWorkersNumber{1};
+    // Емкость очередей между стадиями
+    size_t QueueSize{4};
+    // Чтение сразу в серый (яркостная компонента кодека) и уменьшение при чтении: 1, 2, 4 или 8 (см. LoadReducedImage)
+    bool GrayDecode{false};
+    size_t ReductionFactor{1};
+    // Ожидаемый наибольший размер страницы: под него заранее выделяются арены бинаризаторов
+    // (0 - арены растут по мере прихода страниц)
+    size_t MaxPageHeight{0};
+    size_t MaxPageWidth{0};
+    // Параметры сохранения, ThreadsNumber - потоков сжатия на одну страницу
+    CBWTiffOptions TiffOptions;
+};
+
+// Итоги пакетной бинаризации
+struct CBatchStats {
+    size_t PagesNumber{0};
+    size_t FailedPagesNumber{0};
+    double TimeInSeconds{0};
+};
+
+// Пакетная бинаризация: чтение с переводом в серый, бинаризация и сохранение идут конвейером из трех стадий,
+// связанных ограниченными очередями, у каждой стадии свое число потоков. Страницы (буферы серого
+// и ЧБ изображений) переиспользуются: их число ограничено, после сохранения страница возвращается к чтению
+class CBatchBinarizer {
+public:
+    explicit CBatchBinarizer(const CBatchOptions& options);
+
+    // Результат страницы sourcePaths[i] сохраняется в targetFolder/<имя без расширения>.tiff
+    // (при совпадении имен без расширения у нескольких источников - с расширением источника, см. batch.cpp)
+    CBatchStats Run(const std::vector<std::string>& sourcePaths, const std::string& targetFolder);
+
+private:
+    // Страница в конвейере
+    struct CPage {
+        std::string SourcePath;
+        std::string TargetPath;
+        CGrayImage GrayImage;
+        CBWImage BWImage;
+        // Непустая - страница не обработана, дальше по конвейеру она только передается
+        std::string Error;
+    };
+
+    const CBatchOptions options;
+};
+
+// Список изображений: все файлы с расширениями изображений в папке (по алфавиту) или пути из файла-списка по строке
+std::vector<std::string> ListBatchSources(const std::string& sourcePath);
+
+//////////////////////////////////////////////////////////////////////////
+
+template<typename TValue>
+void CBoundedQueue<TValue>::Push(TValue value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    hasSpace.wait(lock, [this] { return values.size() < capacity; });
+    values.push_back(std::move(value));
+    hasValue.notify_one();
+}
+
+template<typename TValue>
+bool CBoundedQueue<TValue>::Pop(TValue& value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    hasValue.wait(lock, [this] { return !values.empty() || isClosed; });
+    if (values.empty()) {
+        return false;
+    }
+    value = std::move(values.front());
+    values.pop_front();
+    hasSpace.notify_one();
+    return true;
+}
+
+template<typename TValue>
+void CBoundedQueue<TValue>::Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    isClosed = true;
+    hasValue.notify_all();
+}
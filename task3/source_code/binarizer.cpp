@@ -1,8 +1,11 @@
 #include "binarizer.h"
 
+#include <cassert>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include <stdexcept>
 
 TBinarizationMode ChooseMode(const std::string& modeName) {
     if (modeName == "avg") {
@@ -16,380 +19,308 @@ TBinarizationMode ChooseMode(const std::string& modeName) {
     } else if (modeName == "bySeparatedNoiseLevels") {
         return BM_BySeparatedNoiseLevels;
     } else {
-        assert(false);
-        return BM_Avg;
+        throw std::runtime_error("Unknown binarization mode " + modeName +
+            " (avg, center, centerMinWeighted, avgCenterWeighted or bySeparatedNoiseLevels allowed)");
     }
 }
 
 namespace {
-inline size_t getMaxSqueezeDegree(size_t sideSize) {
-    size_t deg = 1u;
-    for (size_t val = 2u; val < sideSize; val <<= 1u, ++deg) {}
-    return deg - 1;
-}
+// Полоса строк должна вместе с соответствующими строками предыдущего уровня помещаться в кэш ядра
+constexpr size_t bandPixelsNumber = 1u << 15;
+constexpr size_t minBandHeight = 4;
+
+// Полосы подсчета дисперсий выше обычных: на каждую дочитывается 2 * CNoiseStatsAccumulator::Radius строк
+constexpr size_t deviationBandHeight = 256;
 
-inline size_t getDivisibleSideSize(size_t srcSideSize, size_t depth) {
-    const size_t multiplier = (1 << depth);
-    const size_t remainder = srcSideSize % multiplier;
-    return (remainder == 0) ? srcSideSize : srcSideSize + (multiplier - remainder);
+inline size_t getBandHeight(size_t rowWidth) {
+    return std::max(minBandHeight, bandPixelsNumber / std::max<size_t>(rowWidth, 1));
 }
 }
 
-CPyramidBinarizer::CPyramidBinarizer(const CGrayImage& grayImage, TBinarizationMode _mode,
-                                     uint8_t _noiseLevel, float _noiseSigmaMultiplier) :
+CPyramidBinarizer::CPyramidBinarizer(TBinarizationMode _mode, uint8_t _noiseLevel, float _noiseSigmaMultiplier,
+                                     size_t threadsNumber, size_t maxHeight, size_t maxWidth) :
     mode(_mode),
-    width(grayImage.GetWidth()),
-    height(grayImage.GetHeight()),
-    srcGrayImage(grayImage),
-    depth(getMaxSqueezeDegree(std::min(height, width))),
     noiseLevel(_noiseLevel),
     noiseSigmaMultiplier(_noiseSigmaMultiplier),
-    minPyramid(new CGrayImage[depth]),
-    maxPyramid(new CGrayImage[depth]),
-    avgPyramid(new CGrayImage[depth])
+    threadPool(threadsNumber)
 {
-    for (size_t i = 0; i < binsNumber; ++i) {
-        varSum[i] = 0;
-        numberPerBin[i] = 0;
+    if (maxHeight != 0 && maxWidth != 0) {
+        setImageSize(maxHeight, maxWidth);
+        reserveArena(layoutArena(nullptr));
     }
-    if (mode == BM_BySeparatedNoiseLevels) {
-        prepareDeviationStats();
-    }
-    prepareExtended();
-    preparePyramids();
-    const size_t extWidth = extendedImage.IsEmpty() ? width : extendedImage.GetWidth();
-    const size_t extHeight = extendedImage.IsEmpty() ? height : extendedImage.GetHeight();
-    const size_t extSize = extWidth * extHeight;
-    prevThresMap = new uint8_t[extSize];
-    currThresMap = new uint8_t[extSize];
 }
 
-CPyramidBinarizer::~CPyramidBinarizer() {
-    delete [] minPyramid;
-    delete [] maxPyramid;
-    delete [] avgPyramid;
-    delete [] prevThresMap;
-    delete [] currThresMap;
+CPyramidBinarizer::CPyramidBinarizer(const CGrayImage& grayImage, TBinarizationMode _mode,
+                                     uint8_t _noiseLevel, float _noiseSigmaMultiplier, size_t threadsNumber) :
+    CPyramidBinarizer(_mode, _noiseLevel, _noiseSigmaMultiplier, threadsNumber)
+{
+    prepareImage(&grayImage, nullptr);
 }
 
-std::shared_ptr<CBWImage> CPyramidBinarizer::Binarize() {
-    static const uint8_t blackColor = 0;
-    static const uint8_t whiteColor = 1;
+CPyramidBinarizer::CPyramidBinarizer(const CRGBImage& colorImage, TBinarizationMode _mode,
+                                     uint8_t _noiseLevel, float _noiseSigmaMultiplier, size_t threadsNumber) :
+    CPyramidBinarizer(_mode, _noiseLevel, _noiseSigmaMultiplier, threadsNumber)
+{
+    prepareImage(nullptr, &colorImage);
+}
 
-    std::shared_ptr<CBWImage> bwImage(new CBWImage(height, width));
-    buildThresholdMap();
+CPyramidBinarizer::~CPyramidBinarizer() {
+    delete [] arenaBuffer;
+}
 
-    const size_t extWidth = extendedImage.IsEmpty() ? width : extendedImage.GetWidth();
-    const size_t extHeight = extendedImage.IsEmpty() ? height : extendedImage.GetHeight();
-    const size_t xPadding = extWidth - width;
-    const size_t yPadding = extHeight - height;
-    const size_t topPadding = yPadding / 2;
-    const size_t leftPadding = xPadding / 2;
+void CPyramidBinarizer::setImageSize(size_t _height, size_t _width) {
+    height = _height;
+    width = _width;
+    depth = GetMaxSqueezeDegree(std::min(height, width));
+    assert(depth <= maxDepth);
+    padding = GetImagePadding(height, width, depth);
+}
 
-    auto thresholdMapRowBuffer = currThresMap + topPadding * extWidth + leftPadding;
-    auto srcImageRowBuffer = srcGrayImage.GetBuffer();
-    auto bwImageRowBuffer = bwImage->GetBuffer();
-    for (size_t rowIndex = 0; rowIndex < height; ++rowIndex) {
-        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
-            bwImageRowBuffer[columnIndex] = (srcImageRowBuffer[columnIndex] < thresholdMapRowBuffer[columnIndex])
-                ? blackColor : whiteColor;
-        }
-        thresholdMapRowBuffer += extWidth;
-        bwImageRowBuffer += width;
-        srcImageRowBuffer += width;
+size_t CPyramidBinarizer::layoutArena(uint8_t* arenaStart) {
+    size_t offset = 0;
+    // Каждый буфер начинается с границы строки кэша: полосы разных потоков не делят строки кэша на стыках буферов
+    const auto allocate = [&](size_t size) {
+        uint8_t* buffer = (arenaStart != nullptr) ? arenaStart + offset : nullptr;
+        offset += (size + ArenaAlignment - 1) / ArenaAlignment * ArenaAlignment;
+        return buffer;
+    };
+    for (size_t level = 0; level < depth; ++level) {
+        CPyramidLevel& pyramidLevel = levels[level];
+        pyramidLevel.Height = GetLevelSideSize(height, padding.Top, level);
+        pyramidLevel.Width = GetLevelSideSize(width, padding.Left, level);
+        const size_t levelSize = pyramidLevel.Width * pyramidLevel.Height;
+        pyramidLevel.Min = allocate(levelSize);
+        pyramidLevel.Max = allocate(levelSize);
+        pyramidLevel.Avg = allocate(levelSize);
     }
-    return bwImage;
+    // Самая большая карта порогов - итоговая, размера исходного изображения (у изображений в несколько пикселей -
+    // нулевого уровня с ячейками дополнения)
+    const size_t thresholdMapSize = std::max(width * height, levels[0].Width * levels[0].Height);
+    prevThresMap = allocate(thresholdMapSize);
+    currThresMap = allocate(thresholdMapSize);
+    if (srcColorImage != nullptr) {
+        convertedGrayBuffer = allocate(width * height);
+        srcGrayBuffer = convertedGrayBuffer;
+    }
+    return offset;
 }
 
-void CPyramidBinarizer::buildThresholdMap() {
-    const size_t maxSqueezedWidth = avgPyramid[depth - 1].GetWidth();
-    const size_t maxSqueezedHeight = avgPyramid[depth - 1].GetHeight();
-    const size_t maxSqueezedSize = maxSqueezedWidth * maxSqueezedHeight;
-    std::copy_n(avgPyramid[depth - 1].GetBuffer(), maxSqueezedSize, currThresMap);
+void CPyramidBinarizer::reserveArena(size_t size) {
+    if (size <= arenaSize) {
+        return;
+    }
+    delete [] arenaBuffer;
+    arenaBuffer = new uint8_t[size + ArenaAlignment - 1];
+    const auto address = reinterpret_cast<uintptr_t>(arenaBuffer);
+    arena = arenaBuffer + ((ArenaAlignment - address % ArenaAlignment) % ArenaAlignment);
+    arenaSize = size;
+}
 
-    for (size_t level = depth - 1; level != static_cast<size_t>(-1); --level) {
-        const size_t currMapWidth = avgPyramid[level].GetWidth();
-        const size_t currMapHeight = avgPyramid[level].GetHeight();
-        if (level != depth - 1) {
-            const auto minPyramidBuffer = minPyramid[level].GetBuffer();
-            const auto maxPyramidBuffer = maxPyramid[level].GetBuffer();
-            const auto avgPyramidBuffer = avgPyramid[level].GetBuffer();
-            size_t mapIndex = 0;
-            switch(mode) {
-                case BM_Avg:
-                    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-                        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex, ++mapIndex) {
-                            const auto maxValue = maxPyramidBuffer[mapIndex];
-                            const auto minValue = minPyramidBuffer[mapIndex];
-                            if (maxValue - minValue > noiseLevel) {
-                                currThresMap[mapIndex] = avgPyramidBuffer[mapIndex];
-                            }
-                        }
-                    }
-                    break;
-                case BM_Center:
-                    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-                        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex, ++mapIndex) {
-                            const auto maxValue = maxPyramidBuffer[mapIndex];
-                            const auto minValue = minPyramidBuffer[mapIndex];
-                            if (maxValue - minValue > noiseLevel) {
-                                currThresMap[mapIndex] = (maxPyramidBuffer[mapIndex] + minPyramidBuffer[mapIndex] + 1) / 2;
-                            }
-                        }
-                    }
-                    break;
-                case BM_CenterMinWeighted:
-                    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-                        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex, ++mapIndex) {
-                            const auto maxValue = maxPyramidBuffer[mapIndex];
-                            const auto minValue = minPyramidBuffer[mapIndex];
-                            if (maxValue - minValue > noiseLevel) {
-                                const auto medValue = (minValue + maxValue) / 2;
-                                currThresMap[mapIndex] = (minValue + medValue * 2 + 1) / 3;
-                            }
-                        }
-                    }
-                    break;
-                case BM_AvgCenterWeighted:
-                    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-                        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex, ++mapIndex) {
-                            const auto maxValue = maxPyramidBuffer[mapIndex];
-                            const auto minValue = minPyramidBuffer[mapIndex];
-                            if (maxValue - minValue > noiseLevel) {
-                                const auto medValue = (minValue + maxValue) / 2;
-                                const auto avgValue = avgPyramidBuffer[mapIndex];
-                                currThresMap[mapIndex] = (medValue + avgValue + 1) / 2;
-                            }
-                        }
-                    }
-                    break;
-                case BM_BySeparatedNoiseLevels:
-                    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-                        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex, ++mapIndex) {
-                            const auto maxValue = maxPyramidBuffer[mapIndex];
-                            const auto minValue = minPyramidBuffer[mapIndex];
-                            const auto avgValue = avgPyramidBuffer[mapIndex];
-                            if (maxValue - minValue > static_cast<int>(noiseSigmaMultiplier * varSum[avgValue / valuesPerBin])) {
-                                currThresMap[mapIndex] = (minValue + maxValue) / 2;
-                            }
-                        }
-                    }
-                    break;
-                default:
-                    assert(false);
-            }
+void CPyramidBinarizer::prepareImage(const CGrayImage* grayImage, const CRGBImage* colorImage) {
+    assert((grayImage == nullptr) != (colorImage == nullptr));
+    if (grayImage != nullptr) {
+        setImageSize(grayImage->GetHeight(), grayImage->GetWidth());
+        srcGrayBuffer = grayImage->GetBuffer();
+    } else {
+        setImageSize(colorImage->GetHeight(), colorImage->GetWidth());
+    }
+    srcColorImage = colorImage;
+    reserveArena(layoutArena(nullptr));
+    layoutArena(arena);
+
+    for (size_t i = 0; i < binsNumber; ++i) {
+        varSum[i] = 0;
+    }
+    if (mode == BM_BySeparatedNoiseLevels) {
+        // Статистике шума нужно все серое изображение еще до построения пирамид
+        if (srcColorImage != nullptr) {
+            processBands(height, width, [&](size_t beginRow, size_t endRow) {
+                convertColorRows(beginRow, endRow);
+            });
+            srcColorImage = nullptr;
         }
-        std::swap(prevThresMap, currThresMap);
-        upsampleThresholdMap(currMapWidth, currMapHeight);
+        prepareDeviationStats();
+    }
+    // Правило режима bySeparatedNoiseLevels зависит от статистик шума изображения
+    if (!hasCustomRefinement && (!refineRow || mode == BM_BySeparatedNoiseLevels)) {
+        refineRow = ChooseRefineRowFunction(CRefinementParameters{mode, noiseLevel, noiseSigmaMultiplier, varSum});
     }
+    preparePyramids();
+    srcColorImage = nullptr;
 }
 
-void CPyramidBinarizer::upsampleThresholdMap(size_t currMapWidth, size_t currMapHeight) {
-    static const uint8_t centerWeight = 9;
-    static const uint8_t ortoWeight = 3;
-    static const uint8_t diagWeight = 1;
-    static const uint8_t sumWeight = centerWeight + 2 * ortoWeight + diagWeight;
-    static const uint8_t sumWeightHalf = sumWeight / 2;
+template<typename TBandFunction>
+void CPyramidBinarizer::processBands(size_t rowsNumber, size_t rowWidth, const TBandFunction& bandFunction) {
+    const size_t bandHeight = getBandHeight(rowWidth);
+    const size_t bandsNumber = (rowsNumber + bandHeight - 1) / bandHeight;
+    threadPool.ParallelFor(bandsNumber, [&](size_t bandIndex) {
+        const size_t beginRow = bandIndex * bandHeight;
+        bandFunction(beginRow, std::min(beginRow + bandHeight, rowsNumber));
+    });
+}
 
-    const size_t upMapWidth = 2 * currMapWidth;
-    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
-        auto currRow = prevThresMap + currMapWidth * rowIndex;
-        auto prevRow = std::max(currRow - currMapWidth, prevThresMap);
-        auto nextRow = std::min(currRow + currMapWidth, prevThresMap + currMapHeight * currMapWidth);
-        auto upTopRow = currThresMap + 2 * rowIndex * upMapWidth;
-        auto upBotRow = upTopRow + upMapWidth;
-        for (size_t columnIndex = 0; columnIndex < currMapWidth; ++columnIndex) {
-            const size_t prevIndex = std::max<size_t>(columnIndex, 1) - 1;
-            const size_t nextIndex = std::min<size_t>(columnIndex + 1, currMapWidth - 1);
+void CPyramidBinarizer::Binarize(const CGrayImage& grayImage, CBWImage& bwImage) {
+    prepareImage(&grayImage, nullptr);
+    Binarize(bwImage);
+}
 
-            const uint8_t curr = currRow[columnIndex];
-            const uint8_t north = prevRow[columnIndex];
-            const uint8_t south = nextRow[columnIndex];
-            const uint8_t west = currRow[prevIndex];
-            const uint8_t east = currRow[nextIndex];
-            const uint8_t northWest = prevRow[prevIndex];
-            const uint8_t northEast = prevRow[nextIndex];
-            const uint8_t southWest = nextRow[prevIndex];
-            const uint8_t southEast = nextRow[nextIndex];
+void CPyramidBinarizer::Binarize(const CRGBImage& colorImage, CBWImage& bwImage) {
+    prepareImage(nullptr, &colorImage);
+    Binarize(bwImage);
+}
 
-            const uint16_t centerWeighted = centerWeight * curr;
-            const uint16_t northWeighted = north * ortoWeight;
-            const uint16_t southWeighted = south * ortoWeight;
-            const uint16_t westWeighted = west * ortoWeight;
-            const uint16_t eastWeighted = east * ortoWeight;
+std::shared_ptr<CBWImage> CPyramidBinarizer::Binarize() {
+    std::shared_ptr<CBWImage> bwImage(new CBWImage(height, width));
+    Binarize(*bwImage);
+    return bwImage;
+}
 
-            const uint8_t topLeft = (centerWeighted + northWeighted + westWeighted + diagWeight * northWest + sumWeightHalf) / sumWeight;
-            const uint8_t topRight = (centerWeighted + northWeighted + eastWeighted + diagWeight * northEast + sumWeightHalf) / sumWeight;
-            const uint8_t botLeft = (centerWeighted + southWeighted + westWeighted + diagWeight * southWest + sumWeightHalf) / sumWeight;
-            const uint8_t botRight = (centerWeighted + southWeighted + eastWeighted + diagWeight * southEast + sumWeightHalf) / sumWeight;
+void CPyramidBinarizer::Binarize(CBWImage& bwImage) {
+    assert(srcGrayBuffer != nullptr);
+    bwImage.Reset(height, width);
+    buildThresholdMap();
 
-            const size_t posIndex = 2 * columnIndex;
-            upTopRow[posIndex] = topLeft;
-            upBotRow[posIndex] = botLeft;
-            upTopRow[posIndex + 1] = topRight;
-            upBotRow[posIndex + 1] = botRight;
+    const auto thresholdMapBuffer = currThresMap;
+    const auto srcImageBuffer = srcGrayBuffer;
+    const auto bwImageBuffer = bwImage.GetBuffer();
+    const size_t bwRowSize = bwImage.GetRowSize();
+    processBands(height, width, [&](size_t beginRow, size_t endRow) {
+        for (size_t rowIndex = beginRow; rowIndex < endRow; ++rowIndex) {
+            BinarizeRow(srcImageBuffer + rowIndex * width, thresholdMapBuffer + rowIndex * width,
+                        bwImageBuffer + rowIndex * bwRowSize, width);
         }
-    }
+    });
 }
 
-void CPyramidBinarizer::prepareExtended() {
-    const size_t extHeight = getDivisibleSideSize(height, depth);
-    const size_t extWidth = getDivisibleSideSize(width, depth);
-    assert(extWidth >= width && extHeight >= height);
-    assert(depth >= 1);
-    if (height != extHeight || width != extWidth) {
-        new(&extendedImage) CGrayImage(extHeight, extWidth);
-        const size_t yPadding = extHeight - height;
-        const size_t xPadding = extWidth - width;
-        const size_t leftPadding = xPadding / 2;
-        const size_t topPadding = yPadding / 2;
+void CPyramidBinarizer::buildThresholdMap() {
+    const CPyramidLevel& topLevel = levels[depth - 1];
+    std::copy_n(topLevel.Avg, topLevel.Width * topLevel.Height, currThresMap);
+    clampThresholdMapBorders(depth - 1);
 
-        auto srcBuffer = srcGrayImage.GetBuffer();
-        auto extendedRowBuffer = extendedImage.GetBuffer();
-        for (size_t rowIndex = 0; rowIndex < extHeight; ++rowIndex) {
-            const size_t rowOffset = std::min(std::max(rowIndex, topPadding) - topPadding, height - 1);
-            const uint8_t* rowBuffer = srcBuffer + width * rowOffset;
-            for (size_t columnIndex = 0; columnIndex < extWidth; ++columnIndex) {
-                const size_t columnOffset = std::min(std::max(columnIndex, leftPadding) - leftPadding, width - 1);
-                extendedRowBuffer[columnIndex] = rowBuffer[columnOffset];
-            }
-            extendedRowBuffer += extWidth;
+    for (size_t level = depth - 1; level != static_cast<size_t>(-1); --level) {
+        const size_t currMapWidth = levels[level].Width;
+        const size_t currMapHeight = levels[level].Height;
+        if (level != depth - 1) {
+            processBands(currMapHeight, currMapWidth, [&](size_t beginRow, size_t endRow) {
+                refineThresholdMapRows(level, beginRow, endRow);
+            });
+            clampThresholdMapBorders(level);
         }
+        std::swap(prevThresMap, currThresMap);
+        upsampleThresholdMap(level, currMapWidth, currMapHeight);
     }
 }
 
-void CPyramidBinarizer::prepareDeviationStats() {
-    const CGrayImage& srcImage = extendedImage.IsEmpty() ? srcGrayImage : extendedImage;
-    const size_t srcHeight = srcImage.GetHeight();
-    const size_t srcWidth = srcImage.GetWidth();
+void CPyramidBinarizer::refineThresholdMapRows(size_t level, size_t beginRow, size_t endRow) {
+    const CPyramidLevel& pyramidLevel = levels[level];
+    const size_t currMapWidth = pyramidLevel.Width;
+    for (size_t rowIndex = beginRow; rowIndex < endRow; ++rowIndex) {
+        const size_t rowOffset = rowIndex * currMapWidth;
+        refineRow(pyramidLevel.Min + rowOffset, pyramidLevel.Max + rowOffset, pyramidLevel.Avg + rowOffset,
+                  currThresMap + rowOffset, currMapWidth);
+    }
+}
 
-    uint64_t* sumSqTable = new uint64_t[(srcHeight + 1) * (srcWidth + 1)];
-    uint64_t* sumTable = new uint64_t[(srcHeight + 1) * (srcWidth + 1)];
-    for (size_t i = 0; i < srcWidth + 1; ++i) {
-        sumSqTable[i] = 0;
-        sumTable[i] = 0;
+void CPyramidBinarizer::clampThresholdMapBorders(size_t level) {
+    const CLevelBorders borders = GetLevelBorders(height, width, padding, level);
+    const size_t currMapWidth = levels[level].Width;
+    const size_t currMapHeight = levels[level].Height;
+    for (size_t rowIndex = 0; rowIndex < currMapHeight; ++rowIndex) {
+        ClampBorderThresholds(borders, currThresMap + rowIndex * currMapWidth, currMapWidth);
     }
-    for (size_t i = 1; i < srcHeight + 1; ++i) {
-        const auto currRowOffset = (srcWidth + 1) * i;
-        const auto prevRowOffset = (srcWidth + 1) * (i - 1);
-        sumSqTable[currRowOffset] = 0;
-        sumTable[currRowOffset] = 0;
-        for (size_t j = 1; j < srcWidth + 1; ++j) {
-            const auto value = srcImage.GetValue(i - 1, j - 1);
-            sumSqTable[currRowOffset + j] = sumSqTable[prevRowOffset + j] + value * value;
-            sumTable[currRowOffset + j] = sumTable[prevRowOffset + j] + value;
-        }
+    if (!borders.Top) {
+        std::copy_n(currThresMap + currMapWidth, currMapWidth, currThresMap);
     }
-    for (size_t i = 1; i < srcHeight + 1; ++i) {
-        const auto rowOffset = i * (srcWidth + 1);
-        for (size_t j = 1; j < srcWidth + 1; ++j) {
-            sumSqTable[rowOffset + j] += sumSqTable[rowOffset + (j - 1)];
-            sumTable[rowOffset + j] += sumTable[rowOffset + (j - 1)];
-        }
+    if (!borders.Bottom) {
+        std::copy_n(currThresMap + (currMapHeight - 2) * currMapWidth, currMapWidth,
+                    currThresMap + (currMapHeight - 1) * currMapWidth);
     }
-    uint64_t* sqAreaTable = sumSqTable + (srcWidth + 1) + 1;
-    uint64_t* areaTable = sumTable + (srcWidth + 1) + 1;
-
-    const size_t radius = 16;
-    for (size_t i = 0; i < srcHeight; ++i) {
-        const size_t top = (i >= radius) ? (i - radius) : 0;
-        const size_t bot = (i + radius > srcHeight - 1) ? srcHeight - 1 : i + radius;
-        const size_t vertNumber = bot - top + 1;
-        const auto botOffset = bot * (srcWidth + 1);
-        const auto topOffset = (top - 1) * (srcWidth + 1);
-        for (size_t j = 0; j < srcWidth; ++j) {
-            const uint64_t left = (j >= radius) ? (j - radius) : 0;
-            const uint64_t right = (j + radius > srcWidth - 1) ? srcWidth - 1 : j + radius;
-            const uint64_t horNumber = right - left + 1;
-            const uint64_t pixelsNumber = horNumber * vertNumber;
-            const uint64_t pixelsHalf = pixelsNumber / 2;
+}
 
-            const auto cSqVal = sqAreaTable[botOffset + right];
-            const auto aSqVal = sqAreaTable[topOffset + left - 1];
-            const auto bSqVal = sqAreaTable[topOffset + right];
-            const auto dSqVal = sqAreaTable[botOffset + left - 1];
-            const auto secondMoment = (cSqVal + aSqVal - bSqVal - dSqVal + pixelsHalf) / pixelsNumber;
+void CPyramidBinarizer::upsampleThresholdMap(size_t level, size_t currMapWidth, size_t currMapHeight) {
+    const size_t upMapWidth = (level == 0) ? width : levels[level - 1].Width;
+    const size_t upMapHeight = (level == 0) ? height : levels[level - 1].Height;
+    processBands(upMapHeight, upMapWidth, [&](size_t beginRow, size_t endRow) {
+        upsampleThresholdMapRows(level, currMapWidth, currMapHeight, upMapWidth, beginRow, endRow);
+    });
+}
 
-            const auto cVal = areaTable[botOffset + right];
-            const auto aVal = areaTable[topOffset + left - 1];
-            const auto bVal = areaTable[topOffset + right];
-            const auto dVal = areaTable[botOffset + left - 1];
-            const auto firstMoment = (cVal + aVal - bVal - dVal + pixelsHalf) / pixelsNumber;
+void CPyramidBinarizer::upsampleThresholdMapRows(size_t level, size_t currMapWidth, size_t currMapHeight,
+                                                 size_t upMapWidth, size_t beginRow, size_t endRow) {
+    const size_t rowShift = GetLevelShift(padding.Top, level);
+    const size_t columnShift = GetLevelShift(padding.Left, level);
+    for (size_t upRowIndex = beginRow; upRowIndex < endRow; ++upRowIndex) {
+        const size_t rowIndex = GetCoveringRow(upRowIndex, rowShift);
+        const size_t vertRowIndex = GetVerticalNeighbourRow(upRowIndex, rowShift, currMapHeight);
+        UpsampleThresholdRow(prevThresMap + currMapWidth * rowIndex, prevThresMap + currMapWidth * vertRowIndex,
+                             currThresMap + upMapWidth * upRowIndex, currMapWidth, upMapWidth, columnShift);
+    }
+}
 
-            const auto firstSquared = firstMoment * firstMoment;
-            const auto var = secondMoment >= firstSquared ? secondMoment - firstSquared : 0;
+void CPyramidBinarizer::convertColorRows(size_t beginRow, size_t endRow) {
+    ConvertRGBRowToGray(srcColorImage->GetBuffer() + beginRow * width, convertedGrayBuffer + beginRow * width,
+                        (endRow - beginRow) * width);
+}
 
-            if (var != 0) {
-                auto varBin = firstMoment / 16;
-                ++numberPerBin[varBin];
-                varSum[varBin] += var;
-            }
-        }
-    }
-    for (size_t i = 0; i < binsNumber; ++i) {
-        if (numberPerBin[i] != 0) {
-            varSum[i] /= numberPerBin[i];
-            varSum[i] = round(sqrt(varSum[i]));
+void CPyramidBinarizer::prepareDeviationStats() {
+    // Полосы считаются независимо, каждая дочитывает по Radius строк окна сверху и снизу
+    const size_t bandsNumber = (height + deviationBandHeight - 1) / deviationBandHeight;
+    CNoiseHistogram histogram;
+    std::mutex histogramMutex;
+    threadPool.ParallelFor(bandsNumber, [&](size_t bandIndex) {
+        const size_t beginRow = bandIndex * deviationBandHeight;
+        CNoiseStatsAccumulator bandStats(width, height, beginRow, std::min(beginRow + deviationBandHeight, height));
+        for (size_t rowIndex = bandStats.GetFirstInputRow(); rowIndex < bandStats.GetEndInputRow(); ++rowIndex) {
+            bandStats.AddRow(srcGrayBuffer + rowIndex * width);
         }
-    }
-
-    delete [] sumSqTable;
-    delete [] sumTable;
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        histogram.Merge(bandStats.GetHistogram());
+    });
+    histogram.GetSigmaPerBin(varSum);
 }
 
 void CPyramidBinarizer::preparePyramids() {
-    const CGrayImage* prevMinPyramid = extendedImage.IsEmpty() ? &srcGrayImage : &extendedImage;
-    const CGrayImage* prevMaxPyramid = prevMinPyramid;
-    const CGrayImage* prevAvgPyramid = prevMinPyramid;
-
+    // Нижняя строка ячеек дополнения строится после полос: при бинаризации цветного изображения она читает
+    // последнюю исходную строку, которую переводит в серое полоса с последней строкой изображения
     for (size_t pyramidIndex = 0; pyramidIndex < depth; ++pyramidIndex) {
-        const size_t prevPyramidHeight = prevMinPyramid->GetHeight();
-        const size_t prevPyramidWidth = prevMinPyramid->GetWidth();
-        const size_t currPyramidHeight = prevPyramidHeight / 2;
-        const size_t currPyramidWidth = prevPyramidWidth / 2;
-
-        new(&minPyramid[pyramidIndex]) CGrayImage(currPyramidHeight, currPyramidWidth);
-        new(&maxPyramid[pyramidIndex]) CGrayImage(currPyramidHeight, currPyramidWidth);
-        new(&avgPyramid[pyramidIndex]) CGrayImage(currPyramidHeight, currPyramidWidth);
-
-        auto prevMinPyramidTopRowBuffer = prevMinPyramid->GetBuffer();
-        auto prevMaxPyramidTopRowBuffer = prevMaxPyramid->GetBuffer();
-        auto prevAvgPyramidTopRowBuffer = prevAvgPyramid->GetBuffer();
-        auto prevMinPyramidBotRowBuffer = prevMinPyramidTopRowBuffer + prevPyramidWidth;
-        auto prevMaxPyramidBotRowBuffer = prevMaxPyramidTopRowBuffer + prevPyramidWidth;
-        auto prevAvgPyramidBotRowBuffer = prevAvgPyramidTopRowBuffer + prevPyramidWidth;
-
-        auto currMinPyramidBuffer = minPyramid[pyramidIndex].GetBuffer();
-        auto currMaxPyramidBuffer = maxPyramid[pyramidIndex].GetBuffer();
-        auto currAvgPyramidBuffer = avgPyramid[pyramidIndex].GetBuffer();
-
-        const size_t pyramidRowStepOffset = 2 * prevPyramidWidth;
-        for (size_t rowIndex = 0; rowIndex < currPyramidHeight; ++rowIndex) {
-            for (size_t columnIndex = 0; columnIndex < currPyramidWidth; ++columnIndex) {
-                currMinPyramidBuffer[columnIndex] = std::min({
-                    prevMinPyramidTopRowBuffer[2 * columnIndex], prevMinPyramidTopRowBuffer[2 * columnIndex + 1],
-                    prevMinPyramidBotRowBuffer[2 * columnIndex], prevMinPyramidBotRowBuffer[2 * columnIndex + 1]});
-                currMaxPyramidBuffer[columnIndex] = std::max({
-                    prevMaxPyramidTopRowBuffer[2 * columnIndex], prevMaxPyramidTopRowBuffer[2 * columnIndex + 1],
-                    prevMaxPyramidBotRowBuffer[2 * columnIndex], prevMaxPyramidBotRowBuffer[2 * columnIndex + 1]});
-                currAvgPyramidBuffer[columnIndex] =
-                    (prevAvgPyramidTopRowBuffer[2 * columnIndex] + prevAvgPyramidTopRowBuffer[2 * columnIndex + 1] +
-                    prevAvgPyramidBotRowBuffer[2 * columnIndex] + prevAvgPyramidBotRowBuffer[2 * columnIndex + 1] + 2) / 4;
-            }
+        const size_t lastRow = levels[pyramidIndex].Height - 1;
+        processBands(lastRow, levels[pyramidIndex].Width, [&](size_t beginRow, size_t endRow) {
+            buildPyramidLevelRows(pyramidIndex, beginRow, endRow);
+        });
+        buildPyramidLevelRows(pyramidIndex, lastRow, lastRow + 1);
+    }
+}
 
-            prevMinPyramidTopRowBuffer += pyramidRowStepOffset;
-            prevMaxPyramidTopRowBuffer += pyramidRowStepOffset;
-            prevAvgPyramidTopRowBuffer += pyramidRowStepOffset;
-            prevMinPyramidBotRowBuffer += pyramidRowStepOffset;
-            prevMaxPyramidBotRowBuffer += pyramidRowStepOffset;
-            prevAvgPyramidBotRowBuffer += pyramidRowStepOffset;
+void CPyramidBinarizer::buildPyramidLevelRows(size_t level, size_t beginRow, size_t endRow) {
+    // Нулевой уровень строится по исходному изображению - тогда все три источника совпадают
+    const uint8_t* prevMinPyramid = (level == 0) ? srcGrayBuffer : levels[level - 1].Min;
+    const uint8_t* prevMaxPyramid = (level == 0) ? srcGrayBuffer : levels[level - 1].Max;
+    const uint8_t* prevAvgPyramid = (level == 0) ? srcGrayBuffer : levels[level - 1].Avg;
+    const size_t prevPyramidWidth = (level == 0) ? width : levels[level - 1].Width;
+    const size_t prevPyramidHeight = (level == 0) ? height : levels[level - 1].Height;
+    const CPyramidLevel& currLevel = levels[level];
+    const size_t currPyramidWidth = currLevel.Width;
+    const size_t rowShift = GetLevelShift(padding.Top, level);
+    const size_t columnShift = GetLevelShift(padding.Left, level);
+    if (level == 0 && srcColorImage != nullptr) {
+        // Полосы нулевого уровня переводят непересекающиеся диапазоны исходных строк от верхней строки, покрываемой
+        // первой строкой полосы, в сумме - все изображение
+        convertColorRows(GetSourceTopRow(beginRow, rowShift, height + 1),
+                         GetSourceTopRow(endRow, rowShift, height + 1));
+    }
 
-            currMinPyramidBuffer += currPyramidWidth;
-            currMaxPyramidBuffer += currPyramidWidth;
-            currAvgPyramidBuffer += currPyramidWidth;
-        }
-        prevMinPyramid = &minPyramid[pyramidIndex];
-        prevMaxPyramid = &maxPyramid[pyramidIndex];
-        prevAvgPyramid = &avgPyramid[pyramidIndex];
+    for (size_t rowIndex = beginRow; rowIndex < endRow; ++rowIndex) {
+        // Строки за краем изображения прижимаются к крайней - так же, как при дополнении повтором крайних строк
+        const size_t topRowIndex = GetSourceTopRow(rowIndex, rowShift, prevPyramidHeight);
+        const size_t botRowIndex = GetSourceBotRow(rowIndex, rowShift, prevPyramidHeight);
+        const size_t topRowOffset = topRowIndex * prevPyramidWidth;
+        const size_t botRowOffset = botRowIndex * prevPyramidWidth;
+        const CPyramidSourceRows srcRows{
+            prevMinPyramid + topRowOffset, prevMinPyramid + botRowOffset,
+            prevMaxPyramid + topRowOffset, prevMaxPyramid + botRowOffset,
+            prevAvgPyramid + topRowOffset, prevAvgPyramid + botRowOffset};
+        const size_t currRowOffset = rowIndex * currPyramidWidth;
+        BuildPyramidRow(srcRows, currLevel.Min + currRowOffset, currLevel.Max + currRowOffset,
+                        currLevel.Avg + currRowOffset, currPyramidWidth, prevPyramidWidth, columnShift);
     }
-}
\ No newline at end of file
+}
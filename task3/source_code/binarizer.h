@@ -1,14 +1,9 @@
 #pragma once
 
 #include "image.h"
-
-enum TBinarizationMode {
-    BM_Avg,
-    BM_Center,
-    BM_CenterMinWeighted,
-    BM_AvgCenterWeighted,
-    BM_BySeparatedNoiseLevels
-};
+#include "noise_stats.h"
+#include "pyramid.h"
+#include "thread_pool.h"
 
 TBinarizationMode ChooseMode(const std::string& modeName);
 
@@ -17,46 +12,119 @@ public:
     static constexpr uint8_t NoiseLevel = 40;
     static constexpr float SigmaMultiplier = 3.0f;
     static constexpr TBinarizationMode DefaultMode = BM_Center;
+    // Выравнивание арены и каждого буфера в ней (строка кэша)
+    static constexpr size_t ArenaAlignment = 64;
 
+    // Переиспользуемый бинаризатор: пирамиды всех уровней, карты порогов и серое изображение (при бинаризации
+    // цветного) размещаются в одной выровненной арене. Арена выделяется сразу под страницу maxHeight x maxWidth,
+    // между страницами только переразмечается и перевыделяется, лишь если очередная страница в нее не помещается.
+    // threadsNumber - число потоков построения пирамид и карты порогов (0 - по числу ядер)
+    explicit CPyramidBinarizer(TBinarizationMode mode = DefaultMode, uint8_t noiseLevel = NoiseLevel,
+                               float noiseSigmaMultiplier = SigmaMultiplier, size_t threadsNumber = 0,
+                               size_t maxHeight = 0, size_t maxWidth = 0);
+    // Бинаризатор одного изображения: пирамиды строятся сразу, результат - Binarize()
     CPyramidBinarizer(const CGrayImage& grayImage, TBinarizationMode mode = DefaultMode,
-                      uint8_t noiseLevel = NoiseLevel, float noiseSigmaMultiplier = SigmaMultiplier);
+                      uint8_t noiseLevel = NoiseLevel, float noiseSigmaMultiplier = SigmaMultiplier,
+                      size_t threadsNumber = 0);
+    // Бинаризация цветного изображения: перевод в серое совмещен с построением нулевого уровня пирамид,
+    // каждая полоса переводит только свои исходные строки, пока они в кэше
+    CPyramidBinarizer(const CRGBImage& colorImage, TBinarizationMode mode = DefaultMode,
+                      uint8_t noiseLevel = NoiseLevel, float noiseSigmaMultiplier = SigmaMultiplier,
+                      size_t threadsNumber = 0);
     ~CPyramidBinarizer();
+    CPyramidBinarizer(const CPyramidBinarizer&) = delete;
+    CPyramidBinarizer& operator=(const CPyramidBinarizer&) = delete;
 
+    // Бинаризация последнего переданного изображения
     std::shared_ptr<CBWImage> Binarize();
+    // Бинаризация в уже созданное изображение (например, переиспользуемое между страницами)
+    void Binarize(CBWImage& bwImage);
+    // Бинаризация очередной страницы (исходное изображение должно жить до конца вызова)
+    void Binarize(const CGrayImage& grayImage, CBWImage& bwImage);
+    void Binarize(const CRGBImage& colorImage, CBWImage& bwImage);
+
+    // Текущий размер арены в байтах
+    size_t GetArenaSize() const { return arenaSize; }
+    // Свое правило уточнения порога вместо правила режима (см. CCenterRefinement) - для следующих изображений
+    template<typename TRefinementPolicy>
+    void SetRefinementPolicy(const TRefinementPolicy& policy);
 
 private:
+    // Уровень пирамид: буферы минимумов, максимумов и средних одного размера в арене
+    struct CPyramidLevel {
+        uint8_t* Min;
+        uint8_t* Max;
+        uint8_t* Avg;
+        size_t Width;
+        size_t Height;
+    };
+    // Глубина пирамиды не больше числа бит размера стороны
+    static constexpr size_t maxDepth = 8 * sizeof(size_t);
+
     // Режим работы механизма
-    TBinarizationMode mode;
-    // Размеры исходного изображения
-    const size_t width;
-    const size_t height;
-    // Исходное серое изображение
-    const CGrayImage& srcGrayImage;
-    // Глубина выстраевамой пирамиды
-    const size_t depth;
+    const TBinarizationMode mode;
     // Шумовой порог
     const uint8_t noiseLevel;
     // Для режима BM_BySeparatedNoiseLevels - коэф-т для шумового порога
     const float noiseSigmaMultiplier;
-    // Расширенное изображение
-    CGrayImage extendedImage;
-    // Пирамиды минимумов, максимумов, средних значений
-    CGrayImage* minPyramid;
-    CGrayImage* maxPyramid;
-    CGrayImage* avgPyramid;
+    // Размеры текущего изображения
+    size_t width{0};
+    size_t height{0};
+    // Глубина выстраевамой пирамиды
+    size_t depth{0};
+    // Положение изображения в сетке ячеек пирамид (как при дополнении по центру до кратности 2^depth)
+    CImagePadding padding{0, 0, 0, 0};
+    // Исходное серое изображение
+    const CGrayValue* srcGrayBuffer{nullptr};
+    // Серое изображение, получаемое из цветного (при бинаризации цветного изображения), - в арене
+    CGrayValue* convertedGrayBuffer{nullptr};
+    // Исходное цветное изображение, пока оно не переведено в серое (иначе nullptr)
+    const CRGBImage* srcColorImage{nullptr};
+    // Арена: выделенный блок и его выровненное начало
+    uint8_t* arenaBuffer{nullptr};
+    uint8_t* arena{nullptr};
+    size_t arenaSize{0};
+    // Уровни пирамид минимумов, максимумов, средних значений
+    CPyramidLevel levels[maxDepth];
     // Карты порогов (текущий и предыдущий шаг построения)
     uint8_t* prevThresMap{nullptr};
     uint8_t* currThresMap{nullptr};
+    // Пул потоков: каждый уровень обрабатывается полосами строк независимо
+    CThreadPool threadPool;
 
-    static constexpr size_t binsNumber = 16;
-    static constexpr size_t valuesPerBin = 256 / binsNumber;
+    static constexpr size_t binsNumber = NoiseBinsNumber;
 
-    uint64_t numberPerBin[binsNumber];
+    // Для режима BM_BySeparatedNoiseLevels - среднеквадратичное отклонение шума в каждом бине яркости
     uint64_t varSum[binsNumber];
+    // Построчное уточнение карты порогов: правило режима или заданное через SetRefinementPolicy
+    TRefineRowFunction refineRow;
+    bool hasCustomRefinement{false};
 
+    void setImageSize(size_t height, size_t width);
+    // Разметка арены под текущее изображение; при arenaStart == nullptr только подсчет размера
+    size_t layoutArena(uint8_t* arenaStart);
+    // Арена не меньше size байт (перевыделяется только при нехватке)
+    void reserveArena(size_t size);
+    // Подготовка к бинаризации изображения: разметка арены и построение пирамид
+    void prepareImage(const CGrayImage* grayImage, const CRGBImage* colorImage);
+    void convertColorRows(size_t beginRow, size_t endRow);
     void prepareDeviationStats();
-    void prepareExtended();
     void preparePyramids();
+    void buildPyramidLevelRows(size_t level, size_t beginRow, size_t endRow);
     void buildThresholdMap();
-    void upsampleThresholdMap(size_t currMapWidth, size_t currMapHeight);
-};
\ No newline at end of file
+    void refineThresholdMapRows(size_t level, size_t beginRow, size_t endRow);
+    // Пороги в ячейках дополнения, которых нет в сетке дополненного изображения (см. CLevelBorders)
+    void clampThresholdMapBorders(size_t level);
+    void upsampleThresholdMap(size_t level, size_t currMapWidth, size_t currMapHeight);
+    void upsampleThresholdMapRows(size_t level, size_t currMapWidth, size_t currMapHeight, size_t upMapWidth,
+                                  size_t beginRow, size_t endRow);
+    // Параллельная обработка строк [0, rowsNumber) полосами, размер полосы подбирается под кэш по ширине строки
+    template<typename TBandFunction>
+    void processBands(size_t rowsNumber, size_t rowWidth, const TBandFunction& bandFunction);
+};
+
+template<typename TRefinementPolicy>
+void CPyramidBinarizer::SetRefinementPolicy(const TRefinementPolicy& policy) {
+    refineRow = MakeRefineRowFunction(policy);
+    hasCustomRefinement = true;
+}
\ No newline at end of file
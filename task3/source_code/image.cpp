@@ -3,22 +3,56 @@
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <algorithm>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
 template<TImageColor TColor>
-void CImage<TColor>::LoadFromFile(const std::string& sourceFilePath) {
+static void loadImage(const std::string& sourceFilePath, size_t reductionFactor, CImage<TColor>& image) {
     static_assert(TColor == IC_Gray || TColor == IC_RGB);
-    constexpr auto readMode = (TColor == IC_Gray) ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR;
-    const cv::Mat cvImage = imread(sourceFilePath, readMode);
-    if (dataBuffer != nullptr) {
-        delete [] dataBuffer;
+    constexpr bool isGray = (TColor == IC_Gray);
+    int readMode = isGray ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR;
+    switch(reductionFactor) {
+        case 1:
+            break;
+        case 2:
+            readMode = isGray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+            break;
+        case 4:
+            readMode = isGray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+            break;
+        case 8:
+            readMode = isGray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+            break;
+        default:
+            throw std::runtime_error("Invalid reduction factor " + std::to_string(reductionFactor) +
+                " (1, 2, 4 or 8 allowed)");
+    }
+    const cv::Mat cvImage = cv::imread(sourceFilePath, readMode);
+    if (cvImage.empty()) {
+        throw std::runtime_error("Can't read " + sourceFilePath);
     }
-    width = cvImage.cols;
-    height = cvImage.rows;
-    const size_t fullSize = width * height;
-    dataBuffer = new TColorValue[fullSize];
-    std::copy_n(cvImage.data, fullSize * ComponentsNumber, reinterpret_cast<decltype(cvImage.data)>(dataBuffer));
+    // При загрузке изображений того же размера буфер переиспользуется
+    image.Reset(cvImage.rows, cvImage.cols);
+    const size_t fullSize = image.GetWidth() * image.GetHeight();
+    std::copy_n(cvImage.data, fullSize * ComponentsNumber<TColor>,
+                reinterpret_cast<decltype(cvImage.data)>(image.GetBuffer()));
+}
+
+template<TImageColor TColor>
+void CImage<TColor>::LoadFromFile(const std::string& sourceFilePath) {
+    loadImage(sourceFilePath, 1, *this);
+}
+
+void LoadReducedImage(const std::string& sourceFilePath, size_t reductionFactor, CGrayImage& grayImage) {
+    loadImage(sourceFilePath, reductionFactor, grayImage);
+}
+
+void LoadReducedImage(const std::string& sourceFilePath, size_t reductionFactor, CRGBImage& colorImage) {
+    loadImage(sourceFilePath, reductionFactor, colorImage);
 }
 
 template<TImageColor TColor>
@@ -47,20 +81,55 @@ static inline CGrayValue colorTransform(const CRGBValue& colorValue) {
     const uint8_t R = colorValue.Components[RGBC_Red];
     const uint8_t G = colorValue.Components[RGBC_Green];
     const uint8_t B = colorValue.Components[RGBC_Blue];
-    const uint8_t Y = ((redWeight * R + greenWeight * G + blueWeight * B + denominatorBitsNumber / 2) >> denominatorBitsNumber);
+    const uint8_t Y = ((redWeight * R + greenWeight * G + blueWeight * B + denominator / 2) >> denominatorBitsNumber);
     return CGrayValue{Y};
 }
 
+void ConvertRGBRowToGray(const CRGBValue* colorRow, CGrayValue* grayRow, size_t width) {
+    size_t pixelNumber = 0;
+#if defined(__SSE2__)
+    // По 16 пикселей за итерацию. Пиксель BGR расширяется до 32 бит (четвертый байт - начало следующего пикселя,
+    // его вес нулевой), затем до 16-битных компонент: madd дает B * blueWeight + G * greenWeight и R * redWeight,
+    // остается сложить соседние 32-битные суммы. Веса меньше 2^15 и помещаются в знаковые 16 бит
+    static_assert(sizeof(CRGBValue) == 3);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set_epi16(0, redWeight, greenWeight, blueWeight, 0, redWeight, greenWeight, blueWeight);
+    const __m128i roundingTerm = _mm_set1_epi32(denominator / 2);
+    const uint8_t* colorBytes = reinterpret_cast<const uint8_t*>(colorRow);
+    // Четыре пикселя из 16 загруженных байт (используются первые 12)
+    const auto convertFour = [&](const uint8_t* pixels) {
+        const __m128i loaded = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+        const __m128i firstPair = _mm_unpacklo_epi32(loaded, _mm_srli_si128(loaded, 3));
+        const __m128i secondPair = _mm_unpacklo_epi32(_mm_srli_si128(loaded, 6), _mm_srli_si128(loaded, 9));
+        const __m128i fourPixels = _mm_unpacklo_epi64(firstPair, secondPair);
+        const __m128i lowSums = _mm_madd_epi16(_mm_unpacklo_epi8(fourPixels, zero), weights);
+        const __m128i highSums = _mm_madd_epi16(_mm_unpackhi_epi8(fourPixels, zero), weights);
+        const __m128 lowFloats = _mm_castsi128_ps(lowSums);
+        const __m128 highFloats = _mm_castsi128_ps(highSums);
+        const __m128i blueGreenSums = _mm_castps_si128(_mm_shuffle_ps(lowFloats, highFloats, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i redSums = _mm_castps_si128(_mm_shuffle_ps(lowFloats, highFloats, _MM_SHUFFLE(3, 1, 3, 1)));
+        const __m128i sums = _mm_add_epi32(_mm_add_epi32(blueGreenSums, redSums), roundingTerm);
+        return _mm_srli_epi32(sums, denominatorBitsNumber);
+    };
+    // Последняя загрузка читает 16 байт, начиная с 36-го байта пикселей итерации - нужен запас в 4 байта
+    for (; 3 * (pixelNumber + 16) + 4 <= 3 * width; pixelNumber += 16) {
+        const uint8_t* pixels = colorBytes + 3 * pixelNumber;
+        const __m128i low = _mm_packs_epi32(convertFour(pixels), convertFour(pixels + 12));
+        const __m128i high = _mm_packs_epi32(convertFour(pixels + 24), convertFour(pixels + 36));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(grayRow + pixelNumber), _mm_packus_epi16(low, high));
+    }
+#endif
+    for (; pixelNumber < width; ++pixelNumber) {
+        grayRow[pixelNumber] = colorTransform(colorRow[pixelNumber]);
+    }
+}
+
 void ConvertRGBImageToGray(const CRGBImage& colorImage, CGrayImage& grayImage) {
     const size_t width = colorImage.GetWidth();
     const size_t height = colorImage.GetHeight();
     assert(grayImage.GetHeight() == height);
     assert(grayImage.GetWidth() == width);
-    auto toFillBuffer = grayImage.GetBuffer();
-    auto toReadBuffer = colorImage.GetBuffer();
-    for (size_t pixelNumber = 0; pixelNumber < width * height; ++pixelNumber) {
-        toFillBuffer[pixelNumber] = colorTransform(toReadBuffer[pixelNumber]);
-    }
+    ConvertRGBRowToGray(colorImage.GetBuffer(), grayImage.GetBuffer(), width * height);
 }
 
 std::shared_ptr<CGrayImage> ConvertRGBImageToGray(const CRGBImage& colorImage) {
@@ -71,5 +140,12 @@ std::shared_ptr<CGrayImage> ConvertRGBImageToGray(const CRGBImage& colorImage) {
     return grayImage;
 }
 
+void CGrayImageRowSource::ReadRow(CGrayValue* row) {
+    assert(rowIndex < image.GetHeight());
+    const size_t width = image.GetWidth();
+    std::copy_n(image.GetBuffer() + rowIndex * width, width, row);
+    ++rowIndex;
+}
+
 template class CImage<IC_Gray>;
 template class CImage<IC_RGB>;
\ No newline at end of file
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cassert>
+#include <cstdint>
+#include <memory>
 #include <string>
 
 // Цвет изображения
@@ -8,7 +11,7 @@ enum TImageColor : unsigned char {
     IC_Gray = 0,
     // Изображение цветового пространства RGB
     IC_RGB,
-    // Черно-белое изображение
+    // Черно-белое изображение (упаковано по 8 пикселей в байт, старший бит - левый пиксель; 0 - черный, 1 - белый)
     IC_BW,
     // Количество поддерживаемых типов изображения
     IC_Count
@@ -18,12 +21,22 @@ enum TImageColor : unsigned char {
 template<TImageColor TColor>
 struct CColorProperties {
     static constexpr size_t ComponentsNumber = 1;
+    // Число пикселей в одном значении буфера
+    static constexpr size_t PixelsPerValue = 1;
 };
 
 // Специализация для RGB
 template<>
 struct CColorProperties<IC_RGB> {
     static constexpr size_t ComponentsNumber = 3;
+    static constexpr size_t PixelsPerValue = 1;
+};
+
+// Специализация для ЧБ
+template<>
+struct CColorProperties<IC_BW> {
+    static constexpr size_t ComponentsNumber = 1;
+    static constexpr size_t PixelsPerValue = 8;
 };
 
 // Шаблонная переменная для удобства
@@ -48,6 +61,7 @@ class CImage {
 public:
     typedef TImageBufferType<TColor> TColorValue;
     static constexpr auto ComponentsNumber = ::ComponentsNumber<TColor>;
+    static constexpr auto PixelsPerValue = CColorProperties<TColor>::PixelsPerValue;
     CImage() = default;
     // Создать изображение, считав его из файла на диске
     CImage(const std::string& sourceFilePath);
@@ -55,9 +69,13 @@ public:
     CImage(size_t height, size_t width);
     ~CImage();
 
+    // Изменить размеры изображения (буфер перевыделяется, только если меняется его размер; содержимое не сохраняется)
+    void Reset(size_t height, size_t width);
     // Получение размеров изображения
     size_t GetWidth() const { return width; }
     size_t GetHeight() const { return height; }
+    // Число значений буфера на строку (строки ЧБ-изображения начинаются с целого байта)
+    size_t GetRowSize() const { return (width + PixelsPerValue - 1) / PixelsPerValue; }
     bool IsEmpty() const { return dataBuffer == nullptr; }
     // Получение/Установка значения конкретного пикселя
     TColorValue GetValue(size_t y, size_t x) const;
@@ -76,7 +94,8 @@ private:
 };
 
 // Для ЧБ-изображения сериализация реализована с помощью
-// низкоуровневой C-библиотеки libtiff (OpenCV не умеет сохранять ЧБ в 1bit-depth формат)
+// низкоуровневой C-библиотеки libtiff (OpenCV не умеет сохранять ЧБ в 1bit-depth формат): только сохранение
+// в файл .tiff, иначе (как и при загрузке) - std::runtime_error
 template<> void CImage<IC_BW>::LoadFromFile(const std::string& sourceFilePath);
 template<> void CImage<IC_BW>::SaveToFile(const std::string& sourceFilePath) const;
 
@@ -103,9 +122,43 @@ enum TRGBComponent : unsigned char {
     RGBC_Count
 };
 
+// Чтение с уменьшением в reductionFactor (1, 2, 4 или 8) раз: JPEG уменьшается при декодировании средствами libjpeg
+// (масштабированием DCT), остальные форматы - после чтения. Серое изображение читается без промежуточного цветного
+// (у JPEG берется яркостная компонента, веса каналов при этом - веса OpenCV, а не ConvertRGBImageToGray).
+// Нечитаемый файл - std::runtime_error
+void LoadReducedImage(const std::string& sourceFilePath, size_t reductionFactor, CGrayImage& grayImage);
+void LoadReducedImage(const std::string& sourceFilePath, size_t reductionFactor, CRGBImage& colorImage);
+
 // Создание серого изображения по цветному
 std::shared_ptr<CGrayImage> ConvertRGBImageToGray(const CRGBImage& colorImage);
 void ConvertRGBImageToGray(const CRGBImage& colorImage, CGrayImage& grayImage);
+void ConvertRGBRowToGray(const CRGBValue* colorRow, CGrayValue* grayRow, size_t width);
+
+// Построчный источник серого изображения (для потоковой обработки изображений, не помещающихся в память целиком)
+class CGrayRowSource {
+public:
+    virtual ~CGrayRowSource() = default;
+    virtual size_t GetWidth() const = 0;
+    virtual size_t GetHeight() const = 0;
+    // Вернуться к первой строке
+    virtual void Rewind() = 0;
+    // Прочитать очередную строку (GetWidth() значений)
+    virtual void ReadRow(CGrayValue* row) = 0;
+};
+
+// Построчный источник поверх изображения в памяти
+class CGrayImageRowSource : public CGrayRowSource {
+public:
+    explicit CGrayImageRowSource(const CGrayImage& _image) : image(_image) {}
+    size_t GetWidth() const override { return image.GetWidth(); }
+    size_t GetHeight() const override { return image.GetHeight(); }
+    void Rewind() override { rowIndex = 0; }
+    void ReadRow(CGrayValue* row) override;
+
+private:
+    const CGrayImage& image;
+    size_t rowIndex{0};
+};
 
 // Приведение значения в правильный диапазон
 template<typename TReturnType = uint8_t>
@@ -120,7 +173,7 @@ CImage<TColor>::CImage(size_t _height, size_t _width) :
     height(_height),
     width(_width)
 {
-    dataBuffer = new TColorValue[width * height];
+    dataBuffer = new TColorValue[GetRowSize() * height];
 }
 
 template<TImageColor TColor>
@@ -135,14 +188,35 @@ CImage<TColor>::~CImage() {
     }
 }
 
+template<TImageColor TColor>
+void CImage<TColor>::Reset(size_t _height, size_t _width) {
+    const size_t bufferSize = GetRowSize() * height;
+    height = _height;
+    width = _width;
+    if (dataBuffer == nullptr || GetRowSize() * height != bufferSize) {
+        delete[] dataBuffer;
+        dataBuffer = new TColorValue[GetRowSize() * height];
+    }
+}
+
 template<TImageColor TColor>
 inline typename CImage<TColor>::TColorValue CImage<TColor>::GetValue(size_t y, size_t x) const {
     assert(dataBuffer != nullptr);
-    return dataBuffer[y * width + x];
+    if constexpr (PixelsPerValue == 1) {
+        return dataBuffer[y * width + x];
+    } else {
+        return (dataBuffer[y * GetRowSize() + x / PixelsPerValue] >> (PixelsPerValue - 1 - x % PixelsPerValue)) & 1u;
+    }
 }
 
 template<TImageColor TColor>
 inline void CImage<TColor>::SetValue(size_t y, size_t x, TColorValue value) {
     assert(dataBuffer != nullptr);
-    dataBuffer[y * width + x] = value;
+    if constexpr (PixelsPerValue == 1) {
+        dataBuffer[y * width + x] = value;
+    } else {
+        const uint8_t bitMask = 1u << (PixelsPerValue - 1 - x % PixelsPerValue);
+        TColorValue& packedValue = dataBuffer[y * GetRowSize() + x / PixelsPerValue];
+        packedValue = (value != 0) ? (packedValue | bitMask) : (packedValue & ~bitMask);
+    }
 }
\ No newline at end of file
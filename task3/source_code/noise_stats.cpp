@@ -0,0 +1,130 @@
+#include "noise_stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+void CNoiseHistogram::Merge(const CNoiseHistogram& other) {
+    for (size_t i = 0; i < NoiseBinsNumber; ++i) {
+        PixelsNumbers[i] += other.PixelsNumbers[i];
+        VarianceSums[i] += other.VarianceSums[i];
+    }
+}
+
+void CNoiseHistogram::GetSigmaPerBin(uint64_t* sigmaPerBin) const {
+    for (size_t i = 0; i < NoiseBinsNumber; ++i) {
+        sigmaPerBin[i] = 0;
+        if (PixelsNumbers[i] != 0) {
+            sigmaPerBin[i] = round(sqrt(VarianceSums[i] / PixelsNumbers[i]));
+        }
+    }
+}
+
+namespace {
+constexpr size_t storedRowsNumber = 2 * CNoiseStatsAccumulator::Radius + 2;
+// Частное (a + n / 2) / n считается умножением на 1 / n в double: погрешность произведения для сумм окна меньше 1e-7,
+// а дробная часть точного частного либо 0, либо не меньше 1 / n > 1e-4. Поправка переносит произведение,
+// оказавшееся чуть меньше целого, обратно к нему - результат совпадает с целочисленным делением
+constexpr double quotientCorrection = 1e-6;
+
+inline uint32_t divideRounded(uint32_t dividend, uint32_t divisor, double inverseDivisor) {
+    return static_cast<uint32_t>((dividend + divisor / 2) * inverseDivisor + quotientCorrection);
+}
+}
+
+CNoiseStatsAccumulator::CNoiseStatsAccumulator(size_t _width, size_t _height, size_t beginRow, size_t _endRow) :
+    width(_width),
+    height(_height),
+    endRow(_endRow),
+    firstInputRow(beginRow >= Radius ? beginRow - Radius : 0),
+    endInputRow(std::min(height, endRow + Radius)),
+    nextInputRow(firstInputRow),
+    nextOutputRow(beginRow),
+    windowTopRow(firstInputRow),
+    rows(storedRowsNumber * width),
+    columnSums(width, 0),
+    columnSquaresSums(width, 0),
+    windowSums(width),
+    windowSquaresSums(width),
+    pixelsNumbers(width),
+    inversePixelsNumbers(width)
+{
+    assert(beginRow < endRow && endRow <= height);
+}
+
+void CNoiseStatsAccumulator::AddRow(const CGrayValue* row) {
+    assert(nextInputRow < endInputRow);
+    std::copy_n(row, width, rows.data() + (nextInputRow % storedRowsNumber) * width);
+    for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+        const uint32_t value = row[columnIndex];
+        columnSums[columnIndex] += value;
+        columnSquaresSums[columnIndex] += value * value;
+    }
+    ++nextInputRow;
+    // Строка готова, когда в суммы вошла нижняя строка ее окна
+    while (nextOutputRow < endRow && std::min(nextOutputRow + Radius, height - 1) < nextInputRow) {
+        processRow(nextOutputRow);
+        ++nextOutputRow;
+    }
+}
+
+void CNoiseStatsAccumulator::processRow(size_t rowIndex) {
+    const size_t topRow = (rowIndex >= Radius) ? rowIndex - Radius : 0;
+    for (; windowTopRow < topRow; ++windowTopRow) {
+        const CGrayValue* row = rows.data() + (windowTopRow % storedRowsNumber) * width;
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+            const uint32_t value = row[columnIndex];
+            columnSums[columnIndex] -= value;
+            columnSquaresSums[columnIndex] -= value * value;
+        }
+    }
+    const size_t currWindowHeight = nextInputRow - windowTopRow;
+    if (currWindowHeight != windowHeight) {
+        windowHeight = currWindowHeight;
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+            const size_t left = (columnIndex >= Radius) ? columnIndex - Radius : 0;
+            const size_t right = std::min(columnIndex + Radius, width - 1);
+            pixelsNumbers[columnIndex] = static_cast<uint32_t>((right - left + 1) * windowHeight);
+            inversePixelsNumbers[columnIndex] = 1.0 / pixelsNumbers[columnIndex];
+        }
+    }
+
+    // Окно по строке сдвигается на столбец: добавляется правый столбец, убирается левый
+    uint32_t sum = 0;
+    uint32_t squaresSum = 0;
+    for (size_t columnIndex = 0; columnIndex < std::min(Radius, width); ++columnIndex) {
+        sum += columnSums[columnIndex];
+        squaresSum += columnSquaresSums[columnIndex];
+    }
+    for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+        if (columnIndex + Radius < width) {
+            sum += columnSums[columnIndex + Radius];
+            squaresSum += columnSquaresSums[columnIndex + Radius];
+        }
+        if (columnIndex > Radius) {
+            sum -= columnSums[columnIndex - Radius - 1];
+            squaresSum -= columnSquaresSums[columnIndex - Radius - 1];
+        }
+        windowSums[columnIndex] = sum;
+        windowSquaresSums[columnIndex] = squaresSum;
+    }
+
+    // Моменты считаются без ветвлений, этот цикл векторизуется компилятором
+    for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+        const uint32_t pixelsNumber = pixelsNumbers[columnIndex];
+        const double inversePixelsNumber = inversePixelsNumbers[columnIndex];
+        const uint32_t firstMoment = divideRounded(windowSums[columnIndex], pixelsNumber, inversePixelsNumber);
+        const uint32_t secondMoment = divideRounded(windowSquaresSums[columnIndex], pixelsNumber, inversePixelsNumber);
+        const uint32_t firstSquared = firstMoment * firstMoment;
+        windowSums[columnIndex] = firstMoment;
+        windowSquaresSums[columnIndex] = (secondMoment >= firstSquared) ? secondMoment - firstSquared : 0;
+    }
+    for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+        const uint32_t variance = windowSquaresSums[columnIndex];
+        if (variance != 0) {
+            const size_t varianceBin = windowSums[columnIndex] / ValuesPerNoiseBin;
+            ++histogram.PixelsNumbers[varianceBin];
+            histogram.VarianceSums[varianceBin] += variance;
+        }
+    }
+}
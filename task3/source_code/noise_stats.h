@@ -0,0 +1,62 @@
+#pragma once
+
+#include "image.h"
+#include "pyramid.h"
+
+#include <vector>
+
+// Гистограмма дисперсий по бинам яркости для режима BM_BySeparatedNoiseLevels
+struct CNoiseHistogram {
+    uint64_t PixelsNumbers[NoiseBinsNumber]{};
+    uint64_t VarianceSums[NoiseBinsNumber]{};
+
+    void Merge(const CNoiseHistogram& other);
+    // Среднеквадратичное отклонение в каждом бине (округленный корень из средней дисперсии)
+    void GetSigmaPerBin(uint64_t* sigmaPerBin) const;
+};
+
+// Скользящее окно (2 * Radius + 1)^2, обрезанное по краям изображения: в каждой точке считаются среднее и дисперсия
+// в окне, ненулевая дисперсия заносится в бин яркости, определяемый средним.
+// Строки подаются по порядку, хранятся только суммы окна по столбцам и последние 2 * Radius + 2 строки -
+// память O(width).
+// Выходные строки [beginRow, endRow) можно считать независимо от остальных, подав строки
+// [GetFirstInputRow(), GetEndInputRow())
+class CNoiseStatsAccumulator {
+public:
+    static constexpr size_t Radius = 16;
+
+    CNoiseStatsAccumulator(size_t width, size_t height, size_t beginRow, size_t endRow);
+
+    size_t GetFirstInputRow() const { return firstInputRow; }
+    size_t GetEndInputRow() const { return endInputRow; }
+    // Очередная строка изображения, начиная с GetFirstInputRow()
+    void AddRow(const CGrayValue* row);
+    const CNoiseHistogram& GetHistogram() const { return histogram; }
+
+private:
+    const size_t width;
+    const size_t height;
+    const size_t endRow;
+    const size_t firstInputRow;
+    const size_t endInputRow;
+    size_t nextInputRow;
+    size_t nextOutputRow;
+    // Верхняя строка, входящая в суммы по столбцам
+    size_t windowTopRow;
+    // Высота окна, для которой посчитаны pixelsNumbers
+    size_t windowHeight{0};
+    // Последние строки изображения: строка rowIndex в ячейке rowIndex % (2 * Radius + 2)
+    std::vector<CGrayValue> rows;
+    // Суммы значений и квадратов по столбцам окна (не больше (2 * Radius + 1) * 255^2 - помещаются в 32 бита)
+    std::vector<uint32_t> columnSums;
+    std::vector<uint32_t> columnSquaresSums;
+    // Суммы по окну вокруг каждой точки строки, затем среднее и дисперсия в ней
+    std::vector<uint32_t> windowSums;
+    std::vector<uint32_t> windowSquaresSums;
+    // Число пикселей окна вокруг каждой точки строки и обратная к нему величина
+    std::vector<uint32_t> pixelsNumbers;
+    std::vector<double> inversePixelsNumbers;
+    CNoiseHistogram histogram;
+
+    void processRow(size_t rowIndex);
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Аргументы командной строки: позиционные и именованные опции вида --name=value (или --name)
+struct CCommandLineArguments {
+    std::vector<std::string> Positional;
+    std::map<std::string, std::string> Options;
+
+    CCommandLineArguments(int argc, char* argv[]) {
+        for (int argIndex = 1; argIndex < argc; ++argIndex) {
+            const std::string arg(argv[argIndex]);
+            if (arg.compare(0, 2, "--") != 0) {
+                Positional.push_back(arg);
+                continue;
+            }
+            const size_t separatorPos = arg.find('=');
+            if (separatorPos == std::string::npos) {
+                Options[arg.substr(2)] = "";
+            } else {
+                Options[arg.substr(2, separatorPos - 2)] = arg.substr(separatorPos + 1);
+            }
+        }
+    }
+
+    bool HasOption(const std::string& name) const { return Options.find(name) != Options.end(); }
+    std::string GetOption(const std::string& name, const std::string& defaultValue = "") const {
+        const auto it = Options.find(name);
+        return it == Options.end() ? defaultValue : it->second;
+    }
+};
@@ -0,0 +1,207 @@
+#include "pyramid.h"
+
+#include <algorithm>
+#include <cassert>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+size_t GetMaxSqueezeDegree(size_t sideSize) {
+    size_t deg = 1u;
+    for (size_t val = 2u; val < sideSize; val <<= 1u, ++deg) {}
+    // Хотя бы один уровень - и у изображений со стороной в 1-2 пикселя (например, после уменьшения при чтении)
+    return std::max<size_t>(deg - 1, 1u);
+}
+
+size_t GetDivisibleSideSize(size_t srcSideSize, size_t depth) {
+    const size_t multiplier = (1 << depth);
+    const size_t remainder = srcSideSize % multiplier;
+    return (remainder == 0) ? srcSideSize : srcSideSize + (multiplier - remainder);
+}
+
+CImagePadding GetImagePadding(size_t height, size_t width, size_t depth) {
+    const size_t verticalPadding = GetDivisibleSideSize(height, depth) - height;
+    const size_t horizontalPadding = GetDivisibleSideSize(width, depth) - width;
+    return CImagePadding{verticalPadding / 2, verticalPadding - verticalPadding / 2,
+                         horizontalPadding / 2, horizontalPadding - horizontalPadding / 2};
+}
+
+// Есть ли в сетке уровня ячейки до первой и после последней ячейки, пересекающейся со стороной изображения
+static bool hasLeadingBorder(size_t leadingPadding, size_t level) {
+    return (leadingPadding >> (level + 1)) != 0;
+}
+
+static bool hasTrailingBorder(size_t srcSideSize, size_t leadingPadding, size_t trailingPadding, size_t level) {
+    const size_t cellSizeLog2 = level + 1;
+    const size_t lastCellIndex = (leadingPadding + srcSideSize - 1) >> cellSizeLog2;
+    return lastCellIndex + 1 < ((leadingPadding + srcSideSize + trailingPadding) >> cellSizeLog2);
+}
+
+CLevelBorders GetLevelBorders(size_t height, size_t width, const CImagePadding& padding, size_t level) {
+    return CLevelBorders{hasLeadingBorder(padding.Top, level),
+                         hasTrailingBorder(height, padding.Top, padding.Bottom, level),
+                         hasLeadingBorder(padding.Left, level),
+                         hasTrailingBorder(width, padding.Left, padding.Right, level)};
+}
+
+void ClampBorderThresholds(const CLevelBorders& borders, uint8_t* thresholdRow, size_t width) {
+    if (!borders.Left) {
+        thresholdRow[0] = thresholdRow[1];
+    }
+    if (!borders.Right) {
+        thresholdRow[width - 1] = thresholdRow[width - 2];
+    }
+}
+
+void BuildPyramidRow(const CPyramidSourceRows& src, uint8_t* minRow, uint8_t* maxRow, uint8_t* avgRow,
+                     size_t width, size_t prevWidth, size_t columnShift) {
+    const auto buildCell = [&](size_t columnIndex) {
+        // Индексы прижимаются так же, как номера строк
+        const size_t left = GetSourceTopRow(columnIndex, columnShift, prevWidth);
+        const size_t right = GetSourceBotRow(columnIndex, columnShift, prevWidth);
+        minRow[columnIndex] = std::min({src.MinTop[left], src.MinTop[right], src.MinBot[left], src.MinBot[right]});
+        maxRow[columnIndex] = std::max({src.MaxTop[left], src.MaxTop[right], src.MaxBot[left], src.MaxBot[right]});
+        avgRow[columnIndex] = (src.AvgTop[left] + src.AvgTop[right] + src.AvgBot[left] + src.AvgBot[right] + 2) / 4;
+    };
+    // Крайние ячейки с прижатыми индексами считаются отдельно, внутренние (до innerWidth) - без проверок
+    const size_t innerWidth = (prevWidth + columnShift) / 2;
+    size_t columnIndex = 0;
+    for (; 2 * columnIndex < columnShift; ++columnIndex) {
+        buildCell(columnIndex);
+    }
+#if defined(__SSE2__)
+    // По 16 ячеек за итерацию: вертикальные min/max/сумма по байтам, затем горизонтальные
+    // по парам соседних байт в 16-битных словах (четный байт - маской, нечетный - сдвигом).
+    // Сумма четырех значений помещается в 16 бит, поэтому среднее округляется так же, как в скалярной версии
+    const __m128i lowBytesMask = _mm_set1_epi16(0x00FF);
+    const __m128i roundingTerm = _mm_set1_epi16(2);
+    const auto pairMin = [&](__m128i value) {
+        return _mm_min_epi16(_mm_and_si128(value, lowBytesMask), _mm_srli_epi16(value, 8));
+    };
+    const auto pairMax = [&](__m128i value) {
+        return _mm_max_epi16(_mm_and_si128(value, lowBytesMask), _mm_srli_epi16(value, 8));
+    };
+    const auto pairSum = [&](__m128i top, __m128i bot) {
+        const __m128i topSum = _mm_add_epi16(_mm_and_si128(top, lowBytesMask), _mm_srli_epi16(top, 8));
+        const __m128i botSum = _mm_add_epi16(_mm_and_si128(bot, lowBytesMask), _mm_srli_epi16(bot, 8));
+        return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(topSum, botSum), roundingTerm), 2);
+    };
+    const auto load = [](const uint8_t* row, size_t offset) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + offset));
+    };
+    for (; columnIndex + 16 <= innerWidth; columnIndex += 16) {
+        const size_t offset = 2 * columnIndex - columnShift;
+        const __m128i minLow = _mm_min_epu8(load(src.MinTop, offset), load(src.MinBot, offset));
+        const __m128i minHigh = _mm_min_epu8(load(src.MinTop, offset + 16), load(src.MinBot, offset + 16));
+        const __m128i maxLow = _mm_max_epu8(load(src.MaxTop, offset), load(src.MaxBot, offset));
+        const __m128i maxHigh = _mm_max_epu8(load(src.MaxTop, offset + 16), load(src.MaxBot, offset + 16));
+        const __m128i avgLow = pairSum(load(src.AvgTop, offset), load(src.AvgBot, offset));
+        const __m128i avgHigh = pairSum(load(src.AvgTop, offset + 16), load(src.AvgBot, offset + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(minRow + columnIndex),
+                         _mm_packus_epi16(pairMin(minLow), pairMin(minHigh)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(maxRow + columnIndex),
+                         _mm_packus_epi16(pairMax(maxLow), pairMax(maxHigh)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(avgRow + columnIndex), _mm_packus_epi16(avgLow, avgHigh));
+    }
+#endif
+    for (; columnIndex < width; ++columnIndex) {
+        buildCell(columnIndex);
+    }
+}
+
+CSeparatedNoiseRefinement::CSeparatedNoiseRefinement(float sigmaMultiplier, const uint64_t* sigmaPerBin) {
+    // Разброс ячейки не больше 255: больший порог равносилен 255, отрицательный - -1
+    for (size_t value = 0; value < 256; ++value) {
+        const int noiseLevel = static_cast<int>(sigmaMultiplier * sigmaPerBin[value / ValuesPerNoiseBin]);
+        NoiseLevelPerValue[value] = static_cast<int16_t>(std::clamp(noiseLevel, -1, 255));
+    }
+}
+
+TRefineRowFunction ChooseRefineRowFunction(const CRefinementParameters& parameters) {
+    const int noiseLevel = parameters.NoiseLevel;
+    switch(parameters.Mode) {
+        case BM_Avg:
+            return MakeRefineRowFunction(CAvgRefinement{noiseLevel});
+        case BM_Center:
+            return MakeRefineRowFunction(CCenterRefinement{noiseLevel});
+        case BM_CenterMinWeighted:
+            return MakeRefineRowFunction(CCenterMinWeightedRefinement{noiseLevel});
+        case BM_AvgCenterWeighted:
+            return MakeRefineRowFunction(CAvgCenterWeightedRefinement{noiseLevel});
+        case BM_BySeparatedNoiseLevels:
+            return MakeRefineRowFunction(CSeparatedNoiseRefinement(parameters.NoiseSigmaMultiplier,
+                                                                   parameters.SigmaPerBin));
+        default:
+            assert(false);
+            return TRefineRowFunction();
+    }
+}
+
+void UpsampleThresholdRow(const uint8_t* currRow, const uint8_t* vertRow, uint8_t* upRow,
+                          size_t currWidth, size_t upWidth, size_t columnShift) {
+    static const uint8_t centerWeight = 9;
+    static const uint8_t ortoWeight = 3;
+    static const uint8_t diagWeight = 1;
+    static const uint8_t sumWeight = centerWeight + 2 * ortoWeight + diagWeight;
+    static const uint8_t sumWeightHalf = sumWeight / 2;
+    // Ячейка карты большего размера - четверть ячейки curr, ближайшие к этой четверти соседи curr
+    // по вертикали, горизонтали и диагонали - vert, hor и diag
+    const auto upsampleValue = [](uint8_t curr, uint8_t vert, uint8_t hor, uint8_t diag) -> uint8_t {
+        return (centerWeight * curr + ortoWeight * vert + ortoWeight * hor + diagWeight * diag + sumWeightHalf) / sumWeight;
+    };
+
+    size_t upColumnIndex = 0;
+    size_t columnIndex = columnShift / 2;
+    if (columnShift % 2 != 0) {
+        // Первая ячейка - правая половина ячейки curr
+        const size_t nextIndex = std::min(columnIndex + 1, currWidth - 1);
+        upRow[upColumnIndex++] = upsampleValue(currRow[columnIndex], vertRow[columnIndex],
+                                               currRow[nextIndex], vertRow[nextIndex]);
+        ++columnIndex;
+    }
+    for (; upColumnIndex + 1 < upWidth; ++columnIndex, upColumnIndex += 2) {
+        const size_t prevIndex = std::max<size_t>(columnIndex, 1) - 1;
+        const size_t nextIndex = std::min<size_t>(columnIndex + 1, currWidth - 1);
+        const uint8_t curr = currRow[columnIndex];
+        const uint8_t vert = vertRow[columnIndex];
+        upRow[upColumnIndex] = upsampleValue(curr, vert, currRow[prevIndex], vertRow[prevIndex]);
+        upRow[upColumnIndex + 1] = upsampleValue(curr, vert, currRow[nextIndex], vertRow[nextIndex]);
+    }
+    if (upColumnIndex < upWidth) {
+        // Последняя ячейка - левая половина крайней ячейки curr
+        const size_t prevIndex = std::max<size_t>(columnIndex, 1) - 1;
+        upRow[upColumnIndex] = upsampleValue(currRow[columnIndex], vertRow[columnIndex],
+                                             currRow[prevIndex], vertRow[prevIndex]);
+    }
+}
+
+void BinarizeRow(const uint8_t* srcRow, const uint8_t* thresholdRow, uint8_t* packedRow, size_t width) {
+    size_t columnIndex = 0;
+#if defined(__SSE2__)
+    // По 16 пикселей за итерацию: src >= threshold <=> max(src, threshold) == src. Перед movemask байты
+    // внутри каждой восьмерки переставляются в обратном порядке, чтобы левый пиксель попал в старший бит
+    const auto load = [](const uint8_t* row, size_t offset) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + offset));
+    };
+    for (; columnIndex + 16 <= width; columnIndex += 16) {
+        const __m128i srcValues = load(srcRow, columnIndex);
+        __m128i isWhite = _mm_cmpeq_epi8(_mm_max_epu8(srcValues, load(thresholdRow, columnIndex)), srcValues);
+        isWhite = _mm_shufflelo_epi16(isWhite, _MM_SHUFFLE(0, 1, 2, 3));
+        isWhite = _mm_shufflehi_epi16(isWhite, _MM_SHUFFLE(0, 1, 2, 3));
+        isWhite = _mm_or_si128(_mm_slli_epi16(isWhite, 8), _mm_srli_epi16(isWhite, 8));
+        const int whiteBits = _mm_movemask_epi8(isWhite);
+        packedRow[columnIndex / 8] = static_cast<uint8_t>(whiteBits);
+        packedRow[columnIndex / 8 + 1] = static_cast<uint8_t>(whiteBits >> 8);
+    }
+#endif
+    for (; columnIndex < width; columnIndex += 8) {
+        const size_t endColumnIndex = std::min(columnIndex + 8, width);
+        uint8_t packedValue = 0;
+        for (size_t bitColumnIndex = columnIndex; bitColumnIndex < endColumnIndex; ++bitColumnIndex) {
+            if (srcRow[bitColumnIndex] >= thresholdRow[bitColumnIndex]) {
+                packedValue |= static_cast<uint8_t>(0x80u >> (bitColumnIndex - columnIndex));
+            }
+        }
+        packedRow[columnIndex / 8] = packedValue;
+    }
+}
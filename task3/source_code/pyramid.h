@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Общие для полной и потоковой бинаризации построчные ядра пирамид и карты порогов
+
+enum TBinarizationMode {
+    BM_Avg,
+    BM_Center,
+    BM_CenterMinWeighted,
+    BM_AvgCenterWeighted,
+    BM_BySeparatedNoiseLevels
+};
+
+// Для режима BM_BySeparatedNoiseLevels диапазон яркости разбивается на равные бины со своим шумовым порогом
+constexpr size_t NoiseBinsNumber = 16;
+constexpr size_t ValuesPerNoiseBin = 256 / NoiseBinsNumber;
+
+// Глубина пирамиды для изображения с меньшей стороной sideSize
+size_t GetMaxSqueezeDegree(size_t sideSize);
+// Размер стороны, дополненной до кратности 2^depth
+size_t GetDivisibleSideSize(size_t srcSideSize, size_t depth);
+
+// Сетка ячеек пирамид та же, что у изображения, дополненного до кратности 2^depth повтором крайних пикселей
+// (изображение по центру), но хранятся только ячейки, пересекающиеся с изображением, и по одной ячейке дополнения
+// с каждой стороны. Ячейки дополнения одной строки (столбца) уровня строятся из одних и тех же повторенных крайних
+// пикселей и совпадают, поэтому одной ячейки достаточно, чтобы пирамиды и карта порогов не отличались от
+// построенных по дополненному изображению
+struct CImagePadding {
+    size_t Top;
+    size_t Bottom;
+    size_t Left;
+    size_t Right;
+};
+CImagePadding GetImagePadding(size_t height, size_t width, size_t depth);
+
+// Число хранимых ячеек уровня level (размера 2^(level+1)) вдоль стороны, сдвинутой в сетке на padding пикселей
+inline size_t GetLevelSideSize(size_t srcSideSize, size_t padding, size_t level) {
+    const size_t cellSizeLog2 = level + 1;
+    return ((padding + srcSideSize - 1) >> cellSizeLog2) - (padding >> cellSizeLog2) + 3;
+}
+
+// Сдвиг уровня level относительно предыдущего: i-я ячейка покрывает (2i - shift)-ю и (2i - shift + 1)-ю ячейки
+// предыдущего уровня (для нулевого уровня - пиксели изображения), выходящие за край индексы прижимаются к крайней
+// ячейке. Тот же сдвиг связывает уровень с предыдущим при увеличении карты порогов
+inline size_t GetLevelShift(size_t padding, size_t level) {
+    return ((padding >> level) & 1u) + ((level == 0) ? 2 : 1);
+}
+
+// Какие ячейки дополнения уровня есть в сетке дополненного изображения. На месте отсутствующих при увеличении
+// карты порогов брался порог крайней ячейки сетки, поэтому в них порог повторяет соседнюю ячейку изображения
+struct CLevelBorders {
+    bool Top;
+    bool Bottom;
+    bool Left;
+    bool Right;
+};
+CLevelBorders GetLevelBorders(size_t height, size_t width, const CImagePadding& padding, size_t level);
+void ClampBorderThresholds(const CLevelBorders& borders, uint8_t* thresholdRow, size_t width);
+
+// Строки предыдущего уровня, покрываемые строкой rowIndex уровня с заданным сдвигом
+inline size_t GetSourceTopRow(size_t rowIndex, size_t shift, size_t prevHeight) {
+    return (2 * rowIndex >= shift) ? std::min(2 * rowIndex - shift, prevHeight - 1) : 0;
+}
+inline size_t GetSourceBotRow(size_t rowIndex, size_t shift, size_t prevHeight) {
+    return (2 * rowIndex + 1 >= shift) ? std::min(2 * rowIndex + 1 - shift, prevHeight - 1) : 0;
+}
+
+// Строки предыдущего уровня пирамид, по которым строится одна строка следующего уровня
+struct CPyramidSourceRows {
+    const uint8_t* MinTop;
+    const uint8_t* MinBot;
+    const uint8_t* MaxTop;
+    const uint8_t* MaxBot;
+    const uint8_t* AvgTop;
+    const uint8_t* AvgBot;
+};
+
+// Одна строка следующего уровня всех трех пирамид за один проход по предыдущему уровню
+void BuildPyramidRow(const CPyramidSourceRows& src, uint8_t* minRow, uint8_t* maxRow, uint8_t* avgRow,
+                     size_t width, size_t prevWidth, size_t columnShift);
+
+// Правила уточнения порога по статистикам ячейки уровня. IsRefined - разброс в ячейке значим (превышает шумовой
+// порог), GetThreshold - новый порог в ней. Свое правило - любая структура с теми же двумя методами
+struct CAvgRefinement {
+    int NoiseLevel;
+    bool IsRefined(uint8_t minValue, uint8_t maxValue, uint8_t) const { return maxValue - minValue > NoiseLevel; }
+    uint8_t GetThreshold(uint8_t, uint8_t, uint8_t avgValue) const { return avgValue; }
+};
+
+struct CCenterRefinement {
+    int NoiseLevel;
+    bool IsRefined(uint8_t minValue, uint8_t maxValue, uint8_t) const { return maxValue - minValue > NoiseLevel; }
+    uint8_t GetThreshold(uint8_t minValue, uint8_t maxValue, uint8_t) const { return (maxValue + minValue + 1) / 2; }
+};
+
+struct CCenterMinWeightedRefinement {
+    int NoiseLevel;
+    bool IsRefined(uint8_t minValue, uint8_t maxValue, uint8_t) const { return maxValue - minValue > NoiseLevel; }
+    uint8_t GetThreshold(uint8_t minValue, uint8_t maxValue, uint8_t) const {
+        return (minValue + (minValue + maxValue) / 2 * 2 + 1) / 3;
+    }
+};
+
+struct CAvgCenterWeightedRefinement {
+    int NoiseLevel;
+    bool IsRefined(uint8_t minValue, uint8_t maxValue, uint8_t) const { return maxValue - minValue > NoiseLevel; }
+    uint8_t GetThreshold(uint8_t minValue, uint8_t maxValue, uint8_t avgValue) const {
+        return ((minValue + maxValue) / 2 + avgValue + 1) / 2;
+    }
+};
+
+// Шумовой порог зависит от яркости: sigmaMultiplier * sigma бина, в который попадает среднее ячейки.
+// Пороги считаются заранее для каждого значения яркости, на ячейку остается одно обращение к таблице
+struct CSeparatedNoiseRefinement {
+    int16_t NoiseLevelPerValue[256];
+
+    CSeparatedNoiseRefinement(float sigmaMultiplier, const uint64_t* sigmaPerBin);
+    bool IsRefined(uint8_t minValue, uint8_t maxValue, uint8_t avgValue) const {
+        return maxValue - minValue > NoiseLevelPerValue[avgValue];
+    }
+    uint8_t GetThreshold(uint8_t minValue, uint8_t maxValue, uint8_t) const { return (minValue + maxValue) / 2; }
+};
+
+// Уточнение строки карты порогов там, где разброс яркости значим. Инстанцируется под каждое правило: вызовы
+// правила встраиваются, а запись без ветвления позволяет компилятору векторизовать цикл
+template<typename TRefinementPolicy>
+void RefineThresholdRow(const TRefinementPolicy& policy, const uint8_t* minRow, const uint8_t* maxRow,
+                        const uint8_t* avgRow, uint8_t* thresholdRow, size_t width) {
+    for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+        const uint8_t minValue = minRow[columnIndex];
+        const uint8_t maxValue = maxRow[columnIndex];
+        const uint8_t avgValue = avgRow[columnIndex];
+        thresholdRow[columnIndex] = policy.IsRefined(minValue, maxValue, avgValue) ?
+            policy.GetThreshold(minValue, maxValue, avgValue) : thresholdRow[columnIndex];
+    }
+}
+
+// Уточнение строки карты порогов выбранным правилом: косвенный вызов один на строку, а не на ячейку
+typedef std::function<void(const uint8_t* minRow, const uint8_t* maxRow, const uint8_t* avgRow,
+                           uint8_t* thresholdRow, size_t width)> TRefineRowFunction;
+
+template<typename TRefinementPolicy>
+TRefineRowFunction MakeRefineRowFunction(const TRefinementPolicy& policy) {
+    return [policy](const uint8_t* minRow, const uint8_t* maxRow, const uint8_t* avgRow, uint8_t* thresholdRow,
+                    size_t width) {
+        RefineThresholdRow(policy, minRow, maxRow, avgRow, thresholdRow, width);
+    };
+}
+
+// Параметры уточнения порога по статистикам уровня
+struct CRefinementParameters {
+    TBinarizationMode Mode;
+    uint8_t NoiseLevel;
+    // Для режима BM_BySeparatedNoiseLevels - коэф-т и среднеквадратичные отклонения по бинам яркости
+    float NoiseSigmaMultiplier;
+    const uint64_t* SigmaPerBin;
+};
+
+// Встроенное правило уточнения для режима бинаризации
+TRefineRowFunction ChooseRefineRowFunction(const CRefinementParameters& parameters);
+
+// Строка карты меньшего уровня, покрывающая строку upRowIndex карты большего уровня,
+// и ближайшая к строке upRowIndex соседняя с ней по вертикали строка
+inline size_t GetCoveringRow(size_t upRowIndex, size_t shift) {
+    return (upRowIndex + shift) / 2;
+}
+inline size_t GetVerticalNeighbourRow(size_t upRowIndex, size_t shift, size_t currHeight) {
+    const size_t rowIndex = GetCoveringRow(upRowIndex, shift);
+    const bool isTopHalf = ((upRowIndex + shift) % 2) == 0;
+    return isTopHalf ? ((rowIndex > 0) ? rowIndex - 1 : 0) : ((rowIndex + 1 < currHeight) ? rowIndex + 1 : rowIndex);
+}
+
+// Строка карты порогов следующего (большего) уровня: currRow - строка, покрывающая ее, vertRow - ближайшая
+// к ней соседняя по вертикали строка. Веса 9-3-3-1 по ячейке, соседям по вертикали, горизонтали и диагонали
+void UpsampleThresholdRow(const uint8_t* currRow, const uint8_t* vertRow, uint8_t* upRow,
+                          size_t currWidth, size_t upWidth, size_t columnShift);
+
+// Упакованная строка ЧБ-изображения (по 8 пикселей в байт, старший бит - левый пиксель):
+// 0 - черный (яркость ниже порога), 1 - белый
+void BinarizeRow(const uint8_t* srcRow, const uint8_t* thresholdRow, uint8_t* packedRow, size_t width);
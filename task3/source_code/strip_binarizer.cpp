@@ -0,0 +1,217 @@
+#include "strip_binarizer.h"
+
+#include <cassert>
+
+void CRowRing::Reset(size_t _width, size_t _capacity) {
+    width = _width;
+    capacity = _capacity;
+    buffer.assign(width * capacity, 0);
+    rowIndices.assign(capacity, std::numeric_limits<size_t>::max());
+}
+
+uint8_t* CRowRing::PrepareRow(size_t rowIndex) {
+    const size_t slotIndex = rowIndex % capacity;
+    rowIndices[slotIndex] = rowIndex;
+    return buffer.data() + slotIndex * width;
+}
+
+const uint8_t* CRowRing::GetRow(size_t rowIndex) const {
+    const size_t slotIndex = rowIndex % capacity;
+    // Емкость буфера недостаточна, если нужная строка уже вытеснена
+    assert(rowIndices[slotIndex] == rowIndex);
+    return buffer.data() + slotIndex * width;
+}
+
+namespace {
+// Строки карт порогов запрашиваются по порядку, нужны покрывающая строка и ее соседи
+constexpr size_t thresholdRingCapacity = 4;
+}
+
+CStripBinarizer::CStripBinarizer(CGrayRowSource& _source, TBinarizationMode _mode, uint8_t _noiseLevel,
+                                 float _noiseSigmaMultiplier, size_t _storedLevel) :
+    source(_source),
+    mode(_mode),
+    noiseLevel(_noiseLevel),
+    noiseSigmaMultiplier(_noiseSigmaMultiplier),
+    width(_source.GetWidth()),
+    height(_source.GetHeight()),
+    depth(GetMaxSqueezeDegree(std::min(height, width))),
+    padding(GetImagePadding(height, width, depth)),
+    storedLevel(_storedLevel),
+    levels(depth)
+{
+    assert(depth >= 1);
+    for (size_t i = 0; i < NoiseBinsNumber; ++i) {
+        varSum[i] = 0;
+    }
+    for (size_t level = 0; level < depth; ++level) {
+        levels[level].Width = GetLevelSideSize(width, padding.Left, level);
+        levels[level].Height = GetLevelSideSize(height, padding.Top, level);
+        levels[level].RowShift = GetLevelShift(padding.Top, level);
+        levels[level].ColumnShift = GetLevelShift(padding.Left, level);
+        levels[level].Borders = GetLevelBorders(height, width, padding, level);
+    }
+    if (storedLevel == AutoStoredLevel) {
+        storedLevel = 0;
+        for (size_t level = 1; level < depth; ++level) {
+            if (estimateBuffersSize(level) < estimateBuffersSize(storedLevel)) {
+                storedLevel = level;
+            }
+        }
+    }
+    storedLevel = std::min(storedLevel, depth - 1);
+    allocateBuffers();
+}
+
+size_t CStripBinarizer::getSourceRingCapacity(size_t storedLevel) {
+    return 4 * (size_t(2) << storedLevel) + 16;
+}
+
+size_t CStripBinarizer::getStatsRingCapacity(size_t level, size_t storedLevel) {
+    return 4 * (size_t(1) << (storedLevel - level)) + 8;
+}
+
+size_t CStripBinarizer::estimateBuffersSize(size_t candidateLevel) const {
+    size_t buffersSize = getSourceRingCapacity(candidateLevel) * width + 2 * width;
+    for (size_t level = 0; level < depth; ++level) {
+        const size_t statsRowsNumber = (level < candidateLevel)
+            ? getStatsRingCapacity(level, candidateLevel) : levels[level].Height;
+        buffersSize += (3 * statsRowsNumber + thresholdRingCapacity) * levels[level].Width;
+    }
+    return buffersSize;
+}
+
+void CStripBinarizer::allocateBuffers() {
+    sourceRows.Reset(width, getSourceRingCapacity(storedLevel));
+    for (size_t level = 0; level < depth; ++level) {
+        CLevel& currLevel = levels[level];
+        const size_t statsRowsNumber = (level < storedLevel)
+            ? getStatsRingCapacity(level, storedLevel) : currLevel.Height;
+        currLevel.MinRows.Reset(currLevel.Width, statsRowsNumber);
+        currLevel.MaxRows.Reset(currLevel.Width, statsRowsNumber);
+        currLevel.AvgRows.Reset(currLevel.Width, statsRowsNumber);
+        currLevel.ThresholdRows.Reset(currLevel.Width, thresholdRingCapacity);
+    }
+    thresholdRow.resize(width);
+    packedRow.resize((width + CBWImage::PixelsPerValue - 1) / CBWImage::PixelsPerValue);
+}
+
+size_t CStripBinarizer::GetBuffersSize() const {
+    size_t buffersSize = sourceRows.GetSize() + thresholdRow.size() + packedRow.size();
+    for (const CLevel& level : levels) {
+        buffersSize += level.MinRows.GetSize() + level.MaxRows.GetSize() + level.AvgRows.GetSize();
+        buffersSize += level.ThresholdRows.GetSize();
+    }
+    return buffersSize;
+}
+
+void CStripBinarizer::Binarize(const TRowConsumer& rowConsumer) {
+    // Первый проход: грубые уровни целиком, мелкие - только в кольцевых буферах
+    if (mode == BM_BySeparatedNoiseLevels) {
+        noiseStats.reset(new CNoiseStatsAccumulator(width, height, 0, height));
+    }
+    computeStatsRows(depth - 1, levels[depth - 1].Height - 1);
+    if (noiseStats) {
+        // Шумовые пороги нужны только при уточнении карт порогов во втором проходе
+        getSourceRow(height - 1);
+        noiseStats->GetHistogram().GetSigmaPerBin(varSum);
+        noiseStats.reset();
+    }
+
+    if (!hasCustomRefinement) {
+        refineRow = ChooseRefineRowFunction(CRefinementParameters{mode, noiseLevel, noiseSigmaMultiplier, varSum});
+    }
+
+    // Второй проход: мелкие уровни строятся заново по мере надобности карт порогов
+    source.Rewind();
+    sourceRowsNumber = 0;
+    for (size_t level = 0; level < depth; ++level) {
+        if (level < storedLevel) {
+            levels[level].StatsRowsNumber = 0;
+        }
+        levels[level].ThresholdRowsNumber = 0;
+    }
+    const CLevel& firstLevel = levels[0];
+    for (size_t rowIndex = 0; rowIndex < height; ++rowIndex) {
+        const size_t coveringRowIndex = GetCoveringRow(rowIndex, firstLevel.RowShift);
+        const size_t vertRowIndex = GetVerticalNeighbourRow(rowIndex, firstLevel.RowShift, firstLevel.Height);
+        computeThresholdRows(0, std::max(coveringRowIndex, vertRowIndex));
+        UpsampleThresholdRow(firstLevel.ThresholdRows.GetRow(coveringRowIndex),
+                             firstLevel.ThresholdRows.GetRow(vertRowIndex), thresholdRow.data(),
+                             firstLevel.Width, width, firstLevel.ColumnShift);
+        BinarizeRow(getSourceRow(rowIndex), thresholdRow.data(), packedRow.data(), width);
+        rowConsumer(packedRow.data());
+    }
+}
+
+const uint8_t* CStripBinarizer::getSourceRow(size_t rowIndex) {
+    while (sourceRowsNumber <= rowIndex) {
+        CGrayValue* row = sourceRows.PrepareRow(sourceRowsNumber);
+        source.ReadRow(row);
+        if (noiseStats) {
+            noiseStats->AddRow(row);
+        }
+        ++sourceRowsNumber;
+    }
+    return sourceRows.GetRow(rowIndex);
+}
+
+void CStripBinarizer::computeStatsRows(size_t level, size_t rowIndex) {
+    CLevel& currLevel = levels[level];
+    while (currLevel.StatsRowsNumber <= rowIndex) {
+        const size_t currRowIndex = currLevel.StatsRowsNumber;
+        const size_t prevHeight = (level == 0) ? height : levels[level - 1].Height;
+        const size_t prevWidth = (level == 0) ? width : levels[level - 1].Width;
+        const size_t topRowIndex = GetSourceTopRow(currRowIndex, currLevel.RowShift, prevHeight);
+        const size_t botRowIndex = GetSourceBotRow(currRowIndex, currLevel.RowShift, prevHeight);
+        CPyramidSourceRows srcRows;
+        if (level == 0) {
+            const uint8_t* botRow = getSourceRow(botRowIndex);
+            const uint8_t* topRow = sourceRows.GetRow(topRowIndex);
+            srcRows = CPyramidSourceRows{topRow, botRow, topRow, botRow, topRow, botRow};
+        } else {
+            computeStatsRows(level - 1, botRowIndex);
+            const CLevel& prevLevel = levels[level - 1];
+            srcRows = CPyramidSourceRows{
+                prevLevel.MinRows.GetRow(topRowIndex), prevLevel.MinRows.GetRow(botRowIndex),
+                prevLevel.MaxRows.GetRow(topRowIndex), prevLevel.MaxRows.GetRow(botRowIndex),
+                prevLevel.AvgRows.GetRow(topRowIndex), prevLevel.AvgRows.GetRow(botRowIndex)};
+        }
+        BuildPyramidRow(srcRows, currLevel.MinRows.PrepareRow(currRowIndex), currLevel.MaxRows.PrepareRow(currRowIndex),
+                        currLevel.AvgRows.PrepareRow(currRowIndex), currLevel.Width, prevWidth, currLevel.ColumnShift);
+        ++currLevel.StatsRowsNumber;
+    }
+}
+
+void CStripBinarizer::computeThresholdRows(size_t level, size_t rowIndex) {
+    CLevel& currLevel = levels[level];
+    while (currLevel.ThresholdRowsNumber <= rowIndex) {
+        const size_t currRowIndex = currLevel.ThresholdRowsNumber;
+        // Строка ячеек дополнения, которой нет в сетке дополненного изображения, повторяет соседнюю строку
+        size_t srcRowIndex = currRowIndex;
+        if (currRowIndex == 0 && !currLevel.Borders.Top) {
+            srcRowIndex = 1;
+        } else if (currRowIndex == currLevel.Height - 1 && !currLevel.Borders.Bottom) {
+            srcRowIndex = currLevel.Height - 2;
+        }
+        computeStatsRows(level, srcRowIndex);
+        const uint8_t* avgRow = currLevel.AvgRows.GetRow(srcRowIndex);
+        uint8_t* currThresholdRow = currLevel.ThresholdRows.PrepareRow(currRowIndex);
+        if (level == depth - 1) {
+            // Карта порогов самого грубого уровня - его средние значения
+            std::copy_n(avgRow, currLevel.Width, currThresholdRow);
+        } else {
+            const CLevel& nextLevel = levels[level + 1];
+            const size_t coveringRowIndex = GetCoveringRow(srcRowIndex, nextLevel.RowShift);
+            const size_t vertRowIndex = GetVerticalNeighbourRow(srcRowIndex, nextLevel.RowShift, nextLevel.Height);
+            computeThresholdRows(level + 1, std::max(coveringRowIndex, vertRowIndex));
+            UpsampleThresholdRow(nextLevel.ThresholdRows.GetRow(coveringRowIndex),
+                                 nextLevel.ThresholdRows.GetRow(vertRowIndex), currThresholdRow,
+                                 nextLevel.Width, currLevel.Width, nextLevel.ColumnShift);
+            refineRow(currLevel.MinRows.GetRow(srcRowIndex), currLevel.MaxRows.GetRow(srcRowIndex), avgRow,
+                      currThresholdRow, currLevel.Width);
+        }
+        ClampBorderThresholds(currLevel.Borders, currThresholdRow, currLevel.Width);
+        ++currLevel.ThresholdRowsNumber;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "binarizer.h"
+#include "noise_stats.h"
+
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Кольцевой буфер последних строк одного уровня: строка rowIndex хранится в ячейке rowIndex % capacity
+class CRowRing {
+public:
+    void Reset(size_t width, size_t capacity);
+    // Место под строку rowIndex (вытесняет строку rowIndex - capacity)
+    uint8_t* PrepareRow(size_t rowIndex);
+    // Ранее подготовленная строка, которая еще не вытеснена
+    const uint8_t* GetRow(size_t rowIndex) const;
+    size_t GetSize() const { return buffer.size(); }
+
+private:
+    size_t width{0};
+    size_t capacity{0};
+    std::vector<uint8_t> buffer;
+    std::vector<size_t> rowIndices;
+};
+
+// Потоковая бинаризация сканов, которые неудобно держать в памяти целиком (например, A0 в 600 dpi).
+// Результат совпадает с CPyramidBinarizer, источник читается построчно дважды:
+// - первый проход строит пирамиды каскадом строк и сохраняет целиком только грубые уровни, начиная со storedLevel;
+// - второй проход заново строит мелкие уровни в кольцевых буферах, карта порогов каждого уровня тоже считается
+//   построчно по мере надобности, а готовые строки результата сразу отдаются потребителю.
+// Статистики шума для режима BM_BySeparatedNoiseLevels копятся скользящим окном во время первого прохода.
+// Память - O(width * 2^storedLevel) на кольцевые буферы и O(width * height / 4^storedLevel) на грубые уровни,
+// storedLevel по умолчанию выбирается по размерам изображения так, чтобы сумма была минимальной
+class CStripBinarizer {
+public:
+    static constexpr size_t AutoStoredLevel = std::numeric_limits<size_t>::max();
+    // Получатель строк результата, упакованных так же, как строки CBWImage
+    typedef std::function<void(const CBWValue* row)> TRowConsumer;
+
+    CStripBinarizer(CGrayRowSource& source, TBinarizationMode mode = CPyramidBinarizer::DefaultMode,
+                    uint8_t noiseLevel = CPyramidBinarizer::NoiseLevel,
+                    float noiseSigmaMultiplier = CPyramidBinarizer::SigmaMultiplier,
+                    size_t storedLevel = AutoStoredLevel);
+
+    void Binarize(const TRowConsumer& rowConsumer);
+    // Объем всех буферов бинаризатора, байт
+    size_t GetBuffersSize() const;
+    size_t GetStoredLevel() const { return storedLevel; }
+    // Свое правило уточнения порога вместо правила режима (см. CCenterRefinement)
+    template<typename TRefinementPolicy>
+    void SetRefinementPolicy(const TRefinementPolicy& policy);
+
+private:
+    // Уровень пирамид: строки статистик (минимумы, максимумы, средние) и карты порогов
+    struct CLevel {
+        size_t Width{0};
+        size_t Height{0};
+        // Сдвиг относительно предыдущего уровня (см. GetLevelShift)
+        size_t RowShift{0};
+        size_t ColumnShift{0};
+        // Ячейки дополнения, которые есть в сетке дополненного изображения
+        CLevelBorders Borders{true, true, true, true};
+        CRowRing MinRows;
+        CRowRing MaxRows;
+        CRowRing AvgRows;
+        // Число уже построенных строк статистик и карты порогов
+        size_t StatsRowsNumber{0};
+        CRowRing ThresholdRows;
+        size_t ThresholdRowsNumber{0};
+    };
+
+    CGrayRowSource& source;
+    const TBinarizationMode mode;
+    const uint8_t noiseLevel;
+    const float noiseSigmaMultiplier;
+    const size_t width;
+    const size_t height;
+    const size_t depth;
+    const CImagePadding padding;
+    // Первый уровень, статистики которого хранятся целиком
+    size_t storedLevel;
+    std::vector<CLevel> levels;
+    // Последние прочитанные строки источника
+    CRowRing sourceRows;
+    size_t sourceRowsNumber{0};
+    // Текущие строки итоговой карты порогов и результата
+    std::vector<uint8_t> thresholdRow;
+    std::vector<CBWValue> packedRow;
+    // Для режима BM_BySeparatedNoiseLevels: статистики шума копятся по строкам первого прохода
+    std::unique_ptr<CNoiseStatsAccumulator> noiseStats;
+    uint64_t varSum[NoiseBinsNumber];
+    // Построчное уточнение карты порогов: правило режима или заданное через SetRefinementPolicy
+    TRefineRowFunction refineRow;
+    bool hasCustomRefinement{false};
+
+    // Емкости кольцевых буферов при заданном storedLevel (с запасом на отставание построения карт порогов)
+    static size_t getSourceRingCapacity(size_t storedLevel);
+    static size_t getStatsRingCapacity(size_t level, size_t storedLevel);
+    size_t estimateBuffersSize(size_t storedLevel) const;
+    void allocateBuffers();
+
+    const uint8_t* getSourceRow(size_t rowIndex);
+    // Достроить статистики/карту порогов уровня level до строки rowIndex включительно
+    void computeStatsRows(size_t level, size_t rowIndex);
+    void computeThresholdRows(size_t level, size_t rowIndex);
+};
+
+template<typename TRefinementPolicy>
+void CStripBinarizer::SetRefinementPolicy(const TRefinementPolicy& policy) {
+    refineRow = MakeRefineRowFunction(policy);
+    hasCustomRefinement = true;
+}
@@ -0,0 +1,72 @@
+#include "thread_pool.h"
+
+CThreadPool::CThreadPool(size_t threadsNumber) {
+    const size_t workersNumber = ::GetThreadsNumber(threadsNumber) - 1;
+    workers.reserve(workersNumber);
+    for (size_t workerIndex = 0; workerIndex < workersNumber; ++workerIndex) {
+        workers.emplace_back(&CThreadPool::workerLoop, this);
+    }
+}
+
+CThreadPool::~CThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isStopping = true;
+    }
+    jobStarted.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void CThreadPool::run(size_t tasksNumber, TTaskInvoker invoker, const void* task) {
+    if (workers.empty() || tasksNumber <= 1) {
+        for (size_t taskIndex = 0; taskIndex < tasksNumber; ++taskIndex) {
+            invoker(task, taskIndex);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobInvoker = invoker;
+        jobTask = task;
+        jobTasksNumber = tasksNumber;
+        nextTaskIndex = 0;
+        busyWorkersNumber = workers.size();
+        ++jobGeneration;
+    }
+    jobStarted.notify_all();
+    processTasks(invoker, task, tasksNumber);
+    // Задачи могут еще выполняться другими потоками, а task живет на стеке вызывающего
+    std::unique_lock<std::mutex> lock(mutex);
+    jobFinished.wait(lock, [this]() { return busyWorkersNumber == 0; });
+}
+
+void CThreadPool::processTasks(TTaskInvoker invoker, const void* task, size_t tasksNumber) {
+    for (size_t taskIndex = nextTaskIndex++; taskIndex < tasksNumber; taskIndex = nextTaskIndex++) {
+        invoker(task, taskIndex);
+    }
+}
+
+void CThreadPool::workerLoop() {
+    size_t processedGeneration = 0;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobStarted.wait(lock, [&]() { return isStopping || jobGeneration != processedGeneration; });
+        if (isStopping) {
+            return;
+        }
+        processedGeneration = jobGeneration;
+        const TTaskInvoker invoker = jobInvoker;
+        const void* task = jobTask;
+        const size_t tasksNumber = jobTasksNumber;
+        lock.unlock();
+
+        processTasks(invoker, task, tasksNumber);
+
+        lock.lock();
+        if (--busyWorkersNumber == 0) {
+            jobFinished.notify_one();
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Число потоков по умолчанию (0 в параметрах означает "по числу ядер")
+inline size_t GetThreadsNumber(size_t requestedThreadsNumber = 0) {
+    if (requestedThreadsNumber != 0) {
+        return requestedThreadsNumber;
+    }
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Пул потоков для обработки изображения полосами строк.
+// Потоки создаются один раз и переиспользуются между уровнями пирамиды, вызывающий поток тоже выполняет задачи.
+// ParallelFor нельзя вызывать одновременно из нескольких потоков и изнутри задачи того же пула
+class CThreadPool {
+public:
+    explicit CThreadPool(size_t threadsNumber = 0);
+    ~CThreadPool();
+    CThreadPool(const CThreadPool&) = delete;
+    CThreadPool& operator=(const CThreadPool&) = delete;
+
+    size_t GetThreadsNumber() const { return workers.size() + 1; }
+    // Выполнение независимых задач с индексами [0, tasksNumber), задачи раздаются потокам динамически
+    template<typename TTaskFunction>
+    void ParallelFor(size_t tasksNumber, const TTaskFunction& task);
+
+private:
+    typedef void (*TTaskInvoker)(const void* task, size_t taskIndex);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobStarted;
+    std::condition_variable jobFinished;
+    // Текущее задание: функция-задача, число задач и индекс следующей невыполненной задачи
+    TTaskInvoker jobInvoker{nullptr};
+    const void* jobTask{nullptr};
+    size_t jobTasksNumber{0};
+    std::atomic<size_t> nextTaskIndex{0};
+    // Номер задания - по его смене потоки узнают о новой работе
+    size_t jobGeneration{0};
+    size_t busyWorkersNumber{0};
+    bool isStopping{false};
+
+    void run(size_t tasksNumber, TTaskInvoker invoker, const void* task);
+    void processTasks(TTaskInvoker invoker, const void* task, size_t tasksNumber);
+    void workerLoop();
+};
+
+template<typename TTaskFunction>
+void CThreadPool::ParallelFor(size_t tasksNumber, const TTaskFunction& task) {
+    const TTaskInvoker invoker = [](const void* taskPtr, size_t taskIndex) {
+        (*static_cast<const TTaskFunction*>(taskPtr))(taskIndex);
+    };
+    run(tasksNumber, invoker, &task);
+}
@@ -0,0 +1,271 @@
+#include "tiff_io.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <exception>
+#include <stdexcept>
+#include <tiffio.h>
+
+TTiffCompression ChooseTiffCompression(const std::string& compressionName) {
+    if (compressionName == "none") {
+        return TC_None;
+    } else if (compressionName == "packbits") {
+        return TC_PackBits;
+    } else if (compressionName == "g3") {
+        return TC_Fax3;
+    } else if (compressionName == "g4") {
+        return TC_Fax4;
+    } else {
+        throw std::runtime_error("Unknown TIFF compression " + compressionName + " (none, packbits, g3 or g4 allowed)");
+    }
+}
+
+namespace {
+// Полос в пачке на поток: полосы сжимаются с разной скоростью, потоки разбирают их динамически
+constexpr size_t stripsPerThread = 4;
+
+uint16_t getCompressionTag(TTiffCompression compression) {
+    switch(compression) {
+        case TC_None:
+            return COMPRESSION_NONE;
+        case TC_PackBits:
+            return COMPRESSION_PACKBITS;
+        case TC_Fax3:
+            return COMPRESSION_CCITTFAX3;
+        case TC_Fax4:
+            return COMPRESSION_CCITTFAX4;
+    }
+    assert(false);
+    return COMPRESSION_NONE;
+}
+
+void setBWTiffFields(TIFF* tiffFile, size_t width, size_t height, size_t rowsPerStrip, TTiffCompression compression) {
+    TIFFSetField(tiffFile, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width));
+    TIFFSetField(tiffFile, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(height));
+    TIFFSetField(tiffFile, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiffFile, TIFFTAG_BITSPERSAMPLE, 1);
+    TIFFSetField(tiffFile, TIFFTAG_COMPRESSION, getCompressionTag(compression));
+    TIFFSetField(tiffFile, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiffFile, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+    TIFFSetField(tiffFile, TIFFTAG_ROWSPERSTRIP, static_cast<uint32_t>(rowsPerStrip));
+    TIFFSetField(tiffFile, TIFFTAG_XRESOLUTION, 300.0f);
+    TIFFSetField(tiffFile, TIFFTAG_YRESOLUTION, 300.0f);
+}
+
+// TIFF в памяти для сжатия одной полосы через libtiff независимо от остальных
+struct CMemoryTiffStream {
+    std::vector<uint8_t> Data;
+    size_t Position{0};
+};
+
+tmsize_t readMemoryTiff(thandle_t handle, void* buffer, tmsize_t size) {
+    auto& stream = *static_cast<CMemoryTiffStream*>(handle);
+    const size_t position = std::min(stream.Position, stream.Data.size());
+    const size_t readSize = std::min(static_cast<size_t>(size), stream.Data.size() - position);
+    std::copy_n(stream.Data.data() + stream.Position, readSize, static_cast<uint8_t*>(buffer));
+    stream.Position += readSize;
+    return static_cast<tmsize_t>(readSize);
+}
+
+tmsize_t writeMemoryTiff(thandle_t handle, void* buffer, tmsize_t size) {
+    auto& stream = *static_cast<CMemoryTiffStream*>(handle);
+    if (stream.Data.size() < stream.Position + size) {
+        stream.Data.resize(stream.Position + size);
+    }
+    std::copy_n(static_cast<const uint8_t*>(buffer), size, stream.Data.data() + stream.Position);
+    stream.Position += size;
+    return size;
+}
+
+toff_t seekMemoryTiff(thandle_t handle, toff_t offset, int whence) {
+    auto& stream = *static_cast<CMemoryTiffStream*>(handle);
+    if (whence == SEEK_CUR) {
+        offset += stream.Position;
+    } else if (whence == SEEK_END) {
+        offset += stream.Data.size();
+    }
+    stream.Position = static_cast<size_t>(offset);
+    return offset;
+}
+
+int closeMemoryTiff(thandle_t) {
+    return 0;
+}
+
+toff_t getMemoryTiffSize(thandle_t handle) {
+    return static_cast<CMemoryTiffStream*>(handle)->Data.size();
+}
+
+int mapMemoryTiff(thandle_t, void**, toff_t*) {
+    return 0;
+}
+
+void unmapMemoryTiff(thandle_t, void*, toff_t) {
+}
+
+TIFF* openMemoryTiff(CMemoryTiffStream& stream, const char* mode) {
+    stream.Position = 0;
+    return TIFFClientOpen("strip", mode, &stream, readMemoryTiff, writeMemoryTiff, seekMemoryTiff, closeMemoryTiff,
+                          getMemoryTiffSize, mapMemoryTiff, unmapMemoryTiff);
+}
+
+// Сжатие полосы из rowsNumber упакованных строк (буфер строк может быть испорчен libtiff).
+// Вызывается из потоков пула, поэтому об ошибке сообщает результатом, а не исключением
+bool encodeStrip(uint8_t* rows, size_t width, size_t rowsNumber, TTiffCompression compression,
+                 std::vector<uint8_t>& encodedStrip) {
+    const size_t stripSize = rowsNumber * ((width + 7) / 8);
+    if (compression == TC_None) {
+        encodedStrip.assign(rows, rows + stripSize);
+        return true;
+    }
+    // Полоса записывается в отдельный TIFF в памяти, сжатые данные вычитываются из него обратно как есть
+    CMemoryTiffStream stream;
+    TIFF* stripFile = openMemoryTiff(stream, "w");
+    if (stripFile == nullptr) {
+        return false;
+    }
+    setBWTiffFields(stripFile, width, rowsNumber, rowsNumber, compression);
+    const bool isEncoded = TIFFWriteEncodedStrip(stripFile, 0, rows, static_cast<tmsize_t>(stripSize)) >= 0;
+    TIFFClose(stripFile);
+    stripFile = isEncoded ? openMemoryTiff(stream, "r") : nullptr;
+    if (stripFile == nullptr) {
+        return false;
+    }
+    encodedStrip.resize(static_cast<size_t>(TIFFRawStripSize(stripFile, 0)));
+    const tmsize_t encodedSize = static_cast<tmsize_t>(encodedStrip.size());
+    const tmsize_t readSize = TIFFReadRawStrip(stripFile, 0, encodedStrip.data(), encodedSize);
+    TIFFClose(stripFile);
+    return readSize == encodedSize;
+}
+}
+
+CBWTiffWriter::CBWTiffWriter(const std::string& targetFilePath, size_t _width, size_t _height,
+                             const CBWTiffOptions& _options) :
+    tiffFile(TIFFOpen(targetFilePath.c_str(), "w")),
+    width(_width),
+    height(_height),
+    options(_options),
+    packedRowSize((_width + CBWImage::PixelsPerValue - 1) / CBWImage::PixelsPerValue),
+    threadPool(_options.ThreadsNumber)
+{
+    if (tiffFile == nullptr) {
+        throw std::runtime_error("Can't open " + targetFilePath + " for writing");
+    }
+    assert(options.RowsPerStrip > 0);
+    setBWTiffFields(tiffFile, width, height, options.RowsPerStrip, options.Compression);
+    const size_t stripsNumber = (height + options.RowsPerStrip - 1) / options.RowsPerStrip;
+    batchStripsNumber = std::max<size_t>(1, std::min(stripsNumber, threadPool.GetThreadsNumber() * stripsPerThread));
+    pendingRows.resize(batchStripsNumber * options.RowsPerStrip * packedRowSize);
+    encodedStrips.resize(batchStripsNumber);
+}
+
+CBWTiffWriter::~CBWTiffWriter() {
+    // При раскрутке стека после ошибки записи или бинаризации файл остается недописанным
+    assert(rowIndex == height || std::uncaught_exceptions() > 0);
+    TIFFClose(tiffFile);
+}
+
+void CBWTiffWriter::WriteRow(const CBWValue* row) {
+    assert(rowIndex < height);
+    std::copy_n(row, packedRowSize, pendingRows.data() + pendingRowsNumber * packedRowSize);
+    ++pendingRowsNumber;
+    ++rowIndex;
+    if (pendingRowsNumber == batchStripsNumber * options.RowsPerStrip || rowIndex == height) {
+        flushStrips();
+    }
+}
+
+void CBWTiffWriter::flushStrips() {
+    const size_t stripsNumber = (pendingRowsNumber + options.RowsPerStrip - 1) / options.RowsPerStrip;
+    std::atomic<bool> isEncodingFailed{false};
+    threadPool.ParallelFor(stripsNumber, [&](size_t stripIndex) {
+        const size_t beginRow = stripIndex * options.RowsPerStrip;
+        const size_t rowsNumber = std::min(options.RowsPerStrip, pendingRowsNumber - beginRow);
+        if (!encodeStrip(pendingRows.data() + beginRow * packedRowSize, width, rowsNumber, options.Compression,
+                         encodedStrips[stripIndex])) {
+            isEncodingFailed = true;
+        }
+    });
+    if (isEncodingFailed) {
+        throw std::runtime_error("Can't encode TIFF strip");
+    }
+    for (size_t stripIndex = 0; stripIndex < stripsNumber; ++stripIndex) {
+        std::vector<uint8_t>& encodedStrip = encodedStrips[stripIndex];
+        if (TIFFWriteRawStrip(tiffFile, static_cast<tstrip_t>(nextStripIndex++), encodedStrip.data(),
+                              static_cast<tmsize_t>(encodedStrip.size())) < 0) {
+            throw std::runtime_error("Can't write TIFF strip");
+        }
+    }
+    pendingRowsNumber = 0;
+}
+
+void SaveBWImageToTiff(const CBWImage& image, const std::string& targetFilePath, const CBWTiffOptions& options) {
+    CBWTiffWriter writer(targetFilePath, image.GetWidth(), image.GetHeight(), options);
+    const size_t rowSize = image.GetRowSize();
+    for (size_t rowIndex = 0; rowIndex < image.GetHeight(); ++rowIndex) {
+        writer.WriteRow(image.GetBuffer() + rowIndex * rowSize);
+    }
+}
+
+CTiffGrayRowSource::CTiffGrayRowSource(const std::string& sourceFilePath) :
+    tiffFile(TIFFOpen(sourceFilePath.c_str(), "r"))
+{
+    if (tiffFile == nullptr) {
+        throw std::runtime_error("Can't open " + sourceFilePath);
+    }
+    uint32_t tiffWidth = 0;
+    uint32_t tiffHeight = 0;
+    uint16_t bitsPerSample = 0;
+    uint16_t samplesPerPixel = 0;
+    uint16_t planarConfig = PLANARCONFIG_CONTIG;
+    TIFFGetField(tiffFile, TIFFTAG_IMAGEWIDTH, &tiffWidth);
+    TIFFGetField(tiffFile, TIFFTAG_IMAGELENGTH, &tiffHeight);
+    TIFFGetFieldDefaulted(tiffFile, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+    TIFFGetFieldDefaulted(tiffFile, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+    TIFFGetFieldDefaulted(tiffFile, TIFFTAG_PLANARCONFIG, &planarConfig);
+    if (bitsPerSample != 8 || (samplesPerPixel != 1 && samplesPerPixel != 3) || planarConfig != PLANARCONFIG_CONTIG) {
+        TIFFClose(tiffFile);
+        throw std::runtime_error(sourceFilePath + ": only 8-bit gray or interleaved RGB TIFF is supported");
+    }
+    width = tiffWidth;
+    height = tiffHeight;
+    componentsNumber = samplesPerPixel;
+    if (componentsNumber == ComponentsNumber<IC_RGB>) {
+        colorRow = new CRGBValue[width];
+    }
+}
+
+CTiffGrayRowSource::~CTiffGrayRowSource() {
+    TIFFClose(tiffFile);
+    delete [] colorRow;
+}
+
+void CTiffGrayRowSource::ReadRow(CGrayValue* row) {
+    assert(rowIndex < height);
+    void* scanline = colorRow == nullptr ? static_cast<void*>(row) : static_cast<void*>(colorRow);
+    if (TIFFReadScanline(tiffFile, scanline, static_cast<uint32_t>(rowIndex)) < 0) {
+        throw std::runtime_error("Can't read TIFF row " + std::to_string(rowIndex));
+    }
+    if (colorRow != nullptr) {
+        // В TIFF компоненты идут в порядке RGB, а изображения хранятся в порядке BGR
+        for (size_t columnIndex = 0; columnIndex < width; ++columnIndex) {
+            std::swap(colorRow[columnIndex][RGBC_Blue], colorRow[columnIndex][RGBC_Red]);
+        }
+        ConvertRGBRowToGray(colorRow, row, width);
+    }
+    ++rowIndex;
+}
+
+bool IsTiffPath(const std::string& path) {
+    const size_t dotPos = path.rfind('.');
+    if (dotPos == std::string::npos) {
+        return false;
+    }
+    std::string extension = path.substr(dotPos + 1);
+    for (auto& symbol : extension) {
+        symbol = static_cast<char>(std::tolower(static_cast<unsigned char>(symbol)));
+    }
+    return extension == "tif" || extension == "tiff";
+}
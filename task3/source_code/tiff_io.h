@@ -0,0 +1,89 @@
+#pragma once
+
+#include "image.h"
+#include "thread_pool.h"
+
+#include <vector>
+
+// Построчные чтение и запись TIFF через libtiff: изображение не требуется держать в памяти целиком
+struct tiff;
+
+// Сжатие ЧБ TIFF
+enum TTiffCompression {
+    TC_None,
+    TC_PackBits,
+    // CCITT Group 3 и Group 4
+    TC_Fax3,
+    TC_Fax4
+};
+
+TTiffCompression ChooseTiffCompression(const std::string& compressionName);
+
+// Параметры записи ЧБ TIFF
+struct CBWTiffOptions {
+    TTiffCompression Compression{TC_Fax4};
+    // Строк в полосе (strip): полосы сжимаются независимо друг от друга
+    size_t RowsPerStrip{128};
+    // Число потоков сжатия полос (0 - по числу ядер)
+    size_t ThreadsNumber{0};
+};
+
+// Запись ЧБ-изображения в 1bit-depth TIFF по мере готовности строк.
+// Строки копятся в пачку полос, полосы пачки сжимаются в пуле потоков, каждая в свой TIFF в памяти,
+// и записываются в файл по порядку уже сжатыми
+class CBWTiffWriter {
+public:
+    CBWTiffWriter(const std::string& targetFilePath, size_t width, size_t height,
+                  const CBWTiffOptions& options = CBWTiffOptions());
+    ~CBWTiffWriter();
+    CBWTiffWriter(const CBWTiffWriter&) = delete;
+    CBWTiffWriter& operator=(const CBWTiffWriter&) = delete;
+
+    // Записать очередную упакованную строку (в формате буфера CBWImage)
+    void WriteRow(const CBWValue* packedRow);
+
+private:
+    tiff* tiffFile;
+    const size_t width;
+    const size_t height;
+    const CBWTiffOptions options;
+    const size_t packedRowSize;
+    size_t rowIndex{0};
+    // Строки текущей пачки полос (libtiff может менять переданный ему буфер, поэтому строки копируются)
+    std::vector<uint8_t> pendingRows;
+    size_t pendingRowsNumber{0};
+    size_t batchStripsNumber;
+    size_t nextStripIndex{0};
+    std::vector<std::vector<uint8_t>> encodedStrips;
+    CThreadPool threadPool;
+
+    void flushStrips();
+};
+
+// Сохранение ЧБ-изображения с заданными параметрами (CBWImage::SaveToFile - с параметрами по умолчанию)
+void SaveBWImageToTiff(const CBWImage& image, const std::string& targetFilePath,
+                       const CBWTiffOptions& options = CBWTiffOptions());
+
+// Построчное чтение 8-битного серого или RGB TIFF с переводом в серый
+class CTiffGrayRowSource : public CGrayRowSource {
+public:
+    explicit CTiffGrayRowSource(const std::string& sourceFilePath);
+    ~CTiffGrayRowSource() override;
+
+    size_t GetWidth() const override { return width; }
+    size_t GetHeight() const override { return height; }
+    void Rewind() override { rowIndex = 0; }
+    void ReadRow(CGrayValue* row) override;
+
+private:
+    tiff* tiffFile;
+    size_t width{0};
+    size_t height{0};
+    size_t componentsNumber{1};
+    size_t rowIndex{0};
+    // Строка RGB-изображения в порядке BGR
+    CRGBValue* colorRow{nullptr};
+};
+
+// Путь к файлу TIFF (по расширению)
+bool IsTiffPath(const std::string& path);